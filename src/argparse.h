@@ -2,6 +2,7 @@
 
 #include <string>
 #include <cstring>
+#include <cctype>
 #include <vector>
 #include <map>
 #include <variant>
@@ -42,7 +43,7 @@ std::string alias2key(std::string alias);
 
 // Check if the string is valid for the given type
 // 'true', '1', 'false', '0' for BOOL
-// '123' for INT
+// '123', '0x7b' for INT
 // '123.45' for FLOAT
 bool is_valid_type(std::string str, ArgType_t type);
 
@@ -154,6 +155,15 @@ public:
                 continue;
             }
 
+            // Split '--opt=value' into '--opt' and 'value'
+            size_t eq = arg.find('=');
+            bool has_value = arg.rfind("--", 0) == 0 && eq != std::string::npos;
+            std::string value;
+            if (has_value) {
+                value = arg.substr(eq + 1);
+                arg = arg.substr(0, eq);
+            }
+
             // Check for match
             bool found = false;
             Argument_t *argp=nullptr;
@@ -175,11 +185,20 @@ public:
             }
 
             if (argp->type == BOOL) {
+                // A flag takes no value, except an explicit '--flag=true' or '--flag=false'
+                if (has_value && !is_valid_type(value, BOOL)) {
+                    fprintf(stderr, "ArgParse error: Invalid value for argument %s: %s\n", arg.c_str(), value.c_str());
+                    return -1;
+                }
                 parsed_args_[argp->key].type = BOOL;
-                parsed_args_[argp->key].value.as_bool = true;
+                parsed_args_[argp->key].value.as_bool = !has_value || value == "true" || value == "1";
                 continue;
             }
-            else if (argp->type == INT) {
+            if (has_value) {
+                args_.insert(args_.begin() + i, value);
+            }
+
+            if (argp->type == INT) {
                 if (i >= args_.size()) {
                     fprintf(stderr, "ArgParse error: Missing value for argument %s\n", arg.c_str());
                     return -1;
@@ -334,6 +353,14 @@ bool is_valid_type(std::string str, ArgType_t type) {
         return (str == "true" || str == "1" || str == "false" || str == "0");
     }
     else if (type == INT) {
+        if (str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+            for (size_t i=2; i<str.size(); i++) {
+                if (!isxdigit((unsigned char)str[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
         for (size_t i=0; i<str.size(); i++) {
             if (str[i] < '0' || str[i] > '9') {
                 return false;
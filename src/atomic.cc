@@ -0,0 +1,226 @@
+#include "core.h"
+#include "exec.h"
+
+// RV32A on top of host atomics: aligned RAM words are accessed with __atomic builtins,
+// so harts running on different host threads see each AMO as one indivisible access.
+// Misaligned words, I/O registers and watched pages are emulated with plain loads and
+// stores (I/O accesses are serialized by the bus lock anyway).
+//
+// LR/SC reservations are broken by any store to the word, even one writing back the same
+// value. The first LR to a page takes it out of the write TLBs of every hart, so that from
+// then on all of its stores, AMOs and SCs go through the store sequence number of the word
+// (Memory::store_seq). A sequence number is odd while a write holds it: it serves as the
+// word's lock, and an SC succeeds only if it is still the one its LR read.
+
+// Take the store sequence at seq for a write; returns its even value before the write
+static uint32_t lock_seq(uint32_t *seq) {
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+    while ((s & 1) || !__atomic_compare_exchange_n(seq, &s, s + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if (s & 1) {
+            s = __atomic_load_n(seq, __ATOMIC_RELAXED); // Another hart is writing the word
+        }
+    }
+    return s;
+}
+
+// Release a store sequence taken by lock_seq() at s, after a write
+static void unlock_seq(uint32_t *seq, uint32_t s) {
+    __atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+}
+
+// Result of an AMO on old
+static uint32_t amo_result(int op, uint32_t old, uint32_t value) {
+    switch (op) {
+        case OP_AMOADD_W:  return old + value;
+        case OP_AMOXOR_W:  return old ^ value;
+        case OP_AMOAND_W:  return old & value;
+        case OP_AMOOR_W:   return old | value;
+        case OP_AMOMIN_W:  return (int32_t)old < (int32_t)value ? old : value;
+        case OP_AMOMAX_W:  return (int32_t)old > (int32_t)value ? old : value;
+        case OP_AMOMINU_W: return old < value ? old : value;
+        case OP_AMOMAXU_W: return old > value ? old : value;
+        default:           return value; // AMOSWAP
+    }
+}
+
+void Core::map_writes(uint32_t address, uint8_t *host) {
+    tlb_entry_t &e = tlb_wr[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    if (mem->reservation_page(address)) {
+        return;
+    }
+    e.host = host;
+    __atomic_store_n(&e.tag, address & ~(PAGE_SIZE - 1), __ATOMIC_SEQ_CST);
+    if (mem->reservation_page(address)) {
+        // A first LR on another hart marked the page meanwhile: it may not have seen this entry
+        __atomic_store_n(&e.tag, TLB_INVALID, __ATOMIC_RELAXED);
+    }
+}
+
+void Core::reserved_store(uint8_t *host, uint32_t address, uint32_t value, unsigned size) {
+    // A store may straddle two words: take their sequences in index order
+    uint32_t *first = mem->store_seq(address);
+    uint32_t *last = mem->store_seq(address + size - 1);
+    if (last < first) {
+        std::swap(first, last);
+    }
+    uint32_t s1 = lock_seq(first);
+    uint32_t s2 = (last != first) ? lock_seq(last) : 0;
+    for (unsigned i = 0; i < size; ++i) {
+        __atomic_store_n(host + i, (uint8_t)(value >> (8 * i)), __ATOMIC_RELAXED);
+    }
+    if (last != first) {
+        unlock_seq(last, s2);
+    }
+    unlock_seq(first, s1);
+}
+
+uint32_t *Core::atomic_word(uint32_t address) {
+    if (address & 0b11) {
+        return nullptr;
+    }
+    tlb_entry_t &e = tlb_wr[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    if (e.tag == (address & ~(PAGE_SIZE - 1))) {
+        return (uint32_t*)(e.host + (address & (PAGE_SIZE - 1)));
+    }
+    if ((bus && bus->is_io(address)) || watch_pages[address >> PAGE_SHIFT] || mem->reservation_page(address)) {
+        return nullptr;
+    }
+
+    uint8_t *host = mem->page(address);
+    if (!code_pages[address >> PAGE_SHIFT]) {
+        map_writes(address, host);
+    }
+    return (uint32_t*)(host + (address & (PAGE_SIZE - 1)));
+}
+
+xlen_t Core::amo(int op, uint32_t address, xlen_t value) {
+    uint32_t *word = atomic_word(address);
+    uint32_t old;
+    if (!word) {
+        if (!(address & 0b11) && !(bus && bus->is_io(address)) && mem->reservation_page(address)) {
+            // The word's store sequence makes the read-modify-write indivisible
+            uint32_t *seq = mem->store_seq(address);
+            uint32_t s = lock_seq(seq);
+            uint32_t *host = (uint32_t*)(mem->page(address) + (address & (PAGE_SIZE - 1)));
+            old = __atomic_load_n(host, __ATOMIC_RELAXED);
+            uint32_t result = amo_result(op, old, value);
+            __atomic_store_n(host, result, __ATOMIC_RELAXED);
+            unlock_seq(seq, s);
+            if (watch_pages[address >> PAGE_SHIFT] & WATCH_READ) {
+                check_watch(address, 4, WATCH_READ, old);
+            }
+            if (watch_pages[address >> PAGE_SHIFT] & WATCH_WRITE) {
+                check_watch(address, 4, WATCH_WRITE, result);
+            }
+        } else {
+            old = mem_load<uint32_t>(address);
+            mem_store<uint32_t>(address, amo_result(op, old, value));
+            return old;
+        }
+    } else {
+        switch (op) {
+            case OP_AMOADD_W: old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST); break;
+            case OP_AMOXOR_W: old = __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST); break;
+            case OP_AMOAND_W: old = __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST); break;
+            case OP_AMOOR_W:  old = __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST); break;
+            case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W: {
+                // No host instruction for these: retry until no other hart wrote in between
+                old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+                while (!__atomic_compare_exchange_n(word, &old, amo_result(op, old, value), false,
+                                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                }
+                break;
+            }
+            default:
+                old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+                break;
+        }
+    }
+    if (code_pages[address >> PAGE_SHIFT]) {
+        invalidate_code(address, 4);
+    }
+    return old;
+}
+
+xlen_t Core::load_reserved(uint32_t address) {
+    resv_valid = true;
+    resv_addr = address;
+    resv_seq_valid = !(address & 0b11) && !(bus && bus->is_io(address));
+    if (!resv_seq_valid) {
+        // Device registers and misaligned words: the SC compares the value
+        resv_value = mem_load<uint32_t>(address);
+        return resv_value;
+    }
+
+    if (mem->mark_reservation_page(address)) {
+        // First LR to the page: unmap it for direct writes on every hart. A direct store
+        // already under way on another hart can still land; the SC's value check catches it
+        // unless it writes the same value.
+        uint32_t page = address & ~(PAGE_SIZE - 1);
+        Core *self = this;
+        for (Core *core : bus ? bus->get_cores() : std::vector<Core*>{self}) {
+            tlb_entry_t &e = core->tlb_wr[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+            if (__atomic_load_n(&e.tag, __ATOMIC_SEQ_CST) == page) {
+                __atomic_store_n(&e.tag, TLB_INVALID, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    // Read the word between two identical, even readings of its store sequence
+    uint32_t *seq = mem->store_seq(address);
+    uint32_t *host = (uint32_t*)(mem->page(address) + (address & (PAGE_SIZE - 1)));
+    uint32_t value;
+    while (true) {
+        resv_seq = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (resv_seq & 1) {
+            continue;
+        }
+        value = __atomic_load_n(host, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == resv_seq) {
+            break;
+        }
+    }
+    if (watch_pages[address >> PAGE_SHIFT] & WATCH_READ) {
+        check_watch(address, 4, WATCH_READ, value);
+    }
+    resv_value = value;
+    return value;
+}
+
+xlen_t Core::store_conditional(uint32_t address, xlen_t value) {
+    bool valid = resv_valid && resv_addr == address;
+    resv_valid = false;
+    if (!valid) {
+        return 1;
+    }
+
+    if (!resv_seq_valid) {
+        if (mem_load<uint32_t>(address) != resv_value) {
+            return 1;
+        }
+        mem_store<uint32_t>(address, value);
+        return 0;
+    }
+
+    // Take the store sequence only if no store was made since the LR
+    uint32_t *seq = mem->store_seq(address);
+    uint32_t expected = resv_seq;
+    if (!__atomic_compare_exchange_n(seq, &expected, resv_seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+    uint32_t *host = (uint32_t*)(mem->page(address) + (address & (PAGE_SIZE - 1)));
+    if (__atomic_load_n(host, __ATOMIC_RELAXED) != resv_value) {
+        __atomic_store_n(seq, resv_seq, __ATOMIC_RELEASE); // Written directly before the page was unmapped
+        return 1;
+    }
+    __atomic_store_n(host, (uint32_t)value, __ATOMIC_RELAXED);
+    unlock_seq(seq, resv_seq);
+    if (watch_pages[address >> PAGE_SHIFT] & WATCH_WRITE) {
+        check_watch(address, 4, WATCH_WRITE, value);
+    }
+    if (code_pages[address >> PAGE_SHIFT]) {
+        invalidate_code(address, 4);
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include "batch.h"
+#include "platform.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Instructions executed per call to Core::run()
+#define BATCH_SLICE 1000000
+
+MemoryPool::~MemoryPool() {
+    for (Memory *mem : free) {
+        delete mem;
+    }
+}
+
+Memory *MemoryPool::acquire() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!free.empty()) {
+            Memory *mem = free.back();
+            free.pop_back();
+            return mem;
+        }
+    }
+    Memory *mem = new Memory(backend);
+    mem->setQuiet(true);
+    return mem;
+}
+
+void MemoryPool::release(Memory *mem) {
+    mem->clear(); // Outside the lock: clearing is the expensive part
+    std::lock_guard<std::mutex> guard(lock);
+    free.push_back(mem);
+}
+
+BatchRunner::BatchRunner(const BatchConfig &config, const std::vector<std::string> &paths) :
+    config(config), paths(paths), results(paths.size()), queues(std::max(config.jobs, 1u)), pool(config.backend) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+        queues[i % queues.size()].items.push_back(i);
+    }
+}
+
+bool BatchRunner::next(unsigned w, size_t &index) {
+    {
+        Queue &own = queues[w];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.items.empty()) {
+            index = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    // Steal, starting with the next worker so that thieves spread out
+    for (size_t k = 1; k < queues.size(); ++k) {
+        Queue &victim = queues[(w + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.items.empty()) {
+            index = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false; // Nothing is ever queued again once the run starts
+}
+
+void BatchRunner::work(unsigned w) {
+    size_t index;
+    while (next(w, index)) {
+        run_one(index);
+    }
+}
+
+void BatchRunner::run_one(size_t index) {
+    BatchResult &r = results[index];
+    r.path = paths[index];
+    r.status = BATCH_ERROR;
+    r.rc = 0;
+    r.exit_code = 0;
+    r.instret = 0;
+
+    auto t_start = std::chrono::steady_clock::now();
+    Memory *mem = pool.acquire();
+    std::unique_ptr<Core> core; // Outside the try: an error still reports how far the program got
+    try {
+        if (!std::ifstream(r.path)) {
+            throw std::runtime_error("Could not open program file");
+        }
+        Platform platform(mem, "none", 0, "");
+        core.reset(new Core(mem));
+        core->setEngine(config.engine);
+        core->setBus(&platform.bus);
+        core->setClint(&platform.clint);
+        core->reset(load_program(*mem, r.path, config.load_addr, nullptr));
+
+        int rc = 0;
+        uint64_t limit = config.max_instrs;
+        while (rc == 0 && (!limit || core->getInstret() + BLOCK_MAX_LEN < limit)) {
+            uint64_t slice = BATCH_SLICE;
+            if (limit) {
+                slice = std::min<uint64_t>(slice, limit - BLOCK_MAX_LEN - core->getInstret());
+            }
+            rc = core->run(slice);
+        }
+        // Engines may retire a whole block past their budget: single-step the rest
+        while (rc == 0 && limit && core->getInstret() < limit) {
+            rc = core->tick();
+        }
+
+        r.rc = rc;
+        r.instret = core->getInstret();
+        if (rc == RC_EXIT) {
+            r.exit_code = platform.bus.exit_code;
+            r.status = r.exit_code ? BATCH_FAIL : BATCH_PASS;
+        } else if (rc == RC_EBREAK) {
+            r.status = BATCH_PASS;
+        } else if (rc == 0) {
+            r.status = BATCH_LIMIT;
+        } else {
+            r.status = BATCH_FAIL;
+        }
+    } catch (const std::exception &e) {
+        r.error = e.what();
+        if (core) {
+            r.instret = core->getInstret();
+        }
+    }
+    core.reset(); // Before its memory goes back to the pool
+    pool.release(mem);
+    r.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+const std::vector<BatchResult> &BatchRunner::run() {
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w < queues.size(); ++w) {
+        threads.emplace_back(&BatchRunner::work, this, w);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    return results;
+}
+
+// Does the file name end with a program extension?
+static bool is_program(const std::string &name) {
+    static const char *const exts[] = {".hex", ".elf", ".bin"};
+    for (const char *ext : exts) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ext) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> batch_programs(const std::string &path) {
+    std::vector<std::string> programs;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        throw std::runtime_error("Could not open batch: " + path);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path.c_str());
+        if (!dir) {
+            throw std::runtime_error("Could not read directory: " + path);
+        }
+        while (struct dirent *ent = readdir(dir)) {
+            if (is_program(ent->d_name)) {
+                programs.push_back(path + "/" + ent->d_name);
+            }
+        }
+        closedir(dir);
+        std::sort(programs.begin(), programs.end());
+        return programs;
+    }
+
+    std::ifstream manifest(path);
+    if (!manifest) {
+        throw std::runtime_error("Could not open manifest: " + path);
+    }
+    size_t slash = path.rfind('/');
+    std::string base = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+    std::string line;
+    while (std::getline(manifest, line)) {
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        programs.push_back(line[0] == '/' ? line : base + line);
+    }
+    return programs;
+}
+
+const char *batch_status_name(batch_status_t status) {
+    switch (status) {
+        case BATCH_PASS:  return "pass";
+        case BATCH_FAIL:  return "fail";
+        case BATCH_LIMIT: return "limit";
+        default:          return "error";
+    }
+}
+
+// Write s as a JSON string
+static void json_string(FILE *f, const std::string &s) {
+    fputc('"', f);
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool write_batch_json(const std::vector<BatchResult> &results, const BatchConfig &config,
+                      double wall_s, const std::string &path) {
+    static const char *const engine_names[] = {"interp", "block", "jit"};
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    size_t passed = std::count_if(results.begin(), results.end(),
+                                  [](const BatchResult &r) { return r.status == BATCH_PASS; });
+    fprintf(f, "{\n");
+    fprintf(f, "  \"engine\": \"%s\",\n", engine_names[config.engine]);
+    fprintf(f, "  \"jobs\": %u,\n", config.jobs);
+    fprintf(f, "  \"programs\": %lu,\n", results.size());
+    fprintf(f, "  \"passed\": %lu,\n", passed);
+    fprintf(f, "  \"failed\": %lu,\n", results.size() - passed);
+    fprintf(f, "  \"wall_s\": %.6f,\n", wall_s);
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BatchResult &r = results[i];
+        fprintf(f, "    {\"program\": ");
+        json_string(f, r.path);
+        fprintf(f, ", \"status\": \"%s\", \"rc\": %d, \"exit_code\": %d, \"instret\": %lu, \"wall_s\": %.6f",
+                batch_status_name(r.status), r.rc, r.exit_code, r.instret, r.wall_s);
+        if (r.status == BATCH_ERROR) {
+            fprintf(f, ", \"error\": ");
+            json_string(f, r.error);
+        }
+        fprintf(f, "}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+    return fclose(f) == 0;
+}
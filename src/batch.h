@@ -0,0 +1,100 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include "memory.h"
+#include "core.h"
+
+// Outcome of one batch program
+enum batch_status_t {
+    BATCH_PASS,     // Exited with status 0 (test finisher) or stopped at EBREAK
+    BATCH_FAIL,     // Exited with a nonzero status
+    BATCH_LIMIT,    // Still running at the instruction limit
+    BATCH_ERROR     // Could not be loaded or run
+};
+
+// Result of one batch program
+struct BatchResult {
+    std::string path;       // Program file
+    batch_status_t status;
+    int rc;                 // Core::run() return code
+    int exit_code;          // Guest exit status
+    uint64_t instret;       // Retired instructions
+    double wall_s;          // Wall-clock time of the run, loading included
+    std::string error;      // Exception message (BATCH_ERROR)
+};
+
+// Settings shared by all programs of a batch
+struct BatchConfig {
+    engine_t engine;
+    mem_backend_t backend;
+    uint32_t load_addr;     // Load address for flat binaries
+    uint64_t max_instrs;    // Instruction limit per program (0: none)
+    unsigned jobs;          // Worker threads
+};
+
+// Memories handed out to batch workers and cleared for reuse when returned
+class MemoryPool {
+    private:
+        mem_backend_t backend;
+        std::mutex lock;
+        std::vector<Memory*> free;
+
+    public:
+        MemoryPool(mem_backend_t backend) : backend(backend) {}
+        ~MemoryPool();
+
+        // A zeroed memory, recycled if one is available
+        Memory *acquire();
+
+        // Give a memory back
+        void release(Memory *mem);
+};
+
+// Runs many independent single-hart programs on a work-stealing thread pool. Programs are
+// dealt round-robin to per-worker queues; a worker takes from the back of its own queue and,
+// once it is empty, steals from the front of the others'. Each program gets a Core, a fresh
+// set of devices (console output discarded) and a Memory from the pool.
+class BatchRunner {
+    private:
+        // Work queue of one worker
+        struct Queue {
+            std::mutex lock;
+            std::deque<size_t> items;   // Indices into paths
+        };
+
+        BatchConfig config;
+        std::vector<std::string> paths;
+        std::vector<BatchResult> results;
+        std::vector<Queue> queues;
+        MemoryPool pool;
+
+        // Next program for worker w; returns false once every queue is empty
+        bool next(unsigned w, size_t &index);
+
+        // Thread body
+        void work(unsigned w);
+
+        // Run one program
+        void run_one(size_t index);
+
+    public:
+        BatchRunner(const BatchConfig &config, const std::vector<std::string> &paths);
+
+        // Run all programs; results are in the order of paths
+        const std::vector<BatchResult> &run();
+};
+
+// Program files of a batch: the .hex, .elf and .bin files of a directory (sorted by name),
+// or the lines of a manifest file (relative paths are taken from the manifest's directory,
+// blank lines and lines starting with # are skipped)
+std::vector<std::string> batch_programs(const std::string &path);
+
+// Name of a status for reports
+const char *batch_status_name(batch_status_t status);
+
+// Write the results as a JSON report; returns false if the file cannot be written
+bool write_batch_json(const std::vector<BatchResult> &results, const BatchConfig &config,
+                      double wall_s, const std::string &path);
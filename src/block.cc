@@ -0,0 +1,333 @@
+#include "block.h"
+#include "core.h"
+#include "exec.h"
+#include <string.h>
+
+BlockCache::BlockCache() {
+    for (int i = 0; i < BLOCK_TABLE_SIZE; ++i) {
+        table[i] = nullptr;
+    }
+    code_pages.assign(1u << (32 - PAGE_SHIFT), 0);
+    generation = 0;
+    epoch = 0;
+    clear_class_totals();
+}
+
+BlockCache::~BlockCache() {
+    flush();
+}
+
+Block *BlockCache::alloc(xlen_t pc) {
+    if (blocks.size() >= BLOCK_CACHE_LIMIT) {
+        flush(); // Out of room: start over rather than tracking individual blocks
+    }
+    Block *b = new Block();
+    b->pc = pc;
+    b->end = pc;
+    b->len = 0;
+    b->valid = true;
+    b->link[0] = b->link[1] = nullptr;
+    b->execs = 0;
+    b->profiled = false;
+    b->skipped = 0;
+    b->counted = 0;
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        b->classes[c] = 0;
+    }
+    blocks.push_back(b);
+    return b;
+}
+
+void BlockCache::insert(Block *b) {
+    table[(b->pc >> 2) & (BLOCK_TABLE_SIZE - 1)] = b;
+    map[b->pc] = b;
+
+    // Blocks never cross a page, so one bitmap covers all of their words
+    CodePage &cp = pages[b->pc >> PAGE_SHIFT];
+    if (cp.blocks.empty()) {
+        memset(cp.words, 0, sizeof(cp.words));
+    }
+    cp.blocks.push_back(b);
+    mark_words(cp, b);
+    code_pages[b->pc >> PAGE_SHIFT] = 1;
+}
+
+void BlockCache::mark_words(CodePage &cp, const Block *b) {
+    for (xlen_t a = b->pc; a != b->end; a += 4) {
+        uint32_t w = (a & (PAGE_SIZE - 1)) >> 2;
+        cp.words[w / 32] |= 1u << (w % 32);
+    }
+}
+
+bool BlockCache::invalidate(xlen_t address) {
+    xlen_t page = address >> PAGE_SHIFT;
+    auto it = pages.find(page);
+    if (it == pages.end()) {
+        return false;
+    }
+    CodePage &cp = it->second;
+    uint32_t w = (address & (PAGE_SIZE - 1)) >> 2;
+    if (!(cp.words[w / 32] & (1u << (w % 32)))) {
+        return false; // Data that happens to share a page with code
+    }
+
+    epoch++;
+    xlen_t word = address & ~0b11;
+    size_t keep = 0;
+    for (size_t i = 0; i < cp.blocks.size(); ++i) {
+        Block *b = cp.blocks[i];
+        if (word < b->pc || word >= b->end) {
+            cp.blocks[keep++] = b;
+            continue;
+        }
+
+        // Blocks stay allocated until the next flush, so chained pointers remain safe to test
+        b->valid = false;
+        Block *&slot = table[(b->pc >> 2) & (BLOCK_TABLE_SIZE - 1)];
+        if (slot == b) {
+            slot = nullptr;
+        }
+        auto m = map.find(b->pc);
+        if (m != map.end() && m->second == b) {
+            map.erase(m);
+        }
+    }
+    cp.blocks.resize(keep);
+
+    if (cp.blocks.empty()) {
+        pages.erase(it);
+        code_pages[page] = 0;
+        return true;
+    }
+
+    // Rebuild the coverage bitmap from the surviving blocks
+    memset(cp.words, 0, sizeof(cp.words));
+    for (Block *b : cp.blocks) {
+        mark_words(cp, b);
+    }
+    return true;
+}
+
+void BlockCache::flush() {
+    count_classes(class_totals);
+    for (Block *b : blocks) {
+        uint64_t retired = b->execs * b->len - b->skipped;
+        if (retired != b->counted) {
+            freed_counts[b->pc] += retired - b->counted;
+        }
+        delete b;
+    }
+    blocks.clear();
+    map.clear();
+    for (auto &p : pages) {
+        code_pages[p.first] = 0;
+    }
+    pages.clear();
+    for (int i = 0; i < BLOCK_TABLE_SIZE; ++i) {
+        table[i] = nullptr;
+    }
+    generation++;
+    epoch++;
+}
+
+void BlockCache::count_classes(uint64_t counts[CLASS_COUNT]) const {
+    for (const Block *b : blocks) {
+        for (int c = 0; c < CLASS_COUNT; ++c) {
+            counts[c] += b->execs * b->classes[c];
+        }
+    }
+}
+
+void BlockCache::take_counts(std::unordered_map<xlen_t, uint64_t> &counts) {
+    for (Block *b : blocks) {
+        uint64_t retired = b->execs * b->len - b->skipped;
+        if (retired != b->counted) {
+            counts[b->pc] += retired - b->counted;
+            b->counted = retired;
+        }
+    }
+    for (auto &entry : freed_counts) {
+        counts[entry.first] += entry.second;
+    }
+    freed_counts.clear();
+}
+
+Block *Core::translate(xlen_t pc) {
+    Block *b = bcache.alloc(pc);
+    xlen_t addr = pc;
+    mark_code(pc);
+
+    bool fall_through = false;
+    while (true) {
+        uop_t u;
+        fetch(u, addr);
+        if (uop_runs_alone(u.op) && addr != pc) {
+            // Leave it to a block of its own, which starts with an exact instret
+            fall_through = true;
+            break;
+        }
+        b->uops.push_back(u);
+        b->end = addr + 4;
+        if (uop_ends_block(u.op)) {
+            // EBREAK and illegal instructions stop before retiring
+            b->len = b->uops.size() - ((u.op == OP_EBREAK || u.op == OP_ILLEGAL) ? 1 : 0);
+            break;
+        }
+
+        addr += 4;
+        if (b->uops.size() == BLOCK_MAX_LEN || (addr >> PAGE_SHIFT) != (pc >> PAGE_SHIFT)) {
+            // Block is full or reached the end of the page
+            fall_through = true;
+            break;
+        }
+    }
+
+    if (fall_through) {
+        // Continue at addr with a jump
+        b->len = b->uops.size();
+        uop_t j;
+        j.pc = addr;
+        j.value = 0;
+        j.op = OP_JAL;
+        j.rd = REG_SINK;
+        j.rs1 = j.rs2 = 0;
+        j.imm = addr;
+        b->uops.push_back(j);
+    }
+
+    for (uint32_t i = 0; i < b->len; ++i) {
+        b->classes[uop_class(b->uops[i].op)]++;
+    }
+    b->profiled = (profiler != nullptr);
+    bcache.insert(b);
+    if (trace) {
+        trace->code(b->pc, b->uops.data(), b->len);
+    }
+    return b;
+}
+
+Block *Core::lookup_block(xlen_t pc) {
+    Block *b = bcache.find(pc);
+    return b ? b : translate(pc);
+}
+
+// Finish the trace record of a block left after retiring its first n instructions
+#define TRACE_BLOCK_END(n) \
+    if (TRACED) { \
+        rec[0] = TRACE_REC_BLOCK | (n) << 8; \
+        rec[1] = b->pc; \
+        trace->pos = tp; \
+    }
+
+template<bool TRACED>
+int Core::run_blocks(uint64_t max_instrs) {
+    // Threaded dispatch table indexed by uop_id_t
+    static void *const labels[OP_COUNT] = {
+#define UOP_LABEL(name) &&L_##name,
+        UOP_LIST(UOP_LABEL)
+#undef UOP_LABEL
+    };
+
+    uint64_t end = instret + max_instrs;
+    Block *b = lookup_block(pc);
+    const uop_t *u;
+    xlen_t pc_next;
+    uint32_t *rec = nullptr, *tp = nullptr; // Trace record of the block and its next value
+
+enter_block:
+    b->execs++;
+    if (TRACED) {
+        rec = trace->reserve();
+        tp = rec + 2;
+    }
+    u = b->uops.data();
+    goto *labels[u->op];
+
+    // One handler per operation; control only leaves the block at its last uop,
+    // after a store or AMO that overwrote the block itself, or after an access that
+    // hit a watchpoint. Traced runs store each instruction's values (see trace.h).
+#define UOP_BODY(name) \
+    L_##name: \
+        if (TRACED && (trace_flags(OP_##name, u->rd) & (TRACE_LOAD | TRACE_STORE))) \
+            *tp++ = rf[u->rs1] + (uop_is_atomic(OP_##name) ? 0 : u->imm); \
+        if (TRACED && (trace_flags(OP_##name, u->rd) & TRACE_STORE)) *tp++ = rf[u->rs2]; \
+        pc_next = exec<OP_##name>(*u); \
+        if (TRACED && uop_writes_rd(OP_##name) && u->rd != REG_SINK) *tp++ = rf[u->rd]; \
+        if (OP_##name == OP_EBREAK) goto ebreak; \
+        if (OP_##name == OP_FENCE_I) goto fence_i; \
+        if (uop_ends_block(OP_##name)) goto exit_block; \
+        if ((uop_is_store(OP_##name) || uop_is_atomic(OP_##name)) && (!b->valid || halt)) goto exit_stale; \
+        if (uop_class(OP_##name) == CLASS_LOAD && halt) goto exit_stale; \
+        u++; \
+        goto *labels[u->op];
+    UOP_LIST(UOP_BODY)
+#undef UOP_BODY
+
+exit_block:
+    TRACE_BLOCK_END(b->len)
+    instret += b->len;
+    pc = pc_next;
+    if (profiler) {
+        profiler->retire_block(b->uops.data(), b->len, pc_next, instret);
+    }
+    if (instret >= end) {
+        return 0;
+    }
+    {
+        // Follow the chained successor, or look it up and chain it
+        int slot = (pc_next == b->pc + 4 * b->len);
+        Block *next = b->link[slot];
+        if (!next || next->pc != pc_next || !next->valid) {
+            uint64_t gen = bcache.generation;
+            next = lookup_block(pc_next);
+            if (gen == bcache.generation) {
+                b->link[slot] = next;
+            }
+        }
+        b = next;
+    }
+    goto enter_block;
+
+exit_stale:
+    // The block was modified under us (or a device or watchpoint stopped the
+    // simulation): resume after the access with a fresh translation
+    TRACE_BLOCK_END((u - b->uops.data()) + 1)
+    instret += (u - b->uops.data()) + 1;
+    count_partial(b, (u - b->uops.data()) + 1);
+    pc = pc_next;
+    if (halt) {
+        return halt_code();
+    }
+    if (instret >= end) {
+        return 0;
+    }
+    b = lookup_block(pc);
+    goto enter_block;
+
+fence_i:
+    // FENCE.I runs alone in its block: drop every translation, this one included
+    TRACE_BLOCK_END(b->len)
+    instret += b->len;
+    pc = pc_next;
+    if (profiler) {
+        profiler->retire_block(b->uops.data(), b->len, pc_next, instret);
+    }
+    flush_code();
+    if (instret >= end) {
+        return 0;
+    }
+    b = lookup_block(pc);
+    goto enter_block;
+
+ebreak:
+    TRACE_BLOCK_END(b->len)
+    instret += b->len;
+    pc = pc_next;
+    if (profiler) {
+        profiler->retire_block(b->uops.data(), b->len, pc_next, instret);
+    }
+    return RC_EBREAK;
+}
+
+template int Core::run_blocks<false>(uint64_t max_instrs);
+template int Core::run_blocks<true>(uint64_t max_instrs);
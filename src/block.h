@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include "defs.h"
+#include "decode.h"
+
+// Maximum number of instructions translated into one block
+#define BLOCK_MAX_LEN 64
+
+// Number of entries in the direct-mapped block lookup table (must be a power of 2)
+#define BLOCK_TABLE_SIZE 4096
+
+// Number of blocks allocated before the whole cache is flushed
+#define BLOCK_CACHE_LIMIT 65536
+
+// Straight-line run of predecoded instructions ending in a control transfer
+struct Block {
+    xlen_t pc;                  // Address of the first instruction
+    xlen_t end;                 // Address after the last translated instruction
+    uint32_t len;               // Instructions retired by a full run of the block
+    bool valid;                 // Cleared when the code under the block is overwritten
+    std::vector<uop_t> uops;    // Instructions; the last one always ends the block
+    Block *link[2];             // Chained successors (taken, fall-through)
+    uint64_t execs;             // Times the block was entered
+    bool profiled;              // Translated for a profiler: its calls and returns are followed
+    uint64_t skipped;           // Instructions not retired because the block was left early
+    uint64_t counted;           // Instructions already reported by take_counts()
+    uint16_t classes[CLASS_COUNT];  // Retired instructions of each class per full run
+};
+
+// Translated code on one guest page
+struct CodePage {
+    std::vector<Block*> blocks;             // Valid blocks starting on the page
+    uint32_t words[PAGE_SIZE / 4 / 32];     // Bitmap of instruction words covered by blocks
+};
+
+// Translated block storage, lookup and invalidation
+class BlockCache {
+    private:
+        Block *table[BLOCK_TABLE_SIZE];                 // Direct-mapped lookup by PC
+        std::unordered_map<xlen_t, Block*> map;         // All valid blocks by PC
+        std::unordered_map<xlen_t, CodePage> pages;     // Translated code by page number
+        std::vector<Block*> blocks;                     // Every block allocated since the last flush
+        std::vector<uint8_t> code_pages;                // Pages holding translated code
+        uint64_t class_totals[CLASS_COUNT];             // Instructions retired by blocks freed so far
+        std::unordered_map<xlen_t, uint64_t> freed_counts;  // Unreported instructions of freed blocks, by block PC
+
+        // Mark the words translated into a block in the page bitmap
+        void mark_words(CodePage &cp, const Block *b);
+
+    public:
+        uint64_t generation;    // Bumped on flush; invalidates every Block pointer held outside
+        uint64_t epoch;         // Bumped whenever any translated code is invalidated or flushed
+
+        // Constructor
+        BlockCache();
+
+        // Destructor
+        ~BlockCache();
+
+        // Find the valid block starting at pc, or nullptr
+        Block *find(xlen_t pc) {
+            Block *b = table[(pc >> 2) & (BLOCK_TABLE_SIZE - 1)];
+            if (b && b->pc == pc) {
+                return b;
+            }
+            auto it = map.find(pc);
+            return (it == map.end()) ? nullptr : it->second;
+        }
+
+        // Allocate an empty block for pc (may flush the cache first)
+        Block *alloc(xlen_t pc);
+
+        // Make a translated block visible to find()
+        void insert(Block *b);
+
+        // Does the page containing address hold translated code?
+        bool is_code(xlen_t address) const { return code_pages[address >> PAGE_SHIFT]; }
+
+        // Invalidate the blocks covering the word at address; returns false if there are none
+        bool invalidate(xlen_t address);
+
+        // Drop all blocks
+        void flush();
+
+        // Add the instructions of each class retired by blocks to counts
+        void count_classes(uint64_t counts[CLASS_COUNT]) const;
+
+        // Add the instructions retired by each block since the last call to counts, by block PC
+        void take_counts(std::unordered_map<xlen_t, uint64_t> &counts);
+
+        // Forget the instructions retired by freed blocks
+        void clear_class_totals() {
+            for (int c = 0; c < CLASS_COUNT; ++c) {
+                class_totals[c] = 0;
+            }
+        }
+};
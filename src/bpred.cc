@@ -0,0 +1,321 @@
+#include "bpred.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <stdexcept>
+
+// Tagged tables of the TAGE predictor and their global history lengths
+#define TAGE_TABLES 4
+static const unsigned tage_history[TAGE_TABLES] = {5, 11, 22, 44};
+#define TAGE_TAG_BITS 9
+#define TAGE_NO_TAG 0xffff  // Tag of an empty entry (matches no branch)
+
+// Branches between two agings of the TAGE usefulness counters
+#define TAGE_AGING_PERIOD (1u << 18)
+
+void BranchPredictorConfig::parse(const std::string &settings) {
+    struct { const char *key; unsigned *value; long min, max; } fields[] = {
+        {"table", &table_bits, 4, 24}, {"history", &history, 0, 32},
+        {"btb", &btb, 1, 1u << 20}, {"ras", &ras, 1, 1024}
+    };
+    size_t pos = 0;
+    while (pos < settings.size()) {
+        size_t end = settings.find(',', pos);
+        if (end == std::string::npos) {
+            end = settings.size();
+        }
+        std::string item = settings.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty()) {
+            continue;
+        }
+
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        bool found = false;
+        for (auto &f : fields) {
+            if (key != f.key) {
+                continue;
+            }
+            char *rest = nullptr;
+            long value = (eq == std::string::npos) ? -1 : strtol(item.c_str() + eq + 1, &rest, 0);
+            if (value < f.min || value > f.max || (rest && *rest) || eq + 1 == item.size()) {
+                throw std::runtime_error("Invalid branch predictor setting: " + item);
+            }
+            *f.value = value;
+            found = true;
+        }
+        if (!found) {
+            throw std::runtime_error("Unknown branch predictor setting: " + key);
+        }
+    }
+    if (btb & (btb - 1)) {
+        throw std::runtime_error("The number of BTB entries must be a power of two");
+    }
+}
+
+// Saturating two-bit counter: taken if at least 2
+static void train(uint8_t &counter, bool taken) {
+    if (taken) {
+        counter += (counter < 3);
+    } else {
+        counter -= (counter > 0);
+    }
+}
+
+// Per-address two-bit counters
+class Bimodal : public DirectionPredictor {
+    private:
+        std::vector<uint8_t> counters;
+        uint32_t mask;
+
+    public:
+        Bimodal(unsigned bits) : counters(1u << bits, 1), mask((1u << bits) - 1) {}
+
+        bool predict(xlen_t pc) override {
+            return counters[(pc >> 2) & mask] >= 2;
+        }
+
+        void update(xlen_t pc, bool taken) override {
+            train(counters[(pc >> 2) & mask], taken);
+        }
+};
+
+// Two-bit counters indexed by the address XOR the global history
+class Gshare : public DirectionPredictor {
+    private:
+        std::vector<uint8_t> counters;
+        uint32_t mask;
+        uint32_t history;
+        uint32_t history_mask;
+
+        uint32_t index(xlen_t pc) const { return ((pc >> 2) ^ history) & mask; }
+
+    public:
+        Gshare(unsigned bits, unsigned history_bits) :
+            counters(1u << bits, 1), mask((1u << bits) - 1), history(0),
+            history_mask(history_bits >= 32 ? ~0u : (1u << history_bits) - 1) {}
+
+        bool predict(xlen_t pc) override {
+            return counters[index(pc)] >= 2;
+        }
+
+        void update(xlen_t pc, bool taken) override {
+            train(counters[index(pc)], taken);
+            history = ((history << 1) | taken) & history_mask;
+        }
+};
+
+// Small TAGE: a bimodal base table and tagged tables indexed with geometrically longer
+// global histories. The longest matching table provides the prediction; a misprediction
+// allocates an entry in a longer table whose usefulness counter has run down.
+class Tage : public DirectionPredictor {
+    private:
+        struct Entry {
+            uint16_t tag;
+            int8_t counter;     // -4..3: taken if not negative
+            uint8_t useful;     // 0..3
+        };
+
+        Bimodal base;
+        std::vector<Entry> tables[TAGE_TABLES];
+        unsigned bits;                      // log2 of the entries of a tagged table
+        uint64_t history;
+        uint64_t branches;
+
+        // State of the last prediction, used by update()
+        uint32_t index[TAGE_TABLES];
+        uint16_t tag[TAGE_TABLES];
+        int provider;                       // Table providing the prediction (-1: base)
+        bool provider_taken;
+        bool alt_taken;                     // Prediction had the provider not matched
+
+        // The last len bits of the global history folded into width bits, kept up to date
+        // one outcome at a time
+        struct Folded {
+            unsigned width;
+            unsigned dropped_at;    // Position of the bit leaving the history: len % width
+            uint32_t value;
+
+            void push(bool taken, bool dropped) {
+                value = (value << 1) | taken;
+                value ^= (uint32_t)dropped << dropped_at;
+                value ^= value >> width;
+                value &= (1u << width) - 1;
+            }
+        };
+        Folded index_history[TAGE_TABLES];
+        Folded tag_history[TAGE_TABLES][2];    // Two widths, so that tags and indices differ
+
+    public:
+        Tage(unsigned base_bits) : base(base_bits), bits(std::max(base_bits, 6u) - 2), history(0), branches(0) {
+            for (int t = 0; t < TAGE_TABLES; ++t) {
+                tables[t].assign(1u << bits, Entry{TAGE_NO_TAG, 0, 0});
+                index_history[t] = Folded{bits, tage_history[t] % bits, 0};
+                tag_history[t][0] = Folded{TAGE_TAG_BITS, tage_history[t] % TAGE_TAG_BITS, 0};
+                tag_history[t][1] = Folded{TAGE_TAG_BITS - 1, tage_history[t] % (TAGE_TAG_BITS - 1), 0};
+            }
+        }
+
+        bool predict(xlen_t pc) override {
+            provider = -1;
+            int alt = -1;
+            for (int t = TAGE_TABLES - 1; t >= 0; --t) {
+                index[t] = ((pc >> 2) ^ (pc >> (2 + bits)) ^ index_history[t].value) & ((1u << bits) - 1);
+                tag[t] = ((pc >> 2) ^ tag_history[t][0].value ^ (tag_history[t][1].value << 1)) &
+                         ((1u << TAGE_TAG_BITS) - 1);
+                if (tables[t][index[t]].tag == tag[t]) {
+                    if (provider < 0) {
+                        provider = t;
+                    } else if (alt < 0) {
+                        alt = t;
+                    }
+                }
+            }
+            bool base_taken = base.predict(pc);
+            alt_taken = (alt >= 0) ? tables[alt][index[alt]].counter >= 0 : base_taken;
+            provider_taken = (provider >= 0) ? tables[provider][index[provider]].counter >= 0 : base_taken;
+            return provider_taken;
+        }
+
+        void update(xlen_t pc, bool taken) override {
+            if (provider >= 0) {
+                Entry &e = tables[provider][index[provider]];
+                if (provider_taken != alt_taken) {
+                    if (provider_taken == taken) {
+                        e.useful += (e.useful < 3);
+                    } else {
+                        e.useful -= (e.useful > 0);
+                    }
+                }
+                if (taken) {
+                    e.counter += (e.counter < 3);
+                } else {
+                    e.counter -= (e.counter > -4);
+                }
+            } else {
+                base.update(pc, taken);
+            }
+
+            // Mispredicted: claim an entry with a longer history, or age the candidates
+            if (provider_taken != taken && provider < TAGE_TABLES - 1) {
+                bool allocated = false;
+                for (int t = provider + 1; t < TAGE_TABLES && !allocated; ++t) {
+                    Entry &e = tables[t][index[t]];
+                    if (e.useful == 0) {
+                        e = Entry{tag[t], (int8_t)(taken ? 0 : -1), 0};
+                        allocated = true;
+                    }
+                }
+                for (int t = provider + 1; t < TAGE_TABLES && !allocated; ++t) {
+                    Entry &e = tables[t][index[t]];
+                    e.useful -= (e.useful > 0);
+                }
+            }
+
+            // Let entries that stopped being useful be replaced eventually
+            if (++branches % TAGE_AGING_PERIOD == 0) {
+                for (auto &t : tables) {
+                    for (Entry &e : t) {
+                        e.useful >>= 1;
+                    }
+                }
+            }
+            for (int t = 0; t < TAGE_TABLES; ++t) {
+                bool dropped = (history >> (tage_history[t] - 1)) & 1;
+                index_history[t].push(taken, dropped);
+                tag_history[t][0].push(taken, dropped);
+                tag_history[t][1].push(taken, dropped);
+            }
+            history = (history << 1) | taken;
+        }
+};
+
+BranchPredictor::BranchPredictor(const BranchPredictorConfig &config) :
+    btb_tags(config.btb, 0), btb_targets(config.btb, 0), ras(config.ras, 0), ras_top(0),
+    attribute(config.attribute), stats{0, 0, 0, 0, 0, 0, 0, 0} {
+    if (config.kind == "bimodal") {
+        direction.reset(new Bimodal(config.table_bits));
+    } else if (config.kind == "gshare") {
+        direction.reset(new Gshare(config.table_bits, config.history));
+    } else if (config.kind == "tage") {
+        direction.reset(new Tage(config.table_bits));
+    } else {
+        throw std::runtime_error("Unknown branch predictor: " + config.kind);
+    }
+}
+
+bool BranchPredictor::btb_check(xlen_t pc, xlen_t target) {
+    size_t i = (pc >> 2) & (btb_tags.size() - 1);
+    bool hit = btb_tags[i] == (pc | 1) && btb_targets[i] == target;
+    btb_tags[i] = pc | 1;
+    btb_targets[i] = target;
+    return hit;
+}
+
+bp_result_t BranchPredictor::resolve(const uop_t &u, xlen_t pc_next) {
+    bp_result_t result;
+    if (u.op >= OP_BEQ && u.op <= OP_BGEU) {
+        bool taken = pc_next != u.pc + 4;
+        bool predicted = direction->predict(u.pc);
+        direction->update(u.pc, taken);
+        stats.cond++;
+        if (predicted != taken) {
+            stats.cond_misses++;
+            result = BP_MISS;
+        } else if (taken && !btb_check(u.pc, pc_next)) {
+            stats.late++;
+            result = BP_LATE;
+        } else {
+            result = BP_HIT;
+        }
+    } else if (u.op == OP_JAL || u.op == OP_JALR) {
+        bool link = (u.rd == 1 || u.rd == 5);
+        if (u.op == OP_JAL) {
+            stats.jumps++;
+            result = btb_check(u.pc, pc_next) ? BP_HIT : BP_LATE;
+            stats.late += (result == BP_LATE);
+        } else if (u.rd == REG_SINK && (u.rs1 == 1 || u.rs1 == 5)) {
+            stats.returns++;
+            if (ras_top > 0) {
+                ras_top--;
+                result = (ras[ras_top % ras.size()] == pc_next) ? BP_HIT : BP_MISS;
+            } else {
+                result = btb_check(u.pc, pc_next) ? BP_HIT : BP_MISS; // Empty stack: not a real return
+            }
+            stats.return_misses += (result == BP_MISS);
+        } else {
+            stats.indirect++;
+            result = btb_check(u.pc, pc_next) ? BP_HIT : BP_MISS;
+            stats.indirect_misses += (result == BP_MISS);
+        }
+        if (link) {
+            ras[ras_top % ras.size()] = u.pc + 4;
+            ras_top++;
+        }
+    } else {
+        return BP_NONE;
+    }
+
+    if (attribute) {
+        BranchSite &site = sites[u.pc];
+        site.count++;
+        site.misses += (result == BP_MISS);
+    }
+    return result;
+}
+
+std::vector<std::pair<xlen_t, BranchSite>> BranchPredictor::top_misses(size_t n) const {
+    std::vector<std::pair<xlen_t, BranchSite>> top;
+    for (auto &entry : sites) {
+        if (entry.second.misses) {
+            top.push_back(entry);
+        }
+    }
+    auto more = [](const std::pair<xlen_t, BranchSite> &a, const std::pair<xlen_t, BranchSite> &b) {
+        return a.second.misses != b.second.misses ? a.second.misses > b.second.misses : a.first < b.first;
+    };
+    n = std::min(n, top.size());
+    std::partial_sort(top.begin(), top.begin() + n, top.end(), more);
+    top.resize(n);
+    return top;
+}
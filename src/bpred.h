@@ -0,0 +1,89 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "decode.h"
+
+// How the front end fared on a control transfer
+enum bp_result_t {
+    BP_NONE,        // No predictor: static predict-not-taken timing
+    BP_HIT,         // Next pc predicted at fetch
+    BP_LATE,        // Right direction, but the target of a direct jump came from decode
+    BP_MISS         // Wrong direction or target, found in execute
+};
+
+// Settings of the branch predictor
+struct BranchPredictorConfig {
+    std::string kind = "gshare";    // Direction predictor: bimodal, gshare or tage
+    unsigned table_bits = 12;       // log2 of the counters of the bimodal, gshare and TAGE base tables
+    unsigned history = 12;          // Global history bits of gshare
+    unsigned btb = 512;             // Branch target buffer entries (direct-mapped)
+    unsigned ras = 8;               // Return address stack depth
+    bool attribute = false;         // Count mispredictions by branch address
+
+    // Apply comma-separated key=value settings, e.g. "table=14,btb=1024" (keys: table
+    // history btb ras); throws on bad input
+    void parse(const std::string &settings);
+};
+
+// Conditional branch direction predictor
+class DirectionPredictor {
+    public:
+        virtual ~DirectionPredictor() {}
+
+        // Predict the branch at pc
+        virtual bool predict(xlen_t pc) = 0;
+
+        // Train with the outcome of the branch just predicted
+        virtual void update(xlen_t pc, bool taken) = 0;
+};
+
+// Control transfer counts of one run
+struct BranchStats {
+    uint64_t cond;              // Conditional branches
+    uint64_t cond_misses;       // Wrong direction
+    uint64_t jumps;             // JAL
+    uint64_t indirect;          // JALR other than returns
+    uint64_t indirect_misses;   // Wrong target
+    uint64_t returns;           // JALR through ra or t0 to x0
+    uint64_t return_misses;     // Wrong target
+    uint64_t late;              // Taken direct branches and jumps missing from the BTB
+};
+
+// Executions and mispredictions of one branch
+struct BranchSite {
+    uint64_t count;
+    uint64_t misses;
+};
+
+// Front end of one hart: a direction predictor, a BTB for taken targets and a return
+// address stack. It is fed the retired control transfers in order, so every prediction
+// is trained before the next one is made (no wrong-path effects).
+class BranchPredictor {
+    private:
+        std::unique_ptr<DirectionPredictor> direction;
+        std::vector<xlen_t> btb_tags;       // Branch address | 1 (0: empty; pcs are never odd)
+        std::vector<xlen_t> btb_targets;
+        std::vector<xlen_t> ras;            // Circular: overflow drops the oldest return
+        unsigned ras_top;                   // Entries pushed, less popped (may exceed the depth)
+        bool attribute;
+        std::unordered_map<xlen_t, BranchSite> sites;
+        BranchStats stats;
+
+        // Is target the BTB's target for pc? The entry is then updated to target.
+        bool btb_check(xlen_t pc, xlen_t target);
+
+    public:
+        BranchPredictor(const BranchPredictorConfig &config);
+
+        // Predict the control transfer u, check the prediction against the actual next pc
+        // and train; returns BP_NONE for other operations
+        bp_result_t resolve(const uop_t &u, xlen_t pc_next);
+
+        const BranchStats &getStats() const { return stats; }
+
+        // Branches with the most mispredictions, most first
+        std::vector<std::pair<xlen_t, BranchSite>> top_misses(size_t n) const;
+};
@@ -0,0 +1,268 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+// Largest associativity (PLRU tree bits must fit a 64-bit word)
+#define CACHE_MAX_ASSOC 64
+
+static bool is_pow2(unsigned x) {
+    return x && !(x & (x - 1));
+}
+
+static unsigned log2u(unsigned x) {
+    unsigned n = 0;
+    while (x >>= 1) {
+        n++;
+    }
+    return n;
+}
+
+// Size with an optional k or m suffix
+static unsigned parse_size(const std::string &s) {
+    char *rest = nullptr;
+    unsigned long value = strtoul(s.c_str(), &rest, 0);
+    if (*rest == 'k' || *rest == 'K') {
+        value <<= 10;
+        rest++;
+    } else if (*rest == 'm' || *rest == 'M') {
+        value <<= 20;
+        rest++;
+    }
+    if (s.empty() || *rest || value > (1ul << 30)) {
+        throw std::runtime_error("Invalid cache size: " + s);
+    }
+    return value;
+}
+
+static unsigned parse_number(const std::string &s) {
+    char *rest = nullptr;
+    unsigned long value = strtoul(s.c_str(), &rest, 0);
+    if (s.empty() || *rest || value > 100000) {
+        throw std::runtime_error("Invalid cache setting value: " + s);
+    }
+    return value;
+}
+
+void CacheHierarchyConfig::parse(const std::string &settings) {
+    size_t pos = 0;
+    while (pos < settings.size()) {
+        size_t end = settings.find_first_of(",\n", pos);
+        if (end == std::string::npos) {
+            end = settings.size();
+        }
+        std::string item = settings.substr(pos, end - pos);
+        pos = end + 1;
+        item.erase(std::min(item.find('#'), item.size()));
+        item.erase(0, item.find_first_not_of(" \t\r"));
+        item.erase(item.find_last_not_of(" \t\r") + 1);
+        if (item.empty()) {
+            continue;
+        }
+
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            throw std::runtime_error("Invalid cache setting: " + item);
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        if (key == "mem") {
+            mem_latency = parse_number(value);
+            continue;
+        }
+
+        size_t dot = key.find('.');
+        std::string level = key.substr(0, dot);
+        std::string field = (dot == std::string::npos) ? "" : key.substr(dot + 1);
+        CacheConfig *c = (level == "l1i") ? &l1i : (level == "l1d") ? &l1d : (level == "l2") ? &l2 : nullptr;
+        if (!c) {
+            throw std::runtime_error("Unknown cache setting: " + key);
+        }
+        if (field == "size") {
+            c->size = parse_size(value);
+        } else if (field == "assoc") {
+            c->assoc = parse_number(value);
+        } else if (field == "line") {
+            c->line = parse_number(value);
+        } else if (field == "latency") {
+            c->latency = parse_number(value);
+        } else if (field == "repl") {
+            if (value == "lru") {
+                c->repl = REPL_LRU;
+            } else if (value == "plru") {
+                c->repl = REPL_PLRU;
+            } else if (value == "random") {
+                c->repl = REPL_RANDOM;
+            } else {
+                throw std::runtime_error("Unknown replacement policy: " + value);
+            }
+        } else if (field == "write") {
+            if (value == "back") {
+                c->write_back = true;
+            } else if (value == "through") {
+                c->write_back = false;
+            } else {
+                throw std::runtime_error("Unknown write policy: " + value);
+            }
+        } else {
+            throw std::runtime_error("Unknown cache setting: " + key);
+        }
+    }
+}
+
+void CacheHierarchyConfig::parse_file(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Could not open cache configuration: " + path);
+    }
+    std::stringstream settings;
+    settings << file.rdbuf();
+    parse(settings.str());
+}
+
+Cache::Cache(const std::string &name, const CacheConfig &config, Cache *next, unsigned mem_latency, bool attribute) :
+    config(config), next(next), mem_latency(mem_latency), last_line(0), last_way(nullptr), rng(0x9e3779b9),
+    attribute(attribute), shared(false) {
+    if (!is_pow2(config.line) || config.line < 4 || !is_pow2(config.assoc) || config.assoc > CACHE_MAX_ASSOC ||
+        !is_pow2(config.size) || config.size < config.line * config.assoc) {
+        throw std::runtime_error("Invalid " + name + " geometry: size, associativity and line size must be powers "
+                                 "of two, with lines of at least 4 bytes, at most " +
+                                 std::to_string(CACHE_MAX_ASSOC) + " ways and at least one set");
+    }
+    if (next && next->config.line < config.line) {
+        throw std::runtime_error("The lines of " + name + " must not be larger than those of the next level");
+    }
+    unsigned sets = config.size / (config.line * config.assoc);
+    line_shift = log2u(config.line);
+    assoc_shift = log2u(config.assoc);
+    set_mask = sets - 1;
+    tags.assign(sets * config.assoc, 0);
+    if (config.repl == REPL_LRU) {
+        ranks.resize(sets * config.assoc);
+        for (size_t i = 0; i < ranks.size(); ++i) {
+            ranks[i] = i % config.assoc;
+        }
+    } else if (config.repl == REPL_PLRU) {
+        trees.assign(sets, 0);
+    }
+    stats = CacheStats{name, 0, 0, 0, 0, 0, 0};
+}
+
+void Cache::touch(uint32_t set, unsigned way) {
+    unsigned assoc = config.assoc;
+    if (config.repl == REPL_LRU) {
+        // Ways more recent than this one age by one
+        uint8_t *rank = &ranks[set * assoc];
+        uint8_t old = rank[way];
+        for (unsigned w = 0; w < assoc; ++w) {
+            rank[w] += (rank[w] < old);
+        }
+        rank[way] = 0;
+    } else if (config.repl == REPL_PLRU) {
+        // Point every node on the path away from this way (node i has children 2i and 2i+1)
+        uint64_t &tree = trees[set];
+        unsigned node = 1;
+        for (unsigned bit = assoc >> 1; bit; bit >>= 1) {
+            bool right = way & bit;
+            tree = right ? (tree & ~(1ull << node)) : (tree | (1ull << node));
+            node = 2 * node + right;
+        }
+    }
+}
+
+unsigned Cache::victim(uint32_t set) {
+    unsigned assoc = config.assoc;
+    const uint32_t *ways = &tags[set * assoc];
+    for (unsigned w = 0; w < assoc; ++w) {
+        if (!(ways[w] & LINE_VALID)) {
+            return w;
+        }
+    }
+    switch (config.repl) {
+        case REPL_LRU: {
+            const uint8_t *rank = &ranks[set * assoc];
+            return std::max_element(rank, rank + assoc) - rank;
+        }
+        case REPL_PLRU: {
+            uint64_t tree = trees[set];
+            unsigned node = 1;
+            while (node < assoc) {
+                node = 2 * node + ((tree >> node) & 1);
+            }
+            return node - assoc;
+        }
+        default:
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            return rng & (assoc - 1);
+    }
+}
+
+unsigned Cache::miss(uint32_t address, bool write, xlen_t pc) {
+    uint32_t line = address & ~(config.line - 1);
+    uint32_t set = (address >> line_shift) & set_mask;
+    uint32_t *ways = &tags[set << assoc_shift];
+    if (write) {
+        stats.write_misses++;
+    } else {
+        stats.read_misses++;
+    }
+    if (attribute) {
+        miss_pcs[pc]++;
+    }
+    if (write && !config.write_back) {
+        if (next) {
+            below(address, true, pc); // No write-allocate
+        }
+        return config.latency;
+    }
+
+    unsigned cycles = config.latency + (next ? below(line, false, pc) : mem_latency);
+    unsigned w = victim(set);
+    if (ways[w] & LINE_VALID) {
+        stats.evictions++;
+        if (ways[w] & LINE_DIRTY) {
+            stats.writebacks++;
+            if (next) {
+                below(ways[w] & ~(config.line - 1), true, pc);
+            }
+        }
+    }
+    ways[w] = line | LINE_VALID | (write ? LINE_DIRTY : 0);
+    touch(set, w);
+    last_line = line | LINE_VALID;
+    last_way = &ways[w];
+    return cycles;
+}
+
+std::vector<std::pair<xlen_t, uint64_t>> Cache::top_misses(size_t n) const {
+    std::vector<std::pair<xlen_t, uint64_t>> top(miss_pcs.begin(), miss_pcs.end());
+    auto more = [](const std::pair<xlen_t, uint64_t> &a, const std::pair<xlen_t, uint64_t> &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+    n = std::min(n, top.size());
+    std::partial_sort(top.begin(), top.begin() + n, top.end(), more);
+    top.resize(n);
+    return top;
+}
+
+CacheHierarchy::CacheHierarchy(const CacheHierarchyConfig &config, const CacheHierarchy *shared_with) :
+    l2(shared_with ? shared_with->l2 :
+       config.l2.size ? std::make_shared<Cache>("l2", config.l2, nullptr, config.mem_latency, config.attribute) : nullptr),
+    l1i("l1i", config.l1i, l2.get(), config.mem_latency, config.attribute),
+    l1d("l1d", config.l1d, l2.get(), config.mem_latency, config.attribute) {
+    if (shared_with && l2) {
+        l2->share();
+    }
+}
+
+std::vector<const Cache*> CacheHierarchy::levels() const {
+    std::vector<const Cache*> all = {&l1i, &l1d};
+    if (l2) {
+        all.push_back(l2.get());
+    }
+    return all;
+}
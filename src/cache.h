@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "defs.h"
+
+// Replacement policies
+enum repl_t {
+    REPL_LRU,       // Least recently used
+    REPL_PLRU,      // Tree pseudo-LRU
+    REPL_RANDOM
+};
+
+// Geometry and policies of one cache level
+struct CacheConfig {
+    unsigned size;          // Capacity in bytes (L2 only: 0 leaves the level out)
+    unsigned assoc;         // Ways per set
+    unsigned line;          // Line size in bytes
+    repl_t repl;
+    bool write_back;        // Write-back with write-allocate; otherwise write-through without write-allocate
+    unsigned latency;       // Hit latency in cycles
+};
+
+// Settings of the cache hierarchy: split L1 caches per hart, an optional unified L2 shared by
+// the harts, then memory
+struct CacheHierarchyConfig {
+    CacheConfig l1i = {16 * 1024, 2, 64, REPL_LRU, true, 1};
+    CacheConfig l1d = {16 * 1024, 4, 64, REPL_LRU, true, 1};
+    CacheConfig l2 = {256 * 1024, 8, 64, REPL_LRU, true, 8};
+    unsigned mem_latency = 60;  // Cycles to fetch a line from memory
+    bool attribute = false;     // Count misses by instruction address
+
+    // Apply settings separated by commas or newlines, e.g. "l1d.size=8k,l1d.repl=plru,mem=100"
+    // (keys: <level>.size .assoc .line .repl .write .latency, and mem; # starts a comment);
+    // throws on bad input
+    void parse(const std::string &settings);
+
+    // Apply the settings of a file
+    void parse_file(const std::string &path);
+};
+
+// Event counts of one cache level
+struct CacheStats {
+    std::string name;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_misses;
+    uint64_t write_misses;
+    uint64_t evictions;     // Valid lines replaced
+    uint64_t writebacks;    // Dirty lines written to the next level
+};
+
+// One set-associative cache level. Only tags are kept, no data. The tag array is a flat
+// structure of arrays: each set's ways are adjacent words holding the line address with
+// the valid and dirty flags in its offset bits, so a lookup scans one or two host cache
+// lines. Replacement state lives in separate arrays (one rank byte per way for LRU, one
+// tree word per set for PLRU) that are only touched on the chosen way. Runs of accesses to
+// one line, the common case for fetches and sequential data, skip the lookup altogether.
+class Cache {
+    private:
+        // Flags kept in the offset bits of a tag (lines are at least 4 bytes)
+        static constexpr uint32_t LINE_VALID = 0b01;
+        static constexpr uint32_t LINE_DIRTY = 0b10;
+
+        CacheConfig config;
+        Cache *next;                    // Next level (nullptr: memory)
+        unsigned mem_latency;
+        unsigned line_shift;
+        unsigned assoc_shift;
+        uint32_t set_mask;
+        std::vector<uint32_t> tags;     // Line address | LINE_VALID | LINE_DIRTY, by set then way
+        std::vector<uint8_t> ranks;     // LRU: recency rank of each way (0: most recent)
+        std::vector<uint64_t> trees;    // PLRU: tree bits of each set
+        uint32_t last_line;             // Tag of the line accessed last (always resident and most recent)
+        uint32_t *last_way;             // Its tag word
+        uint32_t rng;                   // Random replacement state
+        bool attribute;
+        std::unordered_map<xlen_t, uint64_t> miss_pcs;
+        CacheStats stats;
+        bool shared;                    // Accessed by the levels above of several harts, under lock
+        std::mutex lock;
+
+        // Record a use of a way
+        void touch(uint32_t set, unsigned way);
+
+        // Way to fill in a set
+        unsigned victim(uint32_t set);
+
+        // Handle a miss on a line
+        unsigned miss(uint32_t address, bool write, xlen_t pc);
+
+        // Access the next level (which must exist)
+        unsigned below(uint32_t address, bool write, xlen_t pc) {
+            if (!next->shared) {
+                return next->access(address, write, pc);
+            }
+            std::lock_guard<std::mutex> guard(next->lock);
+            return next->access(address, write, pc);
+        }
+
+    public:
+        Cache(const std::string &name, const CacheConfig &config, Cache *next, unsigned mem_latency, bool attribute);
+
+        // Access the line holding address for the instruction at pc; returns the cycles
+        // until the data is available (stores are buffered: write-throughs and write-backs
+        // to the next level cost nothing)
+        unsigned access(uint32_t address, bool write, xlen_t pc) {
+            uint32_t want = (address & ~(config.line - 1)) | LINE_VALID;
+            if (write) {
+                stats.writes++;
+            } else {
+                stats.reads++;
+            }
+            if (want == last_line && (!write || config.write_back)) {
+                *last_way |= write ? LINE_DIRTY : 0; // Same line again: no replacement state to update
+                return config.latency;
+            }
+
+            uint32_t set = (address >> line_shift) & set_mask;
+            uint32_t *ways = &tags[set << assoc_shift];
+            for (unsigned w = 0; w < config.assoc; ++w) {
+                if ((ways[w] & ~LINE_DIRTY) == want) {
+                    touch(set, w);
+                    last_line = want;
+                    last_way = &ways[w];
+                    if (write) {
+                        if (config.write_back) {
+                            ways[w] |= LINE_DIRTY;
+                        } else if (next) {
+                            below(address, true, pc);
+                        }
+                    }
+                    return config.latency;
+                }
+            }
+            return miss(address, write, pc);
+        }
+
+        // Let the levels above of several harts access this one
+        void share() { shared = true; }
+
+        unsigned getLine() const { return config.line; }
+        unsigned getLatency() const { return config.latency; }
+        const CacheStats &getStats() const { return stats; }
+
+        // Instruction addresses with the most misses, most first
+        std::vector<std::pair<xlen_t, uint64_t>> top_misses(size_t n) const;
+};
+
+// Caches of one hart
+class CacheHierarchy {
+    private:
+        std::shared_ptr<Cache> l2;
+        Cache l1i;
+        Cache l1d;
+
+    public:
+        // Caches of a hart; with shared_with, its L1 caches sit on the L2 of that hierarchy
+        // (another hart of the same machine) instead of one of their own
+        CacheHierarchy(const CacheHierarchyConfig &config, const CacheHierarchy *shared_with = nullptr);
+
+        // Fetch the instruction at pc; returns the cycles beyond an L1I hit
+        unsigned fetch(xlen_t pc) {
+            return l1i.access(pc, false, pc) - l1i.getLatency();
+        }
+
+        // Data access of size bytes by the instruction at pc; returns the cycles beyond an L1D hit
+        unsigned data(xlen_t pc, uint32_t address, unsigned size, bool write) {
+            unsigned cycles = l1d.access(address, write, pc);
+            uint32_t last = address + size - 1;
+            if ((last ^ address) & ~(l1d.getLine() - 1)) {
+                cycles += l1d.access(last, write, pc); // Misaligned across two lines
+            }
+            return cycles - l1d.getLatency();
+        }
+
+        // Levels, from L1I down (a shared L2 is listed by every hart)
+        std::vector<const Cache*> levels() const;
+};
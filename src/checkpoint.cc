@@ -0,0 +1,111 @@
+#include "checkpoint.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Does the page hold only zeros?
+static bool is_zero_page(const uint8_t *p) {
+    static const uint8_t zeros[PAGE_SIZE] = {};
+    return memcmp(p, zeros, PAGE_SIZE) == 0;
+}
+
+uint32_t save_checkpoint(const std::string &path, const Core &core, Memory &mem, const Clint &clint) {
+    ckpt_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.version = CKPT_VERSION;
+    h.header_size = sizeof(h);
+    core.getState(h.core);
+    h.mtimecmp = clint.mtimecmp[h.core.hartid];
+    h.msip = clint.msip[h.core.hartid];
+
+    // Group the nonzero pages into runs
+    std::vector<ckpt_run_t> runs;
+    std::vector<uint32_t> pages;
+    for (uint32_t address : mem.touched_pages()) {
+        if (is_zero_page(mem.page(address))) {
+            continue;
+        }
+        if (runs.empty() || runs.back().address + runs.back().npages * PAGE_SIZE != address) {
+            runs.push_back({address, 0, 0});
+        }
+        runs.back().npages++;
+        pages.push_back(address);
+    }
+    h.nruns = runs.size();
+
+    uint64_t offset = sizeof(h) + runs.size() * sizeof(ckpt_run_t);
+    offset = (offset + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t data_start = offset;
+    for (ckpt_run_t &r : runs) {
+        r.offset = offset;
+        offset += (uint64_t)r.npages * PAGE_SIZE;
+    }
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("Could not create checkpoint file: " + path);
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && (runs.empty() || fwrite(runs.data(), sizeof(ckpt_run_t), runs.size(), f) == runs.size());
+    ok = ok && fseek(f, data_start, SEEK_SET) == 0;
+    for (size_t i = 0; ok && i < pages.size(); ++i) {
+        ok = fwrite(mem.page(pages[i]), PAGE_SIZE, 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok) {
+        throw std::runtime_error("Could not write checkpoint file: " + path);
+    }
+    return pages.size();
+}
+
+void restore_checkpoint(const std::string &path, Core &core, Memory &mem, Clint &clint) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open checkpoint file: " + path);
+    }
+    ckpt_header_t h;
+    std::vector<ckpt_run_t> runs;
+    try {
+        if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) != 0) {
+            throw std::runtime_error("Not a checkpoint file: " + path);
+        }
+        if (h.version != CKPT_VERSION || h.header_size != sizeof(h)) {
+            throw std::runtime_error("Checkpoint file from an incompatible version: " + path);
+        }
+        if (h.core.hartid >= CLINT_MAX_HARTS) {
+            throw std::runtime_error("Invalid checkpoint file: " + path);
+        }
+        runs.resize(h.nruns);
+        ssize_t size = runs.size() * sizeof(ckpt_run_t);
+        if (size && pread(fd, runs.data(), size, sizeof(h)) != size) {
+            throw std::runtime_error("Truncated checkpoint file: " + path);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw std::runtime_error("Could not read checkpoint file: " + path);
+        }
+        for (const ckpt_run_t &r : runs) {
+            if (r.offset + (uint64_t)r.npages * PAGE_SIZE > (uint64_t)st.st_size) {
+                throw std::runtime_error("Truncated checkpoint file: " + path);
+            }
+        }
+
+        // The mappings keep the file open after fd is closed
+        for (const ckpt_run_t &r : runs) {
+            mem.load_image(r.address, fd, r.offset, (size_t)r.npages * PAGE_SIZE);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    core.setState(h.core);
+    clint.mtimecmp[h.core.hartid] = h.mtimecmp;
+    clint.msip[h.core.hartid] = h.msip;
+}
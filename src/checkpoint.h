@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "core.h"
+#include "memory.h"
+#include "device.h"
+
+// Checkpoint file layout:
+//   ckpt_header_t
+//   ckpt_run_t[nruns]      runs of consecutive nonzero pages, by ascending address
+//   page data              each run's pages back to back, starting on a page boundary
+// Pages that hold only zeros are left out. Page data is stored uncompressed and aligned so
+// that a restore can map it straight into an mmap-backed memory.
+#define CKPT_MAGIC      "PLRSCKPT"
+#define CKPT_VERSION    1
+
+struct ckpt_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(ckpt_header_t): the layout is that of the writing build
+    core_state_t core;
+    uint64_t mtimecmp;          // CLINT registers of the hart
+    uint32_t msip;
+    uint32_t nruns;             // Entries in the run table
+};
+
+struct ckpt_run_t {
+    uint32_t address;           // Guest address of the first page
+    uint32_t npages;
+    uint64_t offset;            // File offset of the page data
+};
+
+// Write the state of a single-hart machine to path; returns the number of pages saved
+uint32_t save_checkpoint(const std::string &path, const Core &core, Memory &mem, const Clint &clint);
+
+// Load a checkpoint into a fresh memory and reset core and clint to it
+void restore_checkpoint(const std::string &path, Core &core, Memory &mem, Clint &clint);
@@ -1,56 +1,365 @@
 #include "core.h"
+#include "exec.h"
+#include "replay.h"
+#include <algorithm>
 
-enum instruction_type {
-    RV_LD = 0x03,
-    RV_ST = 0x23,
-    RV_LUI = 0x37,
-    RV_AUIPC = 0x17,
-    RV_JAL = 0x6F,
-    RV_JALR = 0x67,
-    RV_BR = 0x63,
-    RV_REG = 0x33,
-    RV_IMM = 0x13,
-    RV_SYS = 0x73
+// Handler table indexed by uop_id_t
+const uop_fn_t Core::handlers[OP_COUNT] = {
+#define UOP_HANDLER(name) &Core::handler<OP_##name>,
+    UOP_LIST(UOP_HANDLER)
+#undef UOP_HANDLER
 };
 
-Core::Core(Memory *mem) {
+Core::Core(Memory *mem, uint32_t hartid) {
     this->mem = mem; // Initialize the memory pointer
+    this->hartid = hartid;
+    this->engine = ENGINE_INTERP;
+    this->jit = nullptr;
+    this->timing = nullptr;
+    this->caches = nullptr;
+    this->bpred = nullptr;
+    this->trace = nullptr;
+    this->profiler = nullptr;
+    this->detailed = true;
+    this->bus = nullptr;
+    this->clint = nullptr;
+    this->timekeeper = true;
+    this->replay = nullptr;
+    this->dma_pending = false;
+    this->dma_lo = this->dma_hi = 0;
+    this->watch_stop = false;
+    this->code_pages.assign(1u << (32 - PAGE_SHIFT), 0);
+    this->watch_pages.assign(1u << (32 - PAGE_SHIFT), 0);
     reset();
 }
     
 Core::~Core() {
+    delete jit;
+    delete timing;
+    delete caches;
+    delete bpred;
+    delete profiler;
 }
 
-uint32_t Core::mem_read (uint32_t address) {
-    // Read a 32-bit word from memory at the specified address
-    uint32_t value = mem->read(address & ~0b11); // Align to 4-byte boundary
+uint32_t Core::mem_load_slow(uint32_t address, unsigned size) {
+    uint32_t off = address & (PAGE_SIZE - 1);
+    uint32_t value = 0;
+    if (off > PAGE_SIZE - size) {
+        // Crosses into the next page: assemble it byte by byte
+        for (unsigned i = 0; i < size; ++i) {
+            value |= (uint32_t)mem_load<uint8_t>(address + i) << (8 * i);
+        }
+        return value;
+    }
+
+    if (watch_pages[address >> PAGE_SHIFT]) {
+        // Never mapped, so that every access is checked
+        if (bus && bus->is_io(address)) {
+            value = io_load(address, size);
+        } else {
+            memcpy(&value, mem->page(address) + off, size);
+        }
+        if (watch_pages[address >> PAGE_SHIFT] & WATCH_READ) {
+            check_watch(address, size, WATCH_READ, value);
+        }
+        return value;
+    }
+
+    if (bus && bus->is_io(address)) {
+        return io_load(address, size); // Never mapped
+    }
+
+    // Map the page for direct reads
+    tlb_entry_t &e = tlb_rd[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    e.tag = address & ~(PAGE_SIZE - 1);
+    e.host = mem->page(address);
+    memcpy(&value, e.host + off, size);
+    return value;
+}
+
+void Core::mem_store_slow(uint32_t address, uint32_t value, unsigned size) {
+    uint32_t off = address & (PAGE_SIZE - 1);
+    if (off > PAGE_SIZE - size) {
+        // Crosses into the next page: store it byte by byte
+        for (unsigned i = 0; i < size; ++i) {
+            mem_store<uint8_t>(address + i, value >> (8 * i));
+        }
+        return;
+    }
+
+    if (watch_pages[address >> PAGE_SHIFT] & WATCH_WRITE) {
+        check_watch(address, size, WATCH_WRITE, value);
+    }
+
+    if (bus && bus->is_io(address)) {
+        io_store(address, value, size); // Never mapped
+        return;
+    }
+
+    uint8_t *host = mem->page(address);
+    if (mem->reservation_page(address)) {
+        reserved_store(host + off, address, value, size); // Breaks the LR/SC reservations on the word
+    } else {
+        memcpy(host + off, &value, size);
+    }
+
+    if (code_pages[address >> PAGE_SHIFT]) {
+        invalidate_code(address, size); // Self-modifying code
+    } else if (!watch_pages[address >> PAGE_SHIFT]) {
+        map_writes(address, host); // Plain data page: map it for direct writes
+    }
+}
+
+void Core::invalidate_code(uint32_t address, unsigned size) {
+    // Drop the predecoded copies of the words written if they are cached
+    for (uint32_t word = address & ~0b11; word <= ((address + size - 1) & ~0b11); word += 4) {
+        icache_entry_t &e = icache[(word >> 2) & (ICACHE_SIZE - 1)];
+        if ((e.uop.pc >> 2) == (word >> 2)) {
+            e.uop.pc = ICACHE_INVALID;
+        }
+        if (bcache.is_code(word) && bcache.invalidate(word) && jit) {
+            jit->invalidate(word); // Translations are made from the blocks, so only theirs can be
+        }
+    }
+}
+
+void Core::dmaWritten(uint32_t address, uint64_t size) {
+    uint64_t end = (uint64_t)address + size;
+    if (dma_pending) {
+        dma_lo = std::min<uint64_t>(dma_lo, address);
+        dma_hi = std::max<uint64_t>(dma_hi, end);
+    } else {
+        dma_lo = address;
+        dma_hi = end;
+    }
+    dma_pending = true;
+}
+
+void Core::apply_dma() {
+    for (uint64_t page = dma_lo >> PAGE_SHIFT; page <= (dma_hi - 1) >> PAGE_SHIFT; ++page) {
+        if (code_pages[page]) {
+            uint64_t lo = std::max<uint64_t>(dma_lo, page << PAGE_SHIFT);
+            uint64_t hi = std::min<uint64_t>(dma_hi, (page + 1) << PAGE_SHIFT);
+            invalidate_code(lo, hi - lo);
+        }
+    }
+    dma_pending = false;
+}
+
+void Core::check_watch(uint32_t address, unsigned size, int kind, xlen_t value) {
+    if (watch_stop) {
+        return; // Report the first access of the instruction
+    }
+    for (const watchpoint_t &w : watchpoints) {
+        if ((w.kind & kind) && address < (uint64_t)w.address + w.len && w.address < (uint64_t)address + size) {
+            watch_hit = watch_hit_t{w, address, size, kind, value};
+            watch_stop = true;
+            halt = true; // Engines stop after the access
+            return;
+        }
+    }
+}
+
+int Core::halt_code() {
+    if (!watch_stop) {
+        return RC_EXIT;
+    }
+    watch_stop = false;
+    halt = bus && bus->stop_requested(); // Still stopped if a device asked for it meanwhile
+    return RC_WATCH;
+}
+
+uint32_t Core::io_load(uint32_t address, unsigned size) {
+    std::lock_guard<std::mutex> guard(bus->lock);
+    const DeviceRegion *r = bus->find(address);
+    if (r) {
+        if (replay && replay->replaying()) {
+            return replay->replay_read(hartid, address); // Device state may differ from the recording
+        }
+        uint32_t value = r->dev->read(address - r->base, size);
+        if (replay) {
+            replay->log_read(hartid, address, value);
+        }
+        return value;
+    }
+    uint32_t value = 0;
+    mem->read_bytes(address, &value, size);
     return value;
 }
 
-void Core::mem_write (uint32_t address, uint32_t value, uint8_t mask){
-    // Write a 32-bit word to memory at the specified address
-    if (address == (UINT32_MAX & ~0b11)) { // Check if writing to last word
-        printf("%c", value & 0xFF); // Print the character
-        return; // Ignore writes to address -1
+void Core::io_store(uint32_t address, uint32_t value, unsigned size) {
+    std::lock_guard<std::mutex> guard(bus->lock);
+    const DeviceRegion *r = bus->find(address);
+    if (!r) {
+        mem->write_bytes(address, &value, size);
+        return;
+    }
+    r->dev->write(address - r->base, value, size);
+    if (dma_pending) {
+        apply_dma(); // Before the engines go on with code the device may have replaced
+    }
+    if (bus->stop_requested()) {
+        halt = true; // Engines stop after the store
+    }
+}
+
+void Core::flush_tlb() {
+    for (int i = 0; i < TLB_SIZE; ++i) {
+        tlb_rd[i].tag = TLB_INVALID;
+        tlb_wr[i].tag = TLB_INVALID;
     }
-    mem->write(address & ~0b11, value, mask); // Align to 4-byte boundary
+}
+
+void Core::flush_icache() {
+    for (int i = 0; i < ICACHE_SIZE; ++i) {
+        icache[i].uop.pc = ICACHE_INVALID;
+    }
+}
+
+void Core::flush_code() {
+    flush_icache();
+    bcache.flush(); // The JIT follows the block cache epoch
 }
 
 void Core::reset(xlen_t pc) { 
     this->pc = pc;
-    for (int i = 0; i < 32; ++i) {
+    this->ir = 0;
+    this->instret = 0;
+    this->halt = false;
+    this->watch_stop = false;
+    this->resv_valid = false;
+    this->resv_seq_valid = false;
+    mstatus = mie = mtvec = mscratch = mepc = mcause = mtval = 0;
+    for (int i = 0; i < 33; ++i) {
         rf[i] = 0; 
     }
+    flush_icache();
+    bcache.flush();
+    bcache.clear_class_totals();
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        class_counts[c] = 0;
+    }
+    flush_tlb();
+}
+
+void Core::enableTiming(const PipelineConfig &config) {
+    delete timing;
+    timing = new Pipeline(config);
+}
+
+void Core::enableCaches(const CacheHierarchyConfig &config, const Core *shared_with) {
+    // May throw on a bad geometry
+    CacheHierarchy *created = new CacheHierarchy(config, shared_with ? shared_with->caches : nullptr);
+    delete caches;
+    caches = created;
+}
+
+void Core::enableBranchPredictor(const BranchPredictorConfig &config) {
+    BranchPredictor *created = new BranchPredictor(config);
+    delete bpred;
+    bpred = created;
+}
+
+void Core::enableProfiler(const SymbolTable *symbols) {
+    delete profiler;
+    profiler = new Profiler(symbols, pc, instret, getCycles());
+    flush_code(); // Blocks count their runs on the profiler they were translated for
+}
+
+void Core::setBreakpoint(xlen_t pc, bool set) {
+    if (set) {
+        breakpoints.insert(pc);
+    } else {
+        breakpoints.erase(pc);
+    }
+    invalidate_code(pc, 4); // Decode it again, with or without the EBREAK
+}
+
+void Core::addWatchpoint(xlen_t address, uint32_t len, int kind) {
+    len = std::max(len, 1u);
+    watchpoints.push_back(watchpoint_t{address, len, kind});
+    for (uint64_t page = address >> PAGE_SHIFT; page <= ((uint64_t)address + len - 1) >> PAGE_SHIFT; ++page) {
+        watch_pages[page & ((1u << (32 - PAGE_SHIFT)) - 1)] |= kind;
+    }
+    flush_tlb(); // Unmap the pages
+}
+
+bool Core::removeWatchpoint(xlen_t address, uint32_t len, int kind) {
+    len = std::max(len, 1u);
+    for (size_t i = 0; i < watchpoints.size(); ++i) {
+        const watchpoint_t &w = watchpoints[i];
+        if (w.address == address && w.len == len && w.kind == kind) {
+            watchpoints.erase(watchpoints.begin() + i);
+
+            // Mark the pages again from the remaining watchpoints
+            std::fill(watch_pages.begin(), watch_pages.end(), 0);
+            std::vector<watchpoint_t> rest;
+            rest.swap(watchpoints);
+            for (const watchpoint_t &r : rest) {
+                addWatchpoint(r.address, r.len, r.kind);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void Core::debugWrite(uint32_t address, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        mem->store8(address + i, data[i]);
+        if (code_pages[(address + i) >> PAGE_SHIFT]) {
+            invalidate_code(address + i, 1);
+        }
+    }
+}
+
+void Core::getState(core_state_t &st) const {
+    st.pc = pc;
+    for (int i = 0; i < 32; ++i) {
+        st.rf[i] = rf[i];
+    }
+    st.instret = instret;
+    st.mstatus = mstatus;
+    st.mie = mie;
+    st.mtvec = mtvec;
+    st.mscratch = mscratch;
+    st.mepc = mepc;
+    st.mcause = mcause;
+    st.mtval = mtval;
+    st.hartid = hartid;
+}
+
+void Core::setState(const core_state_t &st) {
+    reset(st.pc);
+    for (int i = 0; i < 32; ++i) {
+        rf[i] = st.rf[i];
+    }
+    instret = st.instret; // Class counts start over
+    mstatus = st.mstatus;
+    mie = st.mie;
+    mtvec = st.mtvec;
+    mscratch = st.mscratch;
+    mepc = st.mepc;
+    mcause = st.mcause;
+    mtval = st.mtval;
+    hartid = st.hartid;
+}
+
+void Core::getClassCounts(uint64_t counts[CLASS_COUNT]) const {
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        counts[c] = class_counts[c];
+    }
+    bcache.count_classes(counts);
 }
 
 void Core::dumpRF(bool miniview) {
     if (miniview) {
-        printf("PC: 0x%08x    IR: 0x%08x\n", pc, instr.value);    
+        printf("PC: 0x%08x    IR: 0x%08x\n", pc, ir);    
         return;
     }
 
     printf("------------------------------------------------\n");
-    printf("PC: 0x%08x    IR: 0x%08x\n", pc, instr.value);
+    printf("PC: 0x%08x    IR: 0x%08x\n", pc, ir);
     printf("------------------------------------------------\n");
     printf("x0  (zero) : 0x%08x    x16 (a6)   : %08x\n", rf[0], rf[16]);
     printf("x1  (ra)   : 0x%08x    x17 (a7)   : %08x\n", rf[1], rf[17]);
@@ -70,228 +379,114 @@ void Core::dumpRF(bool miniview) {
     printf("x15 (a5)   : 0x%08x    x31 (t6)   : %08x\n", rf[15], rf[31]);
 }
 
-int Core::tick() { 
-    // Implement the core's behavior during a clock tick
+template<int OP>
+int Core::handler(Core *core, const uop_t &u) {
+    core->pc = core->exec<OP>(u);
+    return (OP == OP_EBREAK) ? RC_EBREAK : 0;
+}
 
-    // Fetch the next instruction from memory
-    instr.value = mem_read(pc); 
-    
-    // Increment the program counter by 4 bytes (assuming 32-bit instructions)
-    xlen_t pc_next = pc + 4; 
-
-    // Decode the fetched instruction
-    instr.opcode = BIT_FIELD(instr.value, 6, 0);               
-    instr.funct3 = BIT_FIELD(instr.value, 14, 12); 
-    instr.funct7 = BIT_FIELD(instr.value, 31, 25); 
-    instr.rs1_s  = BIT_FIELD(instr.value, 19, 15); 
-    instr.rs2_s  = BIT_FIELD(instr.value, 24, 20); 
-    instr.rd_s   = BIT_FIELD(instr.value, 11, 7);  
-    instr.imm_i  = BIT_FIELD_SIGNED(instr.value, 31, 20); 
-    instr.imm_s  = BIT_FIELD_SIGNED(instr.value, 31, 25) << 5 | BIT_FIELD(instr.value, 11, 7); 
-    instr.imm_u  = BIT_FIELD(instr.value, 31, 12) << 12; 
-    instr.imm_j  = BIT_FIELD_SIGNED(instr.value, 31, 31) << 20 | BIT_FIELD(instr.value, 19, 12) << 12 | BIT_FIELD(instr.value, 20, 20) << 11 | BIT_FIELD(instr.value, 30, 21) << 1; 
-    instr.imm_b  = BIT_FIELD_SIGNED(instr.value, 31, 31) << 12 | BIT_FIELD(instr.value, 7, 7) << 11 | BIT_FIELD(instr.value, 30, 25) << 5 | BIT_FIELD(instr.value, 11, 8) << 1; 
-
-    // Execute the decoded instruction
-    switch (instr.opcode) {
-        case RV_SYS: // System instructions
-            if (instr.funct3 == 0x0 && instr.imm_i == 0x1 && instr.rs1_s == 0x0 && instr.rd_s == 0x0) { // EBREAK
-                return -1; // Return -1 to indicate EBREAK
-            }
-            break;
-        
-        case RV_LD: // Load instructions
-            {
-                uint32_t mem_addr = rf[instr.rs1_s] + instr.imm_i;  
-                uint32_t mem_rdata = mem_read(mem_addr & ~0b11);   
-                
-                switch (instr.funct3) {
-                    case 0x0: // LB (Load Byte)
-                        rf[instr.rd_s] = BIT_FIELD_SIGNED(mem_rdata, 8*(mem_addr & 0b11)+7, 8*(mem_addr & 0b11));
-                        break;
-                    case 0x1: // LH (Load Halfword)
-                        rf[instr.rd_s] = BIT_FIELD_SIGNED(mem_rdata, 8*(mem_addr & 0b10)+15, 8*(mem_addr & 0b10));
-                        break;
-                    case 0x2: // LW (Load Word)
-                        rf[instr.rd_s] = mem_rdata;
-                        break;
-                    case 0x4: // LBU (Load Byte Unsigned)
-                        rf[instr.rd_s] = BIT_FIELD(mem_rdata, 8*(mem_addr & 0b11)+7, 8*(mem_addr & 0b11));
-                        break;
-                    case 0x5: // LHU (Load Halfword Unsigned)
-                        rf[instr.rd_s] = BIT_FIELD(mem_rdata, 8*(mem_addr & 0b10)+15, 8*(mem_addr & 0b10));
-                        break;
-                    default:
-                        break;
-                }
-            }
-            break;
-            
-        case RV_ST: // Store instructions
-            {
-                uint32_t store_addr = rf[instr.rs1_s] + instr.imm_s;     
-                uint8_t mem_mask = 0;
-                uint32_t mem_wdata = 0;
-                
-                switch (instr.funct3) {
-                    case 0x0: // SB (Store Byte)
-                        mem_mask = 0b0001 << BIT_FIELD(store_addr, 1, 0);
-                        mem_wdata = BIT_FIELD(rf[instr.rs2_s], 7, 0) << (8 * (store_addr & 0b11));
-                        break;
-                    case 0x1: // SH (Store Halfword)
-                        mem_mask = 0b0011 << BIT_FIELD(store_addr, 1, 0);
-                        mem_wdata = BIT_FIELD(rf[instr.rs2_s], 15, 0) << (8 * (store_addr & 0b10));
-                        break;
-                    case 0x2: // SW (Store Word)
-                        mem_mask = 0b1111; 
-                        mem_wdata = rf[instr.rs2_s];
-                        break;
-                    default:
-                        break;
-                }
-                mem_write(store_addr & ~0b11, mem_wdata, mem_mask); // Write the data to memory
-            }
-            break;
-
-        case RV_LUI: // Load Upper Immediate
-            rf[instr.rd_s] = instr.imm_u; 
-            break;
-        
-        case RV_AUIPC: // AUIPC (Add Upper Immediate to PC)
-            rf[instr.rd_s] = (xlen_t)((int32_t)pc + instr.imm_u); 
-            break;
-        
-        case RV_JAL: // JAL (Jump and Link)
-            rf[instr.rd_s] = pc_next; // Store the return address in the link register
-            pc_next = (xlen_t)((int32_t)pc + instr.imm_j) & ~0b1; // Jump to the target address
-            break;
-            
-        case RV_JALR: // JALR (Jump and Link Register)
-            rf[instr.rd_s] = pc_next; // Store the return address in the link register
-            pc_next = (xlen_t)((int32_t)rf[instr.rs1_s] + instr.imm_i) & ~0b1; // Jump to the target address
-            break;
-
-        case RV_BR: // Branch instructions
-            switch (instr.funct3) {
-                case 0x0: // BEQ (Branch if Equal)
-                    if (rf[instr.rs1_s] == rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b); 
-                    }
-                    break;
-                case 0x1: // BNE (Branch if Not Equal)
-                    if (rf[instr.rs1_s] != rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b);
-                    }
-                    break;
-                case 0x4: // BLT (Branch if Less Than)
-                    if ((int32_t)rf[instr.rs1_s] < (int32_t)rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b); 
-                    }
-                    break;
-                case 0x5: // BGE (Branch if Greater Than or Equal)
-                    if ((int32_t)rf[instr.rs1_s] >= (int32_t)rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b);
-                    }
-                    break;
-                case 0x6: // BLTU (Branch if Less Than Unsigned)
-                    if (rf[instr.rs1_s] < rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b);
-                    }
-                    break;
-                case 0x7: // BGEU (Branch if Greater Than or Equal Unsigned)
-                    if (rf[instr.rs1_s] >= rf[instr.rs2_s]) {
-                        pc_next = (xlen_t)((int32_t)pc + instr.imm_b);
-                    }
-                    break;
-                default:
-                    break;
-            }
-            break;
-        
-        case RV_REG: // Register arithmetic instructions
-            switch (instr.funct3) {
-                case 0x0: // ADD (Add) or SUB (Subtract)
-                    if (instr.funct7 == 0x00) {
-                        rf[instr.rd_s] = rf[instr.rs1_s] + rf[instr.rs2_s]; 
-                    } else if (instr.funct7 == 0x20) {
-                        rf[instr.rd_s] = rf[instr.rs1_s] - rf[instr.rs2_s]; 
-                    }
-                    break;
-                case 0x1: // SLL (Shift Left Logical)
-                    rf[instr.rd_s] = rf[instr.rs1_s] << (rf[instr.rs2_s] & 0x1F); 
-                    break;
-                case 0x2: // SLT (Set Less Than)
-                    rf[instr.rd_s] = ((int32_t)rf[instr.rs1_s] < (int32_t)rf[instr.rs2_s]); 
-                    break;
-                case 0x3: // SLTU (Set Less Than Unsigned)
-                    rf[instr.rd_s] = (rf[instr.rs1_s] < rf[instr.rs2_s]); 
-                    break;
-                case 0x4: // XOR (XOR)
-                    rf[instr.rd_s] = rf[instr.rs1_s] ^ rf[instr.rs2_s]; 
-                    break;
-                case 0x5: // SRL/SRA (Shift Right Logical/Arithmetic)
-                    if (instr.funct7 == 0x00) {
-                        rf[instr.rd_s] = rf[instr.rs1_s] >> (rf[instr.rs2_s] & 0x1F);
-                    } else if (instr.funct7 == 0x20) {
-                        rf[instr.rd_s] = ((int32_t)rf[instr.rs1_s]) >> (rf[instr.rs2_s] & 0x1F); 
-                    }
-                    break;
-                case 0x6: // OR (OR)
-                    rf[instr.rd_s] = rf[instr.rs1_s] | rf[instr.rs2_s]; 
-                    break;
-                case 0x7: // AND (AND)
-                    rf[instr.rd_s] = rf[instr.rs1_s] & rf[instr.rs2_s]; 
-                    break;
-                default:
-                    break;
-            }
-            break;
-
-        case RV_IMM: // Immediate arithmetic instructions
-            switch (instr.funct3) {
-                case 0x0: // ADDI (Add Immediate)  
-                    rf[instr.rd_s] = rf[instr.rs1_s] + instr.imm_i;
-                    break;
-                case 0x1: // SLLI (Shift Left Logical Immediate)
-                    rf[instr.rd_s] = rf[instr.rs1_s] << (instr.imm_i & 0x1F); 
-                    break;
-                case 0x2: // SLTI (Set Less Than Immediate)
-                    rf[instr.rd_s] = ((int32_t)rf[instr.rs1_s] < instr.imm_i);
-                    break;
-                case 0x3: // SLTIU (Set Less Than Immediate Unsigned)
-                    rf[instr.rd_s] = (rf[instr.rs1_s] < (uint32_t)instr.imm_i);
-                    break;
-                case 0x4: // XORI (XOR Immediate)
-                    rf[instr.rd_s] = rf[instr.rs1_s] ^ instr.imm_i; 
-                    break;
-                case 0x5: // SRLI/SRAI (Shift Right Logical/Arithmetic Immediate)
-                    if (instr.funct7 == 0x00) {
-                        rf[instr.rd_s] = rf[instr.rs1_s] >> (instr.imm_i & 0x1F);
-                    } else if (instr.funct7 == 0x20) {
-                        rf[instr.rd_s] = ((int32_t)rf[instr.rs1_s]) >> (instr.imm_i & 0x1F);
-                    }
-                    break;
-                case 0x6: // ORI (OR Immediate)
-                    rf[instr.rd_s] = rf[instr.rs1_s] | instr.imm_i;
-                    break;
-                case 0x7: // ANDI (AND Immediate)
-                    rf[instr.rd_s] = rf[instr.rs1_s] & instr.imm_i;
-                    break;
-                default:
-                    break;
-            }
-            break;
-        default:
-            printf("Unknown opcode: %02x at PC: 0x%08x\n ", instr.opcode, pc);
-            throw std::runtime_error("Runtime Error"); // Handle unknown opcodes
-            break;
+inline void Core::model(const uop_t &u, uint32_t address, xlen_t data) {
+    unsigned fetch_miss = 0, data_miss = 0;
+    if (caches) {
+        fetch_miss = caches->fetch(u.pc);
+        uop_class_t c = uop_class(u.op);
+        if ((c == CLASS_LOAD || c == CLASS_STORE) && !(bus && bus->is_io(address))) {
+            data_miss = caches->data(u.pc, address, uop_access_size(u.op), c == CLASS_STORE);
+        }
+    }
+    bp_result_t prediction = bpred ? bpred->resolve(u, pc) : BP_NONE;
+    if (timing) {
+        timing->retire(u, pc, fetch_miss, data_miss, prediction);
+    }
+    if (trace) {
+        trace->insn(u, address, data, rf[u.rd]);
+    }
+    if (profiler) {
+        profiler->retire(u, pc, instret, getCycles());
+    }
+}
+
+template<bool MODELLED>
+inline int Core::step() {
+    // Look up the instruction in the predecode cache
+    icache_entry_t &e = icache[(pc >> 2) & (ICACHE_SIZE - 1)];
+
+    if (e.uop.pc != pc) {
+        // Miss: fetch and decode the instruction from memory
+        mark_code(pc);
+        fetch(e.uop, pc);
+        e.fn = handlers[e.uop.op];
+    }
+    ir = e.uop.value;
+
+    // The models need the uop and its data address as they were before execution
+    uop_t u;
+    uint32_t address = 0;
+    xlen_t data = 0;
+    if (MODELLED) {
+        u = e.uop;
+        address = rf[u.rs1] + (uop_is_atomic(u.op) ? 0 : u.imm);
+        data = rf[u.rs2];
+    }
+
+    // Execute the predecoded instruction
+    int rc = e.fn(this, e.uop);
+    instret += (rc == 0);
+    class_counts[uop_class(e.uop.op)] += (rc == 0);
+    if (MODELLED && rc == 0) {
+        model(u, address, data);
+    }
+    if (e.uop.op == OP_FENCE_I) {
+        flush_code();
     }
+    return halt ? halt_code() : rc;
+}
 
-    // Update the program counter to the next instruction
-    pc = pc_next;
+int Core::tick() {
+    return (modelled() || profiler || trace) ? step<true>() : step<false>();
+}
 
-    rf[0] = 0; // x0 is hardwired to 0
+int Core::run(uint64_t max_instrs) {
+    if (bus) {
+        if (timekeeper) {
+            bus->set_time(instret); // Device time advances with retired instructions, per slice
+        }
+        if (bus->stop_requested()) {
+            return RC_EXIT; // Stopped by another hart
+        }
+        if (dma_pending) {
+            std::lock_guard<std::mutex> guard(bus->lock);
+            apply_dma();
+        }
+    }
+    if (!replay || !replay->replaying()) {
+        check_interrupts(); // Replayed interrupts come from the log
+    }
+    if (interpreted()) {
+        // The models see every instruction: interpret, whatever the engine
+        int rc = 0;
+        for (uint64_t i = 0; i < max_instrs && rc == 0; ++i) {
+            rc = step<true>();
+        }
+        return rc;
+    }
 
-    // Return 0 to indicate successful execution of 1 cycle
-    return 0;
+    int rc = 0;
+    if (trace && engine != ENGINE_INTERP) {
+        // Engines record to the trace a block at a time and publish when they leave
+        rc = (engine == ENGINE_JIT) ? run_jit(max_instrs) : run_blocks<true>(max_instrs);
+        trace->publish();
+    } else if (engine == ENGINE_JIT) {
+        rc = run_jit(max_instrs);
+    } else if (engine != ENGINE_INTERP) {
+        rc = run_blocks<false>(max_instrs);
+    } else {
+        for (uint64_t i = 0; i < max_instrs && rc == 0; ++i) {
+            rc = tick();
+        }
+    }
+    if (profiler) {
+        profiler->charge(instret); // Translated blocks charge their frame only at calls and returns
+    }
+    return rc;
 }
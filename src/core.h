@@ -1,52 +1,400 @@
+#pragma once
 #include<stdint.h>
 #include"memory.h"
 #include"defs.h"
+#include"decode.h"
+#include"block.h"
+#include"jit.h"
+#include"device.h"
+#include"timing.h"
+#include"cache.h"
+#include"bpred.h"
+#include"trace.h"
+#include"profile.h"
+#include<stdio.h>
+#include<unordered_set>
 
-struct instr_t {
-    uint32_t value;     // 32 bits   // undecoded instruction
-    uint8_t  opcode;    // 7 bits
-    uint8_t  funct3;    // 3 bits
-    uint8_t  funct7;    // 7 bits
-    uint8_t  rs1_s;     // 5 bits
-    uint8_t  rs2_s;     // 5 bits
-    uint8_t  rd_s;      // 5 bits
-    int32_t  imm_i;     // 32 bits
-    int32_t  imm_s;     // 32 bits
-    int32_t  imm_u;     // 32 bits
-    int32_t  imm_j;     // 32 bits
-    int32_t  imm_b;     // 32 bits
+// Number of entries in the predecode cache (must be a power of 2)
+#define ICACHE_SIZE 8192
+
+// Tag of an empty predecode cache entry (PCs are always even)
+#define ICACHE_INVALID 0xFFFFFFFF
+
+// Number of entries in each software TLB (must be a power of 2)
+#define TLB_SIZE 256
+
+// Tag of an empty TLB entry (never matches a page-aligned address)
+#define TLB_INVALID 0xFFFFFFFF
+
+// Return codes of tick() and run() besides 0
+#define RC_EBREAK   -1  // EBREAK reached
+#define RC_EXIT     -3  // A device requested the end of the simulation
+#define RC_WATCH    -4  // A data watchpoint was hit (after the access)
+
+// Execution engines
+enum engine_t {
+    ENGINE_INTERP,  // Reference interpreter, one instruction per tick()
+    ENGINE_BLOCK,   // Basic-block translation with threaded dispatch
+    ENGINE_JIT      // Basic blocks compiled to x86-64 code
+};
+
+// Kinds of data watchpoints (bit mask)
+#define WATCH_READ   1
+#define WATCH_WRITE  2
+#define WATCH_ACCESS (WATCH_READ | WATCH_WRITE)
+
+// Data watchpoint over [address, address + len)
+struct watchpoint_t {
+    xlen_t address;
+    uint32_t len;
+    int kind;           // WATCH_*
+};
+
+// Data access that hit a watchpoint
+struct watch_hit_t {
+    watchpoint_t watch;
+    xlen_t address;     // Address accessed
+    unsigned size;
+    int kind;           // WATCH_READ or WATCH_WRITE
+    xlen_t value;       // Value read or written
+};
+
+class Core;
+class ReplayLog;
+
+// Instruction handler: executes a predecoded instruction, returns 0 or an exit code
+typedef int (*uop_fn_t)(Core *core, const uop_t &u);
+
+// Software TLB entry: guest page -> host page
+struct tlb_entry_t {
+    xlen_t   tag;   // Guest page address, or TLB_INVALID
+    uint8_t  *host; // Host address of the page
+};
+
+// Architectural state of a hart, as saved in checkpoints
+struct core_state_t {
+    xlen_t pc;
+    xlen_t rf[32];
+    uint64_t instret;
+    xlen_t mstatus, mie, mtvec, mscratch, mepc, mcause, mtval;
+    uint32_t hartid;
+};
+
+// Predecode cache entry
+struct icache_entry_t {
+    uop_t    uop;   // predecoded instruction
+    uop_fn_t fn;    // handler for uop.op
 };
 
 class Core {
+    friend class Jit;
+
     private:
         Memory *mem;    // Pointer to the memory object
         xlen_t pc;      // Program counter
-        xlen_t rf[32];  // Register file (32 registers)
-        instr_t instr;  // Instruction structure
+        xlen_t rf[33];  // Register file (32 registers + write sink for x0)
+        uint32_t ir;    // Last fetched instruction
+        uint64_t instret;   // Number of retired instructions
+        uint64_t class_counts[CLASS_COUNT]; // Instructions of each class retired by tick(), less blocks left early
+        engine_t engine;    // Engine used by run()
+
+        icache_entry_t icache[ICACHE_SIZE]; // Predecode cache, direct-mapped by PC
+        tlb_entry_t tlb_rd[TLB_SIZE];       // Pages that can be read directly
+        tlb_entry_t tlb_wr[TLB_SIZE];       // Pages that can be written directly (no code, no I/O)
+        std::vector<uint8_t> code_pages;    // Pages holding decoded instructions
+        BlockCache bcache;                  // Translated basic blocks
+        Jit *jit;                           // Native code translator (created on first use)
+        Pipeline *timing;                   // Pipeline timing model (nullptr: one cycle per instruction)
+        CacheHierarchy *caches;             // Cache model (nullptr: none)
+        BranchPredictor *bpred;             // Branch predictor model (nullptr: none)
+        TraceBuffer *trace;                 // Retired instruction trace (nullptr: none, not owned)
+        Profiler *profiler;                 // Guest profiler (nullptr: none)
+        bool detailed;                      // The models see the instructions (cleared to fast-forward)
+        DeviceBus *bus;                     // Memory-mapped devices (nullptr: all RAM)
+        Clint *clint;                       // Timer and software interrupt source (nullptr: none)
+        bool halt;                          // A device asked the simulation to stop
+        std::unordered_set<xlen_t> breakpoints; // PCs decoded as EBREAK for a debugger
+        std::vector<watchpoint_t> watchpoints;  // Data watchpoints
+        std::vector<uint8_t> watch_pages;   // Kinds of watchpoints on each page (never mapped in the TLBs)
+        bool watch_stop;                    // halt was set by a watchpoint
+        watch_hit_t watch_hit;              // Access that set watch_stop
+        bool timekeeper;                    // run() sets device time from this core's instret
+        ReplayLog *replay;                  // Log of the device inputs (nullptr: none, not owned)
+        std::atomic<bool> dma_pending;      // A device wrote RAM: decoded code in [dma_lo, dma_hi) may be stale
+        uint64_t dma_lo, dma_hi;            // Guarded by the bus lock
+
+        // LR/SC reservation of this hart
+        bool resv_valid;
+        uint32_t resv_addr;                 // Reserved word
+        uint32_t resv_value;                // Its value at the LR
+        bool resv_seq_valid;                // The word has a store sequence (RAM, aligned)
+        uint32_t resv_seq;                  // Its store sequence number at the LR: the SC fails after any store
+
+        // Machine-mode CSRs
+        uint32_t hartid;
+        xlen_t mstatus;
+        xlen_t mie;
+        xlen_t mtvec;
+        xlen_t mscratch;
+        xlen_t mepc;
+        xlen_t mcause;
+        xlen_t mtval;
+
+        // Typed data accesses through the TLBs (exec.h)
+        template<typename T> T mem_load(uint32_t address);
+        template<typename T> void mem_store(uint32_t address, T value);
+
+        // TLB miss, misaligned and I/O page handling for mem_load and mem_store
+        uint32_t mem_load_slow(uint32_t address, unsigned size);
+        void mem_store_slow(uint32_t address, uint32_t value, unsigned size);
+
+        // Accesses to I/O pages: device registers, or RAM sharing the page
+        uint32_t io_load(uint32_t address, unsigned size);
+        void io_store(uint32_t address, uint32_t value, unsigned size);
+
+        // Drop decoded copies of the words in [address, address + size) after a write to a code page
+        void invalidate_code(uint32_t address, unsigned size);
+
+        // Drop the decoded code overwritten by the DMA writes since the last call (bus lock held)
+        void apply_dma();
+
+        // Check an access to a watched page against the watchpoints, stopping the engines on a hit
+        void check_watch(uint32_t address, unsigned size, int kind, xlen_t value);
+
+        // Return code of an engine stopped by halt (a watchpoint stop is reported once)
+        int halt_code();
+
+        // Host address of the RAM word at address for a host-atomic access, or nullptr when the
+        // access is misaligned, hits an I/O page (then emulated with plain accesses) or a page
+        // holding LR/SC reservations (then emulated under the word's store sequence) (atomic.cc)
+        uint32_t *atomic_word(uint32_t address);
+
+        // Map a RAM page for direct writes unless it holds LR/SC reservations (atomic.cc)
+        void map_writes(uint32_t address, uint8_t *host);
+
+        // Store to a page holding LR/SC reservations, bumping the store sequence of the words
+        // written so that their reservations fail (atomic.cc)
+        void reserved_store(uint8_t *host, uint32_t address, uint32_t value, unsigned size);
+
+        // RV32A operations; they return the value for rd (atomic.cc)
+        xlen_t amo(int op, uint32_t address, xlen_t value);
+        xlen_t load_reserved(uint32_t address);
+        xlen_t store_conditional(uint32_t address, xlen_t value);
+
+        // Drop all decoded and translated code (FENCE.I)
+        void flush_code();
+
+        // Fetch the aligned instruction word containing address (exec.h)
+        uint32_t mem_read(uint32_t address);
+
+        // Fetch and decode the instruction at address, as an EBREAK if it has a breakpoint (exec.h)
+        void fetch(uop_t &u, xlen_t address);
+
+        // Invalidate all TLB entries
+        void flush_tlb();
+
+        // Note that the page containing address holds decoded instructions
+        void mark_code(xlen_t address) {
+            if (!code_pages[address >> PAGE_SHIFT]) {
+                code_pages[address >> PAGE_SHIFT] = 1;
+                tlb_wr[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)].tag = TLB_INVALID; // Stores must check for code
+            }
+        }
+
+        // Invalidate all predecoded instructions
+        void flush_icache();
+
+        // Execute a CSR instruction, returns the next PC (csr.cc)
+        xlen_t csr_op(const uop_t &u);
+
+        // Read or write a CSR; false if it does not exist (or is read-only, for writes)
+        bool csr_read(uint32_t csr, xlen_t &value);
+        bool csr_write(uint32_t csr, xlen_t value);
+
+        // Enter the trap handler for cause, returns its address
+        xlen_t trap(uint32_t cause, xlen_t tval, xlen_t epc);
+
+        // Return from the trap handler, returns mepc
+        xlen_t mret();
+
+        // Interrupts pending at the CLINT for this hart, as mip bits
+        xlen_t pending_interrupts();
 
-        // Read data from the specified address
-        uint32_t mem_read (uint32_t address);
+        // Take the highest-priority enabled pending interrupt, if any
+        void check_interrupts();
 
-        // Write data to the specified address
-        void mem_write (uint32_t address, uint32_t value, uint8_t mask = 0b1111);
- 
+        // Value of a CSR fed by the devices, logged or replayed when there is a replay log
+        xlen_t device_csr(xlen_t value);
+
+        // Load/store for a memory operation (exec.h)
+        template<int OP> xlen_t load(uint32_t address);
+        template<int OP> void store(uint32_t address, xlen_t value);
+
+        // Execute a predecoded instruction, returns the next PC (exec.h)
+        template<int OP> xlen_t exec(const uop_t &u);
+
+        // Handler wrapper for exec<OP>
+        template<int OP> static int handler(Core *core, const uop_t &u);
+
+        // Handler table indexed by uop_id_t
+        static const uop_fn_t handlers[OP_COUNT];
+
+        // Translate the basic block starting at pc
+        Block *translate(xlen_t pc);
+
+        // Find the translated block starting at pc, translating it if needed
+        Block *lookup_block(xlen_t pc);
+
+        // Is any model attached that must see every instruction?
+        bool modelled() const { return detailed && (timing || caches || bpred); }
+
+        // Must run() interpret to feed the models, profiler or trace? (Translated blocks feed
+        // the profiler and trace themselves.)
+        bool interpreted() const { return modelled() || ((profiler || trace) && engine == ENGINE_INTERP); }
+
+        // Execute one instruction with the interpreter, feeding the models if MODELLED
+        template<bool MODELLED> int step();
+
+        // Pass a retired instruction to the models, trace and profiler; address is its data
+        // address and data the value of rs2 before execution
+        void model(const uop_t &u, uint32_t address, xlen_t data);
+
+        // Run translated blocks until at least max_instrs have retired, recording them to
+        // the trace if TRACED
+        template<bool TRACED> int run_blocks(uint64_t max_instrs);
+
+        // Correct the class counts for a block left after retiring only its first retired instructions
+        void count_partial(Block *b, uint32_t retired) {
+            for (uint32_t i = retired; i < b->len; ++i) {
+                class_counts[uop_class(b->uops[i].op)]--;
+            }
+            b->skipped += b->len - retired;
+        }
+
+        // Run native translations until at least max_instrs have retired (jit.cc)
+        int run_jit(uint64_t max_instrs);
 
     public:
         // Constructor
-        Core(Memory *mem);
-        
+        Core(Memory *mem, uint32_t hartid = 0);
+
         // Destructor
         ~Core();
 
         // Reset the core with a new program counter
         void reset(xlen_t pc = 0);
 
-        // Simulate a clock tick
+        // Execute one instruction (through the models when enabled)
         int tick();
 
+        // Run about max_instrs instructions with the selected engine, returns 0 or an exit code
+        int run(uint64_t max_instrs);
+
+        // Continue after a device stop request (a checkpoint or fork marker) has been handled
+        void resume() { halt = false; }
+
+        // Time instructions with a pipeline model (run() then always interprets)
+        void enableTiming(const PipelineConfig &config);
+
+        // Timing model, or nullptr
+        const Pipeline *getTiming() const { return timing; }
+
+        // Simulate caches (run() then always interprets); miss latencies feed the timing model.
+        // With shared_with, the L2 is that core's (harts of one machine share it).
+        void enableCaches(const CacheHierarchyConfig &config, const Core *shared_with = nullptr);
+
+        // Cache model, or nullptr
+        const CacheHierarchy *getCaches() const { return caches; }
+
+        // Predict branches (run() then always interprets); mispredictions feed the timing model
+        void enableBranchPredictor(const BranchPredictorConfig &config);
+
+        // Branch predictor model, or nullptr
+        const BranchPredictor *getBranchPredictor() const { return bpred; }
+
+        // Record every retired instruction to a trace buffer (engines record whole blocks,
+        // so the code translated so far is dropped)
+        void enableTrace(TraceBuffer *trace) {
+            this->trace = trace;
+            flush_code();
+        }
+
+        // Count instructions from now on by pc and call stack, naming functions from symbols
+        void enableProfiler(const SymbolTable *symbols);
+
+        // Profiler, or nullptr
+        const Profiler *getProfiler() const { return profiler; }
+
+        // Feed the models (the default), or leave them idle and run() with the selected engine
+        void setDetailed(bool detailed) { this->detailed = detailed; }
+
+        // Add the instructions retired by each translated block since the last call to
+        // counts, by block address (block and JIT engines only)
+        void takeBlockCounts(std::unordered_map<xlen_t, uint64_t> &counts) { bcache.take_counts(counts); }
+
+        // Select the engine used by run()
+        void setEngine(engine_t engine) { this->engine = engine; }
+
+        // Route accesses to I/O pages through a device bus
+        void setBus(DeviceBus *bus) { this->bus = bus; bus->add_core(this); flush_tlb(); }
+
+        // A device wrote [address, address + size) of RAM (bus lock held). The hart that ran
+        // the device command drops its stale code when the store returns, the others when
+        // they start their next slice.
+        void dmaWritten(uint32_t address, uint64_t size);
+
+        // Take timer and software interrupts from a CLINT on the bus (checked at the start of run())
+        void setClint(Clint *clint) { this->clint = clint; }
+
+        // Let run() advance device time from this core's retired instructions (the default)
+        void setTimekeeper(bool timekeeper) { this->timekeeper = timekeeper; }
+
+        // Log device reads, device-fed CSRs and interrupts to a replay log, or take them from
+        // one being replayed (run() then leaves interrupts to the replayer)
+        void setReplay(ReplayLog *replay) { this->replay = replay; }
+
+        // Take an interrupt now (replayed interrupts)
+        void interrupt(uint32_t irq);
+
+        // Stop before the instruction at pc: run() and tick() then return RC_EBREAK with the
+        // pc there. Only decoding checks for breakpoints, so they cost nothing at run time.
+        void setBreakpoint(xlen_t pc, bool set);
+
+        // Is a breakpoint set at pc?
+        bool isBreakpoint(xlen_t pc) const { return breakpoints.count(pc) != 0; }
+
+        // Stop after data accesses of the given kinds to [address, address + len): run() and
+        // tick() then return RC_WATCH with the pc after the accessing instruction. Pages
+        // holding a watchpoint are kept out of the TLBs, so only their accesses are checked.
+        void addWatchpoint(xlen_t address, uint32_t len, int kind);
+
+        // Remove a watchpoint added with the same arguments; false if there is none
+        bool removeWatchpoint(xlen_t address, uint32_t len, int kind);
+
+        // Access that last returned RC_WATCH
+        const watch_hit_t &getWatchHit() const { return watch_hit; }
+
+        // Write guest memory on behalf of a debugger, dropping decoded copies of the bytes written
+        void debugWrite(uint32_t address, const uint8_t *data, size_t size);
+
         // Dump the register file
         void dumpRF(bool miniview = false);
 
+        // Save the architectural state
+        void getState(core_state_t &st) const;
+
+        // Resume from a saved state (decoded code and LR/SC reservations are dropped)
+        void setState(const core_state_t &st);
+
         xlen_t getPC() const { return pc; } // Get the current program counter
-        uint32_t getIR() const { return instr.value; } // Get the current instruction
+        uint32_t getIR() const { return ir; } // Get the current instruction
+        uint64_t getInstret() const { return instret; } // Get the number of retired instructions
+        uint64_t getCycles() const { return timing ? timing->getCycles() : instret; } // Simulated cycles (one per instruction without a timing model)
+        uint32_t getHartId() const { return hartid; } // Get the value of mhartid
+
+        // Get the number of retired instructions of each class
+        void getClassCounts(uint64_t counts[CLASS_COUNT]) const;
+        xlen_t getReg(int idx) const { return rf[idx]; } // Get a register value
+        void setReg(int idx, xlen_t value) { if (idx != 0) rf[idx] = value; } // Set a register (x0 stays zero)
+        void setPC(xlen_t pc) { this->pc = pc; } // Set the program counter
 };
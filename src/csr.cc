@@ -0,0 +1,146 @@
+#include "core.h"
+#include "csr.h"
+#include "replay.h"
+
+bool Core::csr_read(uint32_t csr, xlen_t &value) {
+    switch (csr) {
+        case CSR_MSTATUS:   value = mstatus | MSTATUS_MPP; break;
+        case CSR_MISA:      value = MISA_VALUE; break;
+        case CSR_MIE:       value = mie; break;
+        case CSR_MTVEC:     value = mtvec; break;
+        case CSR_MSCRATCH:  value = mscratch; break;
+        case CSR_MEPC:      value = mepc; break;
+        case CSR_MCAUSE:    value = mcause; break;
+        case CSR_MTVAL:     value = mtval; break;
+        case CSR_MIP:       value = device_csr(pending_interrupts()); break;
+
+        // Counters: one cycle per instruction, time from the CLINT
+        case CSR_MCYCLE:    case CSR_CYCLE:     value = getCycles(); break;
+        case CSR_MCYCLEH:   case CSR_CYCLEH:    value = getCycles() >> 32; break;
+        case CSR_MINSTRET:  case CSR_INSTRET:   value = instret; break;
+        case CSR_MINSTRETH: case CSR_INSTRETH:  value = instret >> 32; break;
+        case CSR_TIME:      value = device_csr(clint ? clint->get_time() : instret); break;
+        case CSR_TIMEH:     value = device_csr((clint ? clint->get_time() : instret) >> 32); break;
+
+        case CSR_MVENDORID: case CSR_MARCHID: case CSR_MIMPID:
+            value = 0;
+            break;
+        case CSR_MHARTID:   value = hartid; break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+bool Core::csr_write(uint32_t csr, xlen_t value) {
+    if (CSR_READ_ONLY(csr)) {
+        return false;
+    }
+    switch (csr) {
+        case CSR_MSTATUS:   mstatus = value & (MSTATUS_MIE | MSTATUS_MPIE); break;
+        case CSR_MIE:       mie = value & MIE_MASK; break;
+        case CSR_MTVEC:     mtvec = value & ~((value & 0b11) > 1 ? 0b11u : 0b10u); break; // Direct or vectored
+        case CSR_MSCRATCH:  mscratch = value; break;
+        case CSR_MEPC:      mepc = value & ~0b11; break;
+        case CSR_MCAUSE:    mcause = value; break;
+        case CSR_MTVAL:     mtval = value; break;
+
+        // Pending bits come from the CLINT; counters follow the simulation
+        case CSR_MISA: case CSR_MIP:
+        case CSR_MCYCLE: case CSR_MCYCLEH: case CSR_MINSTRET: case CSR_MINSTRETH:
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+xlen_t Core::csr_op(const uop_t &u) {
+    bool imm = (u.op >= OP_CSRRWI);
+    xlen_t src = imm ? u.rs1 : rf[u.rs1];
+    bool write = (u.op == OP_CSRRW || u.op == OP_CSRRWI || u.rs1 != 0); // CSRRS/CSRRC with x0 only read
+
+    xlen_t old = 0;
+    if (!csr_read(u.imm, old)) {
+        return trap(CAUSE_ILLEGAL_INSTR, u.value, u.pc);
+    }
+    if (write) {
+        xlen_t value = src;
+        if (u.op == OP_CSRRS || u.op == OP_CSRRSI) {
+            value = old | src;
+        } else if (u.op == OP_CSRRC || u.op == OP_CSRRCI) {
+            value = old & ~src;
+        }
+        if (!csr_write(u.imm, value)) {
+            return trap(CAUSE_ILLEGAL_INSTR, u.value, u.pc);
+        }
+    }
+    rf[u.rd] = old;
+    return u.pc + 4;
+}
+
+xlen_t Core::trap(uint32_t cause, xlen_t tval, xlen_t epc) {
+    mepc = epc;
+    mcause = cause;
+    mtval = tval;
+    mstatus = (mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0; // MPIE = MIE, MIE = 0
+
+    xlen_t base = mtvec & ~0b11;
+    if ((mtvec & 0b11) == 1 && (cause & CAUSE_INTERRUPT)) {
+        return base + 4 * (cause & ~CAUSE_INTERRUPT); // Vectored
+    }
+    return base;
+}
+
+xlen_t Core::mret() {
+    mstatus = ((mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE; // MIE = MPIE, MPIE = 1
+    return mepc;
+}
+
+xlen_t Core::pending_interrupts() {
+    if (!clint) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> guard;
+    if (bus) {
+        guard = std::unique_lock<std::mutex>(bus->lock); // Other harts may be writing the CLINT
+    }
+    xlen_t mip = 0;
+    if (clint->msip[hartid]) {
+        mip |= 1u << IRQ_MSI;
+    }
+    if (clint->get_time() >= clint->mtimecmp[hartid]) {
+        mip |= 1u << IRQ_MTI;
+    }
+    return mip;
+}
+
+void Core::check_interrupts() {
+    if (!(mstatus & MSTATUS_MIE) || !mie) {
+        return;
+    }
+    xlen_t irqs = pending_interrupts() & mie;
+    if (!irqs) {
+        return;
+    }
+
+    // Priority order: external, software, timer
+    static const int order[] = {IRQ_MEI, IRQ_MSI, IRQ_MTI};
+    for (int irq : order) {
+        if (irqs & (1u << irq)) {
+            if (replay) {
+                replay->log_interrupt(hartid, instret, irq);
+            }
+            pc = trap(CAUSE_INTERRUPT | irq, 0, pc);
+            return;
+        }
+    }
+}
+
+void Core::interrupt(uint32_t irq) {
+    pc = trap(CAUSE_INTERRUPT | irq, 0, pc);
+}
+
+xlen_t Core::device_csr(xlen_t value) {
+    return replay ? replay->csr(hartid, value) : value;
+}
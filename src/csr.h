@@ -0,0 +1,51 @@
+#pragma once
+
+// Machine-mode CSR numbers
+#define CSR_MSTATUS     0x300
+#define CSR_MISA        0x301
+#define CSR_MIE         0x304
+#define CSR_MTVEC       0x305
+#define CSR_MSCRATCH    0x340
+#define CSR_MEPC        0x341
+#define CSR_MCAUSE      0x342
+#define CSR_MTVAL       0x343
+#define CSR_MIP         0x344
+#define CSR_MCYCLE      0xB00
+#define CSR_MINSTRET    0xB02
+#define CSR_MCYCLEH     0xB80
+#define CSR_MINSTRETH   0xB82
+#define CSR_CYCLE       0xC00
+#define CSR_TIME        0xC01
+#define CSR_INSTRET     0xC02
+#define CSR_CYCLEH      0xC80
+#define CSR_TIMEH       0xC81
+#define CSR_INSTRETH    0xC82
+#define CSR_MVENDORID   0xF11
+#define CSR_MARCHID     0xF12
+#define CSR_MIMPID      0xF13
+#define CSR_MHARTID     0xF14
+
+// CSRs with both top bits set are read-only
+#define CSR_READ_ONLY(csr) (((csr) >> 10) == 0b11)
+
+// mstatus fields (machine mode only: MPP always reads as M)
+#define MSTATUS_MIE     (1u << 3)
+#define MSTATUS_MPIE    (1u << 7)
+#define MSTATUS_MPP     (3u << 11)
+
+// Interrupt numbers, as bits of mie and mip
+#define IRQ_MSI         3   // Machine software interrupt (CLINT msip)
+#define IRQ_MTI         7   // Machine timer interrupt (CLINT mtimecmp)
+#define IRQ_MEI         11  // Machine external interrupt
+
+// Interrupts that can be enabled in mie
+#define MIE_MASK        ((1u << IRQ_MSI) | (1u << IRQ_MTI) | (1u << IRQ_MEI))
+
+// mcause values
+#define CAUSE_INTERRUPT         (1u << 31)
+#define CAUSE_ILLEGAL_INSTR     2
+#define CAUSE_BREAKPOINT        3
+#define CAUSE_ECALL_M           11
+
+// misa: RV32IA
+#define MISA_VALUE      ((1u << 30) | (1u << ('I' - 'A')) | (1u << ('A' - 'A')))
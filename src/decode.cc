@@ -0,0 +1,164 @@
+#include "decode.h"
+
+enum instruction_type {
+    RV_LD = 0x03,
+    RV_ST = 0x23,
+    RV_LUI = 0x37,
+    RV_AUIPC = 0x17,
+    RV_JAL = 0x6F,
+    RV_JALR = 0x67,
+    RV_BR = 0x63,
+    RV_REG = 0x33,
+    RV_IMM = 0x13,
+    RV_SYS = 0x73,
+    RV_FENCE = 0x0F,
+    RV_AMO = 0x2F
+};
+
+void decode(uop_t &u, uint32_t value, xlen_t pc) {
+    // Extract the instruction fields
+    uint8_t opcode = BIT_FIELD(value, 6, 0);
+    uint8_t funct3 = BIT_FIELD(value, 14, 12);
+    uint8_t funct7 = BIT_FIELD(value, 31, 25);
+    uint8_t rd     = BIT_FIELD(value, 11, 7);
+    int32_t imm_i  = BIT_FIELD_SIGNED(value, 31, 20);
+    int32_t imm_s  = BIT_FIELD_SIGNED(value, 31, 25) << 5 | BIT_FIELD(value, 11, 7);
+    int32_t imm_u  = BIT_FIELD(value, 31, 12) << 12;
+    int32_t imm_j  = BIT_FIELD_SIGNED(value, 31, 31) << 20 | BIT_FIELD(value, 19, 12) << 12 | BIT_FIELD(value, 20, 20) << 11 | BIT_FIELD(value, 30, 21) << 1;
+    int32_t imm_b  = BIT_FIELD_SIGNED(value, 31, 31) << 12 | BIT_FIELD(value, 7, 7) << 11 | BIT_FIELD(value, 30, 25) << 5 | BIT_FIELD(value, 11, 8) << 1;
+
+    u.pc    = pc;
+    u.value = value;
+    u.rd    = (rd == 0) ? REG_SINK : rd;
+    u.rs1   = BIT_FIELD(value, 19, 15);
+    u.rs2   = BIT_FIELD(value, 24, 20);
+    u.imm   = 0;
+    u.op    = OP_NOP;
+
+    switch (opcode) {
+        case RV_SYS: { // System instructions
+            if (funct3 == 0x0) {
+                if (u.rs1 != 0x0 || rd != 0x0) {
+                    break;
+                }
+                uint32_t funct12 = imm_i & 0xFFF;
+                if (funct12 == 0x000) {
+                    u.op = OP_ECALL;
+                } else if (funct12 == 0x001) {
+                    u.op = OP_EBREAK;
+                } else if (funct12 == 0x302) {
+                    u.op = OP_MRET;
+                } else if (funct12 == 0x105) {
+                    u.op = OP_WFI;
+                }
+                break;
+            }
+            // Zicsr: imm holds the CSR number, rs1 the source register or 5-bit immediate
+            static const uint8_t ops[8] = {OP_NOP, OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_NOP, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI};
+            u.op = ops[funct3];
+            u.imm = imm_i & 0xFFF;
+            break;
+        }
+
+        case RV_LD: { // Load instructions
+            static const uint8_t ops[8] = {OP_LB, OP_LH, OP_LW, OP_NOP, OP_LBU, OP_LHU, OP_NOP, OP_NOP};
+            u.op = ops[funct3];
+            u.imm = imm_i;
+            break;
+        }
+
+        case RV_ST: { // Store instructions
+            static const uint8_t ops[8] = {OP_SB, OP_SH, OP_SW, OP_NOP, OP_NOP, OP_NOP, OP_NOP, OP_NOP};
+            u.op = ops[funct3];
+            u.imm = imm_s;
+            break;
+        }
+
+        case RV_FENCE: { // Memory ordering; FENCE.I synchronizes instruction fetch
+            static const uint8_t ops[8] = {OP_FENCE, OP_FENCE_I, OP_NOP, OP_NOP, OP_NOP, OP_NOP, OP_NOP, OP_NOP};
+            u.op = ops[funct3];
+            break;
+        }
+
+        case RV_AMO: { // Atomic memory operations on words (aq/rl are implied: all are sequentially consistent)
+            uint8_t funct5 = BIT_FIELD(value, 31, 27);
+            u.op = OP_ILLEGAL;
+            if (funct3 != 0x2) {
+                break;
+            }
+            switch (funct5) {
+                case 0x02: if (u.rs2 == 0) u.op = OP_LR_W; break;
+                case 0x03: u.op = OP_SC_W; break;
+                case 0x01: u.op = OP_AMOSWAP_W; break;
+                case 0x00: u.op = OP_AMOADD_W; break;
+                case 0x04: u.op = OP_AMOXOR_W; break;
+                case 0x0C: u.op = OP_AMOAND_W; break;
+                case 0x08: u.op = OP_AMOOR_W; break;
+                case 0x10: u.op = OP_AMOMIN_W; break;
+                case 0x14: u.op = OP_AMOMAX_W; break;
+                case 0x18: u.op = OP_AMOMINU_W; break;
+                case 0x1C: u.op = OP_AMOMAXU_W; break;
+            }
+            break;
+        }
+
+        case RV_LUI: // Load Upper Immediate
+            u.op = OP_LUI;
+            u.imm = imm_u;
+            break;
+
+        case RV_AUIPC: // Result is known at decode time
+            u.op = OP_AUIPC;
+            u.imm = (int32_t)pc + imm_u;
+            break;
+
+        case RV_JAL: // Target is known at decode time
+            u.op = OP_JAL;
+            u.imm = ((int32_t)pc + imm_j) & ~0b1;
+            break;
+
+        case RV_JALR:
+            u.op = OP_JALR;
+            u.imm = imm_i;
+            break;
+
+        case RV_BR: { // Target is known at decode time
+            static const uint8_t ops[8] = {OP_BEQ, OP_BNE, OP_NOP, OP_NOP, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU};
+            u.op = ops[funct3];
+            u.imm = (int32_t)pc + imm_b;
+            break;
+        }
+
+        case RV_REG: { // Register arithmetic instructions
+            static const uint8_t ops[8] = {OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND};
+            static const uint8_t alt[8] = {OP_SUB, OP_NOP, OP_NOP, OP_NOP, OP_NOP, OP_SRA, OP_NOP, OP_NOP};
+            if (funct7 == 0x00) {
+                u.op = ops[funct3];
+            } else if (funct7 == 0x20) {
+                u.op = alt[funct3];
+            }
+            break;
+        }
+
+        case RV_IMM: { // Immediate arithmetic instructions
+            static const uint8_t ops[8] = {OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI};
+            u.op = ops[funct3];
+            u.imm = imm_i;
+            if (funct3 == 0x1 || funct3 == 0x5) { // shifts take a 5-bit shamt
+                u.imm = imm_i & 0x1F;
+            }
+            if (funct3 == 0x5) {
+                if (funct7 == 0x20) {
+                    u.op = OP_SRAI;
+                } else if (funct7 != 0x00) {
+                    u.op = OP_NOP;
+                }
+            }
+            break;
+        }
+
+        default:
+            u.op = OP_ILLEGAL;
+            break;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include "defs.h"
+
+// List of decoded operations; X(name) is expanded once per operation
+#define UOP_LIST(X) \
+    X(ILLEGAL) X(NOP) X(FENCE) X(EBREAK) \
+    X(ECALL) X(MRET) X(WFI) X(FENCE_I) \
+    X(CSRRW) X(CSRRS) X(CSRRC) X(CSRRWI) X(CSRRSI) X(CSRRCI) \
+    X(LUI) X(AUIPC) X(JAL) X(JALR) \
+    X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU) \
+    X(LB) X(LH) X(LW) X(LBU) X(LHU) \
+    X(SB) X(SH) X(SW) \
+    X(LR_W) X(SC_W) X(AMOSWAP_W) X(AMOADD_W) X(AMOXOR_W) X(AMOAND_W) X(AMOOR_W) \
+    X(AMOMIN_W) X(AMOMAX_W) X(AMOMINU_W) X(AMOMAXU_W) \
+    X(ADDI) X(SLTI) X(SLTIU) X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI) X(SRAI) \
+    X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR) X(SRL) X(SRA) X(OR) X(AND)
+
+enum uop_id_t {
+#define UOP_ENUM(name) OP_##name,
+    UOP_LIST(UOP_ENUM)
+#undef UOP_ENUM
+    OP_COUNT
+};
+
+// Register index that absorbs writes to x0, so x0 never needs to be re-zeroed
+#define REG_SINK 32
+
+// Compact predecoded form of an instruction
+struct uop_t {
+    xlen_t   pc;        // address this entry was decoded from (cache tag)
+    uint32_t value;     // undecoded instruction
+    int32_t  imm;       // selected immediate; absolute target/result for pc-relative ops
+    uint8_t  op;        // operation id (uop_id_t)
+    uint8_t  rd;        // destination register (REG_SINK if x0)
+    uint8_t  rs1;       // source register 1
+    uint8_t  rs2;       // source register 2
+};
+
+// Decode an instruction fetched from pc into a uop
+void decode(uop_t &u, uint32_t value, xlen_t pc);
+
+
+// Does the operation read or change machine state that translated blocks do not track
+// (CSRs, traps)? Such operations always run as a block of their own.
+constexpr bool uop_runs_alone(int op) {
+    return op >= OP_ECALL && op <= OP_CSRRCI;
+}
+
+// Does the operation end a basic block (transfers control or stops execution)?
+constexpr bool uop_ends_block(int op) {
+    return op == OP_JAL || op == OP_JALR || (op >= OP_BEQ && op <= OP_BGEU) ||
+           op == OP_EBREAK || op == OP_ILLEGAL || uop_runs_alone(op);
+}
+
+// Does the operation write memory?
+constexpr bool uop_is_store(int op) {
+    return op >= OP_SB && op <= OP_SW;
+}
+
+// Is the operation an atomic memory operation (RV32A)? All but LR.W may write memory.
+constexpr bool uop_is_atomic(int op) {
+    return op >= OP_LR_W && op <= OP_AMOMAXU_W;
+}
+
+// Does the operation write rd? (The decoder fills rd from its field whatever the format.)
+constexpr bool uop_writes_rd(int op) {
+    return !((op >= OP_BEQ && op <= OP_BGEU) || uop_is_store(op) || op <= OP_FENCE_I);
+}
+
+// Bytes accessed by a load, store or atomic operation
+constexpr unsigned uop_access_size(int op) {
+    return (op == OP_LB || op == OP_LBU || op == OP_SB) ? 1 :
+           (op == OP_LH || op == OP_LHU || op == OP_SH) ? 2 : 4;
+}
+
+// Instruction classes reported in run statistics
+enum uop_class_t {
+    CLASS_ALU,      // Register and immediate arithmetic, LUI, AUIPC
+    CLASS_LOAD,     // Including LR
+    CLASS_STORE,    // Including SC and AMOs
+    CLASS_BRANCH,   // Conditional branches
+    CLASS_JUMP,     // JAL, JALR
+    CLASS_SYSTEM,   // Everything else
+    CLASS_COUNT
+};
+
+// Class of an operation
+constexpr uop_class_t uop_class(int op) {
+    return ((op >= OP_LB && op <= OP_LHU) || op == OP_LR_W) ? CLASS_LOAD :
+           (uop_is_store(op) || uop_is_atomic(op)) ? CLASS_STORE :
+           (op >= OP_BEQ && op <= OP_BGEU) ? CLASS_BRANCH :
+           (op == OP_JAL || op == OP_JALR) ? CLASS_JUMP :
+           (op == OP_LUI || op == OP_AUIPC || (op >= OP_ADDI && op <= OP_AND)) ? CLASS_ALU :
+           CLASS_SYSTEM;
+}
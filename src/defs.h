@@ -13,5 +13,9 @@ typedef uint32_t xlen_t; // Define xlen_t as a 32-bit unsigned integer
 
 // #define BIT_FIELD(value, end, start) (eliminate bits after end) & (eliminate bits before start by generating a mask) | (check if sign bit is set and generaate a mask for the sign extension)
 #define BIT_FIELD_SIGNED(value, end, start) \
-    (((value) >> (start)) & ((1 << ((end) - (start) + 1)) - 1)) \
-    | ((((value) >> (end)) & 1) ? ~((1 << ((end) - (start) + 1)) - 1) : 0)
+    ((((value) >> (start)) & ((1 << ((end) - (start) + 1)) - 1)) \
+    | ((((value) >> (end)) & 1) ? ~((1 << ((end) - (start) + 1)) - 1) : 0))
+
+// Guest page geometry
+#define PAGE_SHIFT 12
+#define PAGE_SIZE  (1u << PAGE_SHIFT)
@@ -0,0 +1,368 @@
+#include "device.h"
+#include "memory.h"
+#include "replay.h"
+#include "core.h"
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+DeviceBus::DeviceBus() {
+    io_pages.assign(1u << (32 - PAGE_SHIFT), 0);
+    exit_requested = false;
+    exit_code = 0;
+    marker_requested = false;
+}
+
+void DeviceBus::attach(uint32_t base, uint32_t size, Device *dev) {
+    uint64_t end = (uint64_t)base + size;
+    if (size == 0 || end > (1ull << 32)) {
+        throw std::runtime_error("Invalid device region");
+    }
+    for (const DeviceRegion &r : regions) {
+        if (base < (uint64_t)r.base + r.size && r.base < end) {
+            throw std::runtime_error("Device regions overlap");
+        }
+    }
+
+    DeviceRegion r = {base, size, dev};
+    auto it = std::upper_bound(regions.begin(), regions.end(), base, [](uint32_t a, const DeviceRegion &x) {
+        return a < x.base;
+    });
+    regions.insert(it, r);
+    for (uint64_t page = base >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT; ++page) {
+        io_pages[page] = 1;
+    }
+}
+
+const DeviceRegion *DeviceBus::find(uint32_t address) const {
+    // Last region starting at or below address
+    auto it = std::upper_bound(regions.begin(), regions.end(), address, [](uint32_t a, const DeviceRegion &x) {
+        return a < x.base;
+    });
+    if (it == regions.begin()) {
+        return nullptr;
+    }
+    --it;
+    return (address - it->base < it->size) ? &*it : nullptr;
+}
+
+void DeviceBus::set_time(uint64_t time) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (DeviceRegion &r : regions) {
+        r.dev->set_time(time);
+    }
+}
+
+void DeviceBus::dma_written(uint32_t address, uint64_t size) {
+    for (Core *core : cores) {
+        core->dmaWritten(address, size);
+    }
+}
+
+Console::Console(const std::string &target, uint64_t interval) : interval(interval) {
+    owned = false;
+    if (target == "stdout") {
+        fd = STDOUT_FILENO;
+    } else if (target == "none") {
+        fd = -1;
+    } else {
+        fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open console output: " + target);
+        }
+        owned = true;
+    }
+    line = (fd >= 0) && isatty(fd);
+    last_flush = 0;
+    muted = false;
+    len = 0;
+}
+
+Console::~Console() {
+    flush();
+    if (owned) {
+        close(fd);
+    }
+}
+
+void Console::flush() {
+    if (fd == STDOUT_FILENO) {
+        fflush(stdout); // Keep the simulator's own messages in order
+    }
+    size_t done = 0;
+    while (fd >= 0 && !muted && done < len) {
+        ssize_t n = ::write(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break; // Output is gone: drop it
+        }
+        done += n;
+    }
+    len = 0;
+}
+
+uint32_t ConsoleDevice::read(uint32_t offset, unsigned size) {
+    (void)offset; (void)size;
+    return 0;
+}
+
+void ConsoleDevice::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)size;
+    if (offset == 0) {
+        out->put(value & 0xFF);
+    }
+}
+
+// UART register offsets
+#define UART_RBR_THR 0  // Receive buffer / transmit holding (divisor latch low with DLAB)
+#define UART_IER     1  // Interrupt enable (divisor latch high with DLAB)
+#define UART_IIR_FCR 2  // Interrupt identification / FIFO control
+#define UART_LCR     3  // Line control
+#define UART_MCR     4  // Modem control
+#define UART_LSR     5  // Line status
+#define UART_MSR     6  // Modem status
+#define UART_SCR     7  // Scratch
+
+#define UART_LCR_DLAB 0x80
+#define UART_LSR_THRE 0x20  // Transmit holding register empty
+#define UART_LSR_TEMT 0x40  // Transmitter empty
+
+Uart::Uart(Console *out) : out(out) {
+    ier = lcr = mcr = scr = 0;
+    dll = dlm = 0;
+}
+
+uint32_t Uart::read(uint32_t offset, unsigned size) {
+    (void)size;
+    bool dlab = lcr & UART_LCR_DLAB;
+    switch (offset) {
+        case UART_RBR_THR: return dlab ? dll : 0; // No receive data
+        case UART_IER:     return dlab ? dlm : ier;
+        case UART_IIR_FCR: return 0x01;           // No interrupt pending
+        case UART_LCR:     return lcr;
+        case UART_MCR:     return mcr;
+        case UART_LSR:     return UART_LSR_THRE | UART_LSR_TEMT; // Always ready to transmit
+        case UART_MSR:     return 0;
+        case UART_SCR:     return scr;
+        default:           return 0;
+    }
+}
+
+void Uart::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)size;
+    bool dlab = lcr & UART_LCR_DLAB;
+    uint8_t v = value & 0xFF;
+    switch (offset) {
+        case UART_RBR_THR:
+            if (dlab) {
+                dll = v;
+            } else {
+                out->put(v);
+            }
+            break;
+        case UART_IER: if (dlab) dlm = v; else ier = v & 0x0F; break;
+        case UART_LCR: lcr = v; break;
+        case UART_MCR: mcr = v; break;
+        case UART_SCR: scr = v; break;
+        default: break; // FCR and read-only registers
+    }
+}
+
+// CLINT register offsets
+#define CLINT_MSIP      0x0000
+#define CLINT_MTIMECMP  0x4000
+#define CLINT_MTIME     0xBFF8
+
+Clint::Clint() {
+    mtime = 0;
+    for (int i = 0; i < CLINT_MAX_HARTS; ++i) {
+        msip[i] = 0;
+        mtimecmp[i] = UINT64_MAX;
+    }
+}
+
+uint32_t Clint::read(uint32_t offset, unsigned size) {
+    (void)size;
+    if (offset < CLINT_MSIP + 4 * CLINT_MAX_HARTS) {
+        return msip[offset / 4];
+    }
+    if (offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8 * CLINT_MAX_HARTS) {
+        uint64_t v = mtimecmp[(offset - CLINT_MTIMECMP) / 8];
+        return (offset & 4) ? v >> 32 : v;
+    }
+    if (offset == CLINT_MTIME || offset == CLINT_MTIME + 4) {
+        uint64_t t = get_time();
+        return (offset & 4) ? t >> 32 : t;
+    }
+    return 0;
+}
+
+void Clint::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)size;
+    if (offset < CLINT_MSIP + 4 * CLINT_MAX_HARTS) {
+        msip[offset / 4] = value & 1;
+    } else if (offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8 * CLINT_MAX_HARTS) {
+        uint64_t &v = mtimecmp[(offset - CLINT_MTIMECMP) / 8];
+        if (offset & 4) {
+            v = (v & 0xFFFFFFFFull) | ((uint64_t)value << 32);
+        } else {
+            v = (v & ~0xFFFFFFFFull) | value;
+        }
+    }
+    // mtime follows the retired instruction count and is read-only
+}
+
+// Test finisher commands
+#define FINISHER_FAIL 0x3333
+#define FINISHER_PASS 0x5555
+
+uint32_t TestFinisher::read(uint32_t offset, unsigned size) {
+    (void)offset; (void)size;
+    return 0;
+}
+
+void TestFinisher::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)size;
+    if (offset != 0) {
+        return;
+    }
+    if ((value & 0xFFFF) == FINISHER_PASS) {
+        bus->request_exit(0);
+    } else if ((value & 0xFFFF) == FINISHER_FAIL) {
+        bus->request_exit(value >> 16);
+    }
+}
+
+uint32_t Marker::read(uint32_t offset, unsigned size) {
+    (void)size;
+    return (offset == 0) ? child : 0;
+}
+
+void Marker::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)offset; (void)value; (void)size;
+    if (armed) {
+        bus->marker_requested = true;
+    }
+}
+
+// Block device register offsets
+#define BLKDEV_SECTOR_REG   0x00
+#define BLKDEV_ADDR         0x04
+#define BLKDEV_COUNT        0x08
+#define BLKDEV_CMD          0x0C
+#define BLKDEV_STATUS       0x10
+#define BLKDEV_SIZE         0x14
+
+#define BLKDEV_CMD_READ     1
+#define BLKDEV_CMD_WRITE    2
+
+BlockDevice::BlockDevice(Memory *mem, DeviceBus *bus, const std::string &path, bool copy) : mem(mem), bus(bus) {
+    fd = open(path.c_str(), copy ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open disk image: " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not open disk image: " + path);
+    }
+    if (copy) {
+        // Copy the image to an anonymous file
+        int image = fd;
+        fd = memfd_create("polaris-disk", 0);
+        char buf[1 << 16];
+        ssize_t n = 0;
+        while (fd >= 0 && (n = ::read(image, buf, sizeof(buf))) > 0) {
+            if (::write(fd, buf, n) != n) {
+                n = -1;
+                break;
+            }
+        }
+        close(image);
+        if (fd < 0 || n < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Could not copy disk image: " + path);
+        }
+    }
+    nsectors = st.st_size / BLKDEV_SECTOR;
+    sector = addr = count = status = 0;
+    replay = nullptr;
+}
+
+BlockDevice::~BlockDevice() {
+    close(fd);
+}
+
+uint32_t BlockDevice::read(uint32_t offset, unsigned size) {
+    (void)size;
+    switch (offset) {
+        case BLKDEV_SECTOR_REG: return sector;
+        case BLKDEV_ADDR:       return addr;
+        case BLKDEV_COUNT:      return count;
+        case BLKDEV_STATUS:     return status;
+        case BLKDEV_SIZE:       return nsectors;
+        default:                return 0;
+    }
+}
+
+void BlockDevice::write(uint32_t offset, uint32_t value, unsigned size) {
+    (void)size;
+    switch (offset) {
+        case BLKDEV_SECTOR_REG: sector = value; break;
+        case BLKDEV_ADDR:       addr = value; break;
+        case BLKDEV_COUNT:      count = value; break;
+        case BLKDEV_CMD:        command(value); break;
+        default: break;
+    }
+}
+
+void BlockDevice::command(uint32_t cmd) {
+    uint32_t read;
+    if (replay && replay->replaying()) {
+        read = replay->replay_disk(*mem); // The status comes from the log with the register reads
+    } else {
+        read = transfer(cmd);
+        if (replay) {
+            replay->log_disk(*mem, addr, read);
+        }
+    }
+    if (read) {
+        bus->dma_written(addr, (uint64_t)read * BLKDEV_SECTOR); // It may have loaded code
+    }
+}
+
+uint32_t BlockDevice::transfer(uint32_t cmd) {
+    if ((cmd != BLKDEV_CMD_READ && cmd != BLKDEV_CMD_WRITE) ||
+        (uint64_t)sector + count > nsectors || (uint64_t)addr + (uint64_t)count * BLKDEV_SECTOR > (1ull << 32)) {
+        status = 1;
+        return 0;
+    }
+
+    // Transfer one sector at a time through a bounce buffer
+    uint8_t buf[BLKDEV_SECTOR];
+    for (uint32_t i = 0; i < count; ++i) {
+        off_t pos = (off_t)(sector + i) * BLKDEV_SECTOR;
+        uint32_t a = addr + i * BLKDEV_SECTOR;
+        if (cmd == BLKDEV_CMD_READ) {
+            if (pread(fd, buf, BLKDEV_SECTOR, pos) != BLKDEV_SECTOR) {
+                status = 1;
+                return i;
+            }
+            mem->write_bytes(a, buf, BLKDEV_SECTOR);
+        } else {
+            mem->read_bytes(a, buf, BLKDEV_SECTOR);
+            if (pwrite(fd, buf, BLKDEV_SECTOR, pos) != BLKDEV_SECTOR) {
+                status = 1;
+                return 0;
+            }
+        }
+    }
+    status = 0;
+    return cmd == BLKDEV_CMD_READ ? count : 0;
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include "defs.h"
+
+class Memory;
+class ReplayLog;
+class Core;
+
+// Default device addresses
+#define CLINT_BASE      0x02000000
+#define UART_BASE       0x10000000
+#define FINISHER_BASE   0x10100000
+#define BLKDEV_BASE     0x10200000
+#define MARKER_BASE     0x10300000
+
+// Legacy console: a store to this word prints its low byte
+#define CONSOLE_ADDR    (UINT32_MAX & ~0b11)
+
+// Size of the console output buffer
+#define CONSOLE_BUF_SIZE 65536
+
+// Buffered guest console output, shared by the console devices and written with write(2)
+class Console {
+    private:
+        int fd;                     // Output file descriptor, or -1 to discard output
+        bool owned;                 // fd was opened for a file and is closed on destruction
+        bool line;                  // Flush at every newline (terminal output)
+        uint64_t interval;          // Flush partial output after this much device time (0: never)
+        uint64_t last_flush;        // Device time of the last flush
+        bool muted;                 // Output is dropped
+        size_t len;                 // Bytes buffered
+        char buf[CONSOLE_BUF_SIZE];
+
+    public:
+        // Output to "stdout", "none" (discarded) or a file path
+        Console(const std::string &target = "stdout", uint64_t interval = 0);
+
+        // Destructor (flushes)
+        ~Console();
+
+        // Queue one character
+        void put(char c) {
+            buf[len++] = c;
+            if (len == CONSOLE_BUF_SIZE || (line && c == '\n')) {
+                flush();
+            }
+        }
+
+        // Write out buffered output
+        void flush();
+
+        // Drop output from now on (a replay going over what was already shown), or stop dropping it
+        void setMuted(bool muted) {
+            if (muted != this->muted) {
+                flush();
+                this->muted = muted;
+            }
+        }
+
+        // Flush partial output once the interval has passed
+        void set_time(uint64_t time) {
+            if (len && interval && time - last_flush >= interval) {
+                flush();
+            }
+            if (!len) {
+                last_flush = time;
+            }
+        }
+};
+
+// Memory-mapped device: registers are addressed by offset from the device base
+class Device {
+    public:
+        virtual ~Device() {}
+
+        // Read size (1, 2 or 4) bytes from the register at offset
+        virtual uint32_t read(uint32_t offset, unsigned size) = 0;
+
+        // Write size (1, 2 or 4) bytes to the register at offset
+        virtual void write(uint32_t offset, uint32_t value, unsigned size) = 0;
+
+        // Advance device time to the given timebase value
+        virtual void set_time(uint64_t time) { (void)time; }
+};
+
+// Address range claimed by a device
+struct DeviceRegion {
+    uint32_t base;
+    uint32_t size;
+    Device *dev;
+};
+
+// Routes accesses to I/O pages to the devices mapped there; the rest of memory is RAM
+class DeviceBus {
+    private:
+        std::vector<DeviceRegion> regions;  // Sorted by base
+        std::vector<uint8_t> io_pages;      // Pages overlapping a device region
+        std::vector<Core*> cores;           // Harts sharing the bus (and their memory)
+
+    public:
+        std::mutex lock;                    // Serializes device accesses from several harts
+        std::atomic<bool> exit_requested;   // Set by a device that stops the simulation
+        int exit_code;                      // Guest exit status when exit_requested
+        std::atomic<bool> marker_requested; // Set by an armed marker: stop for a checkpoint or fork
+
+        // Constructor
+        DeviceBus();
+
+        // Map dev at [base, base + size); regions must not overlap
+        void attach(uint32_t base, uint32_t size, Device *dev);
+
+        // Does the page containing address need to go through the bus?
+        bool is_io(uint32_t address) const { return io_pages[address >> PAGE_SHIFT]; }
+
+        // Device region containing address, or nullptr (RAM)
+        const DeviceRegion *find(uint32_t address) const;
+
+        // Advance the time of every device (takes the lock)
+        void set_time(uint64_t time);
+
+        // Let DMA writes drop the decoded code of a hart (Core::setBus)
+        void add_core(Core *core) { cores.push_back(core); }
+
+        // Harts on the bus
+        const std::vector<Core*> &get_cores() const { return cores; }
+
+        // A device wrote [address, address + size) of RAM (called with the lock held)
+        void dma_written(uint32_t address, uint64_t size);
+
+        // Stop the simulation with a guest exit status (called with the lock held)
+        void request_exit(int code) { exit_code = code; exit_requested = true; }
+
+        // Has a device asked the cores to stop?
+        bool stop_requested() const { return exit_requested || marker_requested; }
+};
+
+// Legacy one-register console: a write prints the low byte
+class ConsoleDevice : public Device {
+    private:
+        Console *out;
+
+    public:
+        ConsoleDevice(Console *out) : out(out) {}
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+        void set_time(uint64_t time) override { out->set_time(time); }
+};
+
+// Transmit side of a 16550-compatible UART (one byte per register)
+class Uart : public Device {
+    private:
+        Console *out;   // Transmitted characters
+        uint8_t ier;    // Interrupt enable
+        uint8_t lcr;    // Line control
+        uint8_t mcr;    // Modem control
+        uint8_t scr;    // Scratch
+        uint8_t dll;    // Divisor latch (low)
+        uint8_t dlm;    // Divisor latch (high)
+
+    public:
+        Uart(Console *out);
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+        void set_time(uint64_t time) override { out->set_time(time); }
+};
+
+// Number of harts the CLINT provides registers for
+#define CLINT_MAX_HARTS 32
+
+// Core-local interruptor: software interrupt bits, timer compare registers and mtime
+class Clint : public Device {
+    private:
+        std::atomic<uint64_t> mtime;            // Timebase (retired instructions), read by the time CSRs without the bus lock
+
+    public:
+        uint32_t msip[CLINT_MAX_HARTS];         // Software interrupt pending
+        uint64_t mtimecmp[CLINT_MAX_HARTS];     // Timer compare
+
+        Clint();
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+        void set_time(uint64_t time) override { mtime.store(time, std::memory_order_relaxed); }
+        uint64_t get_time() const { return mtime.load(std::memory_order_relaxed); }
+};
+
+// SiFive-style test finisher: writing PASS or FAIL | (code << 16) stops the simulation
+class TestFinisher : public Device {
+    private:
+        DeviceBus *bus;
+
+    public:
+        TestFinisher(DeviceBus *bus) : bus(bus) {}
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+};
+
+// Guest marker: a write stops the simulation when a checkpoint or fork was asked for at the
+// marker (otherwise it is ignored, so programs can leave their markers in). Reads return the
+// index of the forked child the program runs in (0 when not forked).
+class Marker : public Device {
+    private:
+        DeviceBus *bus;
+        bool armed;
+        uint32_t child;
+
+    public:
+        Marker(DeviceBus *bus) : bus(bus), armed(false), child(0) {}
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+
+        // Make writes stop the simulation
+        void arm(bool armed) { this->armed = armed; }
+
+        // Set the value of reads
+        void setChild(uint32_t child) { this->child = child; }
+};
+
+// Sector size of the block device
+#define BLKDEV_SECTOR 512
+
+// Block device backed by a host file, transferring whole sectors to and from guest memory
+//   0x00 SECTOR   first sector of the transfer
+//   0x04 ADDR     guest buffer address
+//   0x08 COUNT    number of sectors
+//   0x0C CMD      write 1 to read from the disk into memory, 2 to write memory to the disk
+//   0x10 STATUS   0 after a successful command, 1 after a failed one
+//   0x14 SIZE     capacity in sectors (read-only)
+class BlockDevice : public Device {
+    private:
+        Memory *mem;        // Guest memory for transfers
+        DeviceBus *bus;     // Told about the memory written by reads
+        int fd;             // Backing file
+        uint32_t nsectors;  // Capacity
+        uint32_t sector, addr, count, status;
+        ReplayLog *replay;  // Log of the sectors read (nullptr: none)
+
+        // Run a transfer command
+        void command(uint32_t cmd);
+
+        // Transfer the sectors of a command; returns the number read into memory
+        uint32_t transfer(uint32_t cmd);
+
+    public:
+        // Serve the image at path, or a private copy of it that writes never reach
+        BlockDevice(Memory *mem, DeviceBus *bus, const std::string &path, bool copy = false);
+        ~BlockDevice();
+        uint32_t read(uint32_t offset, unsigned size) override;
+        void write(uint32_t offset, uint32_t value, unsigned size) override;
+
+        // Log the data of read commands, or take it from a log being replayed (and leave the
+        // backing file alone)
+        void setReplay(ReplayLog *replay) { this->replay = replay; }
+};
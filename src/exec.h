@@ -0,0 +1,173 @@
+#pragma once
+#include "core.h"
+#include "csr.h"
+#include <stdexcept>
+#include <string.h>
+
+// Load a T from address: one compare covers the TLB tag and alignment
+template<typename T>
+inline T Core::mem_load(uint32_t address) {
+    tlb_entry_t &e = tlb_rd[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    if (e.tag == (address & (~(PAGE_SIZE - 1) | (sizeof(T) - 1)))) {
+        T value;
+        memcpy(&value, e.host + (address & (PAGE_SIZE - 1)), sizeof(T));
+        return value;
+    }
+    return mem_load_slow(address, sizeof(T));
+}
+
+// Store a T to address: one compare covers the TLB tag and alignment
+template<typename T>
+inline void Core::mem_store(uint32_t address, T value) {
+    tlb_entry_t &e = tlb_wr[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    if (e.tag == (address & (~(PAGE_SIZE - 1) | (sizeof(T) - 1)))) {
+        memcpy(e.host + (address & (PAGE_SIZE - 1)), &value, sizeof(T));
+        return;
+    }
+    mem_store_slow(address, value, sizeof(T));
+}
+
+// Fetch the aligned instruction word containing address
+inline uint32_t Core::mem_read(uint32_t address) {
+    if (watch_pages[address >> PAGE_SHIFT]) {
+        return mem->load32(address & ~0b11); // Instruction fetches do not trigger watchpoints
+    }
+    return mem_load<uint32_t>(address & ~0b11);
+}
+
+inline void Core::fetch(uop_t &u, xlen_t address) {
+    decode(u, mem_read(address), address);
+    if (!breakpoints.empty() && breakpoints.count(address)) {
+        u.op = OP_EBREAK;
+    }
+}
+
+// Load a value for a load operation
+template<int OP>
+inline xlen_t Core::load(uint32_t mem_addr) {
+    switch (OP) {
+        case OP_LB:  return (int8_t)mem_load<uint8_t>(mem_addr);
+        case OP_LH:  return (int16_t)mem_load<uint16_t>(mem_addr);
+        case OP_LBU: return mem_load<uint8_t>(mem_addr);
+        case OP_LHU: return mem_load<uint16_t>(mem_addr);
+        default:     return mem_load<uint32_t>(mem_addr);
+    }
+}
+
+// Store a register value for a store operation
+template<int OP>
+inline void Core::store(uint32_t store_addr, xlen_t value) {
+    switch (OP) {
+        case OP_SB: mem_store<uint8_t>(store_addr, value); break;
+        case OP_SH: mem_store<uint16_t>(store_addr, value); break;
+        case OP_SW: mem_store<uint32_t>(store_addr, value); break;
+    }
+}
+
+// Execute a predecoded instruction and return the address of the next one.
+// Only u is consulted for the instruction's own PC, so engines that do not
+// keep Core::pc up to date can use it as well.
+template<int OP>
+inline xlen_t Core::exec(const uop_t &u) {
+    xlen_t pc_next = u.pc + 4; // Next sequential instruction
+
+    switch (OP) {
+        case OP_ILLEGAL: {
+            // Reported by whoever catches it: the console, or the batch job's result
+            char message[64];
+            snprintf(message, sizeof(message), "Unknown opcode: %02x at PC: 0x%08x", BIT_FIELD(u.value, 6, 0), u.pc);
+            throw std::runtime_error(message);
+        }
+        case OP_NOP:
+            break;
+        case OP_FENCE:
+            __atomic_thread_fence(__ATOMIC_SEQ_CST); // Order this hart's accesses as seen by other host threads
+            break;
+        case OP_FENCE_I:
+            break; // The engines drop their decoded code after it
+        case OP_EBREAK:
+            return u.pc; // Execution stops at the EBREAK
+
+        // Traps and CSRs (machine mode only)
+        case OP_ECALL:
+            return trap(CAUSE_ECALL_M, 0, u.pc);
+        case OP_MRET:
+            return mret();
+        case OP_WFI:
+            break; // Interrupts are only taken between slices: resume at once
+        case OP_CSRRW: case OP_CSRRS: case OP_CSRRC: case OP_CSRRWI: case OP_CSRRSI: case OP_CSRRCI:
+            return csr_op(u);
+
+        // Load instructions
+        case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+            rf[u.rd] = load<OP>(rf[u.rs1] + u.imm);
+            break;
+
+        // Store instructions
+        case OP_SB: case OP_SH: case OP_SW:
+            store<OP>(rf[u.rs1] + u.imm, rf[u.rs2]);
+            break;
+
+        // Atomic memory operations
+        case OP_LR_W:
+            rf[u.rd] = load_reserved(rf[u.rs1]);
+            break;
+        case OP_SC_W:
+            rf[u.rd] = store_conditional(rf[u.rs1], rf[u.rs2]);
+            break;
+        case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W:
+        case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+            rf[u.rd] = amo(OP, rf[u.rs1], rf[u.rs2]);
+            break;
+
+        // Upper immediates (AUIPC result is resolved at decode time)
+        case OP_LUI: case OP_AUIPC:
+            rf[u.rd] = u.imm;
+            break;
+
+        // Jumps (JAL target is resolved at decode time)
+        case OP_JAL:
+            rf[u.rd] = pc_next;
+            pc_next = u.imm;
+            break;
+        case OP_JALR: {
+            xlen_t target = (xlen_t)((int32_t)rf[u.rs1] + u.imm) & ~0b1; // rs1 may equal rd
+            rf[u.rd] = pc_next;
+            pc_next = target;
+            break;
+        }
+
+        // Branches (targets are resolved at decode time)
+        case OP_BEQ:  if (rf[u.rs1] == rf[u.rs2]) pc_next = u.imm; break;
+        case OP_BNE:  if (rf[u.rs1] != rf[u.rs2]) pc_next = u.imm; break;
+        case OP_BLT:  if ((int32_t)rf[u.rs1] < (int32_t)rf[u.rs2]) pc_next = u.imm; break;
+        case OP_BGE:  if ((int32_t)rf[u.rs1] >= (int32_t)rf[u.rs2]) pc_next = u.imm; break;
+        case OP_BLTU: if (rf[u.rs1] < rf[u.rs2]) pc_next = u.imm; break;
+        case OP_BGEU: if (rf[u.rs1] >= rf[u.rs2]) pc_next = u.imm; break;
+
+        // Immediate arithmetic instructions
+        case OP_ADDI:  rf[u.rd] = rf[u.rs1] + u.imm; break;
+        case OP_SLTI:  rf[u.rd] = ((int32_t)rf[u.rs1] < u.imm); break;
+        case OP_SLTIU: rf[u.rd] = (rf[u.rs1] < (uint32_t)u.imm); break;
+        case OP_XORI:  rf[u.rd] = rf[u.rs1] ^ u.imm; break;
+        case OP_ORI:   rf[u.rd] = rf[u.rs1] | u.imm; break;
+        case OP_ANDI:  rf[u.rd] = rf[u.rs1] & u.imm; break;
+        case OP_SLLI:  rf[u.rd] = rf[u.rs1] << u.imm; break;
+        case OP_SRLI:  rf[u.rd] = rf[u.rs1] >> u.imm; break;
+        case OP_SRAI:  rf[u.rd] = ((int32_t)rf[u.rs1]) >> u.imm; break;
+
+        // Register arithmetic instructions
+        case OP_ADD:  rf[u.rd] = rf[u.rs1] + rf[u.rs2]; break;
+        case OP_SUB:  rf[u.rd] = rf[u.rs1] - rf[u.rs2]; break;
+        case OP_SLL:  rf[u.rd] = rf[u.rs1] << (rf[u.rs2] & 0x1F); break;
+        case OP_SLT:  rf[u.rd] = ((int32_t)rf[u.rs1] < (int32_t)rf[u.rs2]); break;
+        case OP_SLTU: rf[u.rd] = (rf[u.rs1] < rf[u.rs2]); break;
+        case OP_XOR:  rf[u.rd] = rf[u.rs1] ^ rf[u.rs2]; break;
+        case OP_SRL:  rf[u.rd] = rf[u.rs1] >> (rf[u.rs2] & 0x1F); break;
+        case OP_SRA:  rf[u.rd] = ((int32_t)rf[u.rs1]) >> (rf[u.rs2] & 0x1F); break;
+        case OP_OR:   rf[u.rd] = rf[u.rs1] | rf[u.rs2]; break;
+        case OP_AND:  rf[u.rd] = rf[u.rs1] & rf[u.rs2]; break;
+    }
+
+    return pc_next;
+}
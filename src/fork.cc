@@ -0,0 +1,62 @@
+#include "fork.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/wait.h>
+
+std::vector<ForkResult> fork_children(unsigned k, const std::function<ForkResult(unsigned)> &body) {
+    fflush(stdout); // Buffered output would be written again by every child
+    fflush(stderr);
+
+    std::vector<pid_t> pids(k, -1);
+    std::vector<int> fds(k, -1);
+    for (unsigned i = 0; i < k; ++i) {
+        int fd[2];
+        if (pipe(fd) != 0) {
+            throw std::runtime_error("Could not create pipe for child");
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fd[0]);
+            close(fd[1]);
+            throw std::runtime_error("Could not fork child");
+        }
+        if (pid == 0) {
+            // Child: run, report through the pipe and leave without running the parent's destructors
+            close(fd[0]);
+            for (unsigned j = 0; j < i; ++j) {
+                close(fds[j]);
+            }
+            ForkResult r;
+            memset(&r, 0, sizeof(r));
+            try {
+                r = body(i);
+                r.ok = true;
+            } catch (const std::exception &e) {
+                fprintf(stderr, "Exception in child %u: %s\n", i, e.what());
+            }
+            fflush(stdout);
+            fflush(stderr);
+            if (r.ok && write(fd[1], &r, sizeof(r)) != sizeof(r)) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+        close(fd[1]);
+        pids[i] = pid;
+        fds[i] = fd[0];
+    }
+
+    std::vector<ForkResult> results(k);
+    for (unsigned i = 0; i < k; ++i) {
+        ForkResult &r = results[i];
+        if (read(fds[i], &r, sizeof(r)) != sizeof(r)) {
+            memset(&r, 0, sizeof(r)); // ok = false
+        }
+        close(fds[i]);
+        int status;
+        waitpid(pids[i], &status, 0);
+    }
+    return results;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+// Outcome of a forked child run
+struct ForkResult {
+    bool ok;            // The child reported back (false if it crashed or was killed)
+    int rc;             // Core::run() return code
+    int exit_code;      // Guest exit status
+    uint64_t instret;   // Retired instructions, since the fork
+    double wall_s;      // Wall-clock time of the child
+};
+
+// Fork k host processes that start from the current state of the simulation and run body(i)
+// in child i. The children share all memory of the parent (guest pages, decoded and
+// translated code) copy-on-write, so each one pays only for the pages it modifies.
+// They run in parallel; returns their results in order once all have finished.
+// Only call this while no other host threads are running.
+std::vector<ForkResult> fork_children(unsigned k, const std::function<ForkResult(unsigned)> &body);
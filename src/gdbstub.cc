@@ -0,0 +1,586 @@
+#include "gdbstub.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+// ABI names of the integer registers, as the RISC-V target description of GDB expects them
+static const char *const reg_names[32] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+};
+
+// Register number of the pc in g packets and the target description
+#define GDB_REG_PC 32
+
+// Target description: the 32 integer registers, then pc
+static std::string target_xml() {
+    std::string xml =
+        "<?xml version=\"1.0\"?>\n"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+        "<target version=\"1.0\">\n"
+        "<architecture>riscv:rv32</architecture>\n"
+        "<feature name=\"org.gnu.gdb.riscv.cpu\">\n";
+    for (int i = 0; i < 32; ++i) {
+        const char *type = (i == 1) ? "code_ptr" : (i == 2) ? "data_ptr" : "int";
+        xml += std::string("<reg name=\"") + reg_names[i] + "\" bitsize=\"32\" type=\"" + type +
+               "\" regnum=\"" + std::to_string(i) + "\"/>\n";
+    }
+    xml += "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"32\"/>\n"
+           "</feature>\n"
+           "</target>\n";
+    return xml;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Parse a big-endian hex number starting at pos, advancing pos past it
+static uint32_t parse_hex(const std::string &s, size_t &pos) {
+    uint32_t value = 0;
+    while (pos < s.size() && hex_digit(s[pos]) >= 0) {
+        value = (value << 4) | hex_digit(s[pos++]);
+    }
+    return value;
+}
+
+// Append a byte as two hex digits
+static void put_byte(std::string &out, uint8_t b) {
+    static const char digits[] = "0123456789abcdef";
+    out += digits[b >> 4];
+    out += digits[b & 0xf];
+}
+
+// Append a register value in target (little-endian) byte order
+static void put_word(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        put_byte(out, value >> (8 * i));
+    }
+}
+
+// Parse a register value in target byte order at pos; false if fewer than 8 hex digits remain
+static bool get_word(const std::string &s, size_t pos, uint32_t &value) {
+    if (s.size() < pos + 8) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        int hi = hex_digit(s[pos + 2 * i]), lo = hex_digit(s[pos + 2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        value |= (uint32_t)(hi << 4 | lo) << (8 * i);
+    }
+    return true;
+}
+
+GdbStub::GdbStub(Core &core, Memory &mem, Platform &platform, const std::string &address, Replayer *replay) :
+    core(core), mem(mem), platform(platform), replay(replay), address(address), fd(-1), ack(true) {
+    std::string port = (!address.empty() && address[0] == ':') ? address.substr(1) : address;
+    bool tcp = !port.empty() && port.find_first_not_of("0123456789") == std::string::npos;
+    if (tcp) {
+        sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(atoi(port.c_str()));
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local debuggers only
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        if (listener >= 0) {
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        if (listener < 0 || bind(listener, (sockaddr*)&sa, sizeof(sa)) != 0 || listen(listener, 1) != 0) {
+            std::string error = strerror(errno);
+            if (listener >= 0) {
+                close(listener);
+            }
+            throw std::runtime_error("Could not listen for GDB on port " + port + ": " + error);
+        }
+        this->address = "port " + port;
+    } else {
+        sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (address.empty() || address.size() >= sizeof(sa.sun_path)) {
+            throw std::runtime_error("Bad GDB socket path: " + address);
+        }
+        strcpy(sa.sun_path, address.c_str());
+        unlink(address.c_str()); // Left over from an earlier run
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (sockaddr*)&sa, sizeof(sa)) != 0 || listen(listener, 1) != 0) {
+            std::string error = strerror(errno);
+            if (listener >= 0) {
+                close(listener);
+            }
+            throw std::runtime_error("Could not listen for GDB on " + address + ": " + error);
+        }
+        unix_path = address;
+    }
+}
+
+GdbStub::~GdbStub() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    close(listener);
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());
+    }
+}
+
+bool GdbStub::receive() {
+    char buf[GDB_PACKET_SIZE];
+    ssize_t n;
+    do {
+        n = recv(fd, buf, sizeof(buf), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return false;
+    }
+    input.append(buf, n);
+    return true;
+}
+
+bool GdbStub::get_packet(std::string &packet) {
+    while (true) {
+        // Acknowledgements and stray interrupts between packets are dropped
+        size_t start = input.find('$');
+        if (start == std::string::npos) {
+            input.clear();
+        } else {
+            input.erase(0, start);
+            size_t hash = input.find('#');
+            if (hash != std::string::npos && input.size() >= hash + 3) {
+                std::string data = input.substr(1, hash - 1);
+                int hi = hex_digit(input[hash + 1]), lo = hex_digit(input[hash + 2]);
+                input.erase(0, hash + 3);
+                uint8_t sum = 0;
+                for (char c : data) {
+                    sum += c;
+                }
+                bool valid = hi >= 0 && lo >= 0 && sum == (hi << 4 | lo);
+                if (ack && send(fd, valid ? "+" : "-", 1, MSG_NOSIGNAL) != 1) {
+                    return false;
+                }
+                if (valid) {
+                    packet = data;
+                    return true;
+                }
+                continue; // The debugger sends it again
+            }
+        }
+        if (!receive()) {
+            return false;
+        }
+    }
+}
+
+void GdbStub::put_packet(const std::string &data) {
+    uint8_t sum = 0;
+    for (char c : data) {
+        sum += c;
+    }
+    std::string out = "$" + data + "#";
+    put_byte(out, sum);
+    for (size_t sent = 0; sent < out.size(); ) {
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return; // Hung up: noticed at the next read
+        }
+        sent += n;
+    }
+}
+
+bool GdbStub::interrupted() {
+    pollfd p{fd, POLLIN, 0};
+    if (poll(&p, 1, 0) <= 0 || !receive()) {
+        return false;
+    }
+    size_t at = input.find('\x03');
+    if (at == std::string::npos) {
+        return false;
+    }
+    input.erase(at, 1);
+    return true;
+}
+
+int GdbStub::advance(uint64_t n) {
+    return replay ? replay->run(n) : core.run(n);
+}
+
+int GdbStub::step_over() {
+    xlen_t pc = core.getPC();
+    bool bp = core.isBreakpoint(pc);
+    if (bp) {
+        core.setBreakpoint(pc, false);
+    }
+    int rc = replay ? replay->run(1) : core.tick();
+    if (bp) {
+        core.setBreakpoint(pc, true);
+    }
+    return rc;
+}
+
+int GdbStub::resume(bool step, bool &stopped) {
+    stopped = false;
+    int rc = step_over(); // Leave a breakpoint we are stopped at
+    while (rc == 0 && !step) {
+        rc = advance(GDB_SLICE);
+        if (rc == 0 && interrupted()) {
+            stopped = true;
+            break;
+        }
+    }
+    platform.out.flush();
+    return rc;
+}
+
+std::string GdbStub::stop_reply(int rc, bool stopped) {
+    char reply[32];
+    if (stopped) {
+        return "S02"; // SIGINT
+    }
+    if (replay && replay->atEnd()) {
+        return "T05replaylog:end;"; // Stay: the debugger can go back from there
+    }
+    if (rc == RC_EXIT) {
+        snprintf(reply, sizeof(reply), "W%02x", platform.bus.exit_code & 0xff);
+        return reply;
+    }
+    if (rc == RC_WATCH) {
+        const watch_hit_t &hit = core.getWatchHit();
+        const char *name = (hit.watch.kind == WATCH_WRITE) ? "watch" : (hit.watch.kind == WATCH_READ) ? "rwatch" : "awatch";
+        snprintf(reply, sizeof(reply), "T05%s:%x;", name, hit.address);
+        return reply;
+    }
+    if (rc == RC_EBREAK && sw_breaks.count(core.getPC())) {
+        return "T05swbreak:;";
+    }
+    if (rc == RC_EBREAK && hw_breaks.count(core.getPC())) {
+        return "T05hwbreak:;";
+    }
+    return "S05"; // SIGTRAP: a step, or an EBREAK in the program
+}
+
+std::string GdbStub::reverse(bool step) {
+    std::string reply;
+    if (step) {
+        reply = replay->reverse_step() ? "S05" : "T05replaylog:begin;";
+    } else {
+        int rc = replay->reverse_continue();
+        reply = rc ? stop_reply(rc, false) : "T05replaylog:begin;";
+    }
+    platform.out.flush();
+    return reply;
+}
+
+std::string GdbStub::read_registers() {
+    std::string out;
+    for (int i = 0; i < 32; ++i) {
+        put_word(out, core.getReg(i));
+    }
+    put_word(out, core.getPC());
+    return out;
+}
+
+std::string GdbStub::write_registers(const std::string &args) {
+    uint32_t values[33];
+    if (replay) {
+        return "E01"; // The replay must stay the recorded run
+    }
+    for (int i = 0; i < 33; ++i) {
+        if (!get_word(args, 8 * i, values[i])) {
+            return "E01";
+        }
+    }
+    for (int i = 1; i < 32; ++i) {
+        core.setReg(i, values[i]);
+    }
+    core.setPC(values[GDB_REG_PC]);
+    return "OK";
+}
+
+std::string GdbStub::read_register(const std::string &args) {
+    size_t pos = 0;
+    uint32_t n = parse_hex(args, pos);
+    if (n > GDB_REG_PC) {
+        return "E01";
+    }
+    std::string out;
+    put_word(out, n == GDB_REG_PC ? core.getPC() : core.getReg(n));
+    return out;
+}
+
+std::string GdbStub::write_register(const std::string &args) {
+    size_t pos = 0;
+    uint32_t n = parse_hex(args, pos), value;
+    if (replay || n > GDB_REG_PC || pos >= args.size() || args[pos] != '=' || !get_word(args, pos + 1, value)) {
+        return "E01";
+    }
+    if (n == GDB_REG_PC) {
+        core.setPC(value);
+    } else {
+        core.setReg(n, value);
+    }
+    return "OK";
+}
+
+std::string GdbStub::read_memory(const std::string &args) {
+    size_t pos = 0;
+    uint32_t addr = parse_hex(args, pos);
+    if (pos >= args.size() || args[pos++] != ',') {
+        return "E01";
+    }
+    uint32_t len = std::min<uint32_t>(parse_hex(args, pos), (GDB_PACKET_SIZE - 4) / 2);
+    std::string out;
+    for (uint32_t i = 0; i < len; ++i) {
+        if (platform.bus.is_io(addr + i)) {
+            break; // Reading device registers could change them
+        }
+        put_byte(out, mem.load8(addr + i));
+    }
+    return (len && out.empty()) ? "E14" : out; // EFAULT
+}
+
+std::string GdbStub::write_memory(const std::string &args) {
+    size_t pos = 0;
+    uint32_t addr = parse_hex(args, pos);
+    if (pos >= args.size() || args[pos++] != ',') {
+        return "E01";
+    }
+    uint32_t len = parse_hex(args, pos);
+    if (replay || pos >= args.size() || args[pos++] != ':' || args.size() - pos < 2 * (size_t)len) {
+        return "E01";
+    }
+    std::vector<uint8_t> data(len);
+    for (uint32_t i = 0; i < len; ++i) {
+        int hi = hex_digit(args[pos + 2 * i]), lo = hex_digit(args[pos + 2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return "E01";
+        }
+        if (platform.bus.is_io(addr + i)) {
+            return "E14";
+        }
+        data[i] = hi << 4 | lo;
+    }
+    core.debugWrite(addr, data.data(), len);
+    return "OK";
+}
+
+std::string GdbStub::breakpoint(const std::string &packet) {
+    // Z<type>,<addr>,<kind> sets, z<type>,... clears
+    bool set = packet[0] == 'Z';
+    if (packet.size() < 3 || packet[1] < '0' || packet[1] > '4' || packet[2] != ',') {
+        return "";
+    }
+    size_t pos = 3;
+    xlen_t addr = parse_hex(packet, pos);
+    if (packet[1] >= '2') {
+        // Watchpoints: write, read, access; kind is the length
+        static const int kinds[] = {WATCH_WRITE, WATCH_READ, WATCH_ACCESS};
+        int kind = kinds[packet[1] - '2'];
+        pos++;
+        uint32_t len = parse_hex(packet, pos);
+        if (set) {
+            core.addWatchpoint(addr, len, kind);
+            watches.push_back(watchpoint_t{addr, len, kind});
+            return "OK";
+        }
+        for (size_t i = 0; i < watches.size(); ++i) {
+            if (watches[i].address == addr && watches[i].len == len && watches[i].kind == kind) {
+                core.removeWatchpoint(addr, len, kind);
+                watches.erase(watches.begin() + i);
+                return "OK";
+            }
+        }
+        return "E01";
+    }
+    std::set<xlen_t> &breaks = (packet[1] == '0') ? sw_breaks : hw_breaks;
+    if (set) {
+        breaks.insert(addr);
+        core.setBreakpoint(addr, true);
+    } else {
+        breaks.erase(addr);
+        if (!sw_breaks.count(addr) && !hw_breaks.count(addr)) {
+            core.setBreakpoint(addr, false);
+        }
+    }
+    return "OK";
+}
+
+std::string GdbStub::query(const std::string &packet) {
+    char supported[128];
+    snprintf(supported, sizeof(supported), "PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+;QStartNoAckMode+%s",
+             GDB_PACKET_SIZE, replay ? ";ReverseStep+;ReverseContinue+" : "");
+    if (packet.compare(0, 10, "qSupported") == 0) {
+        return supported;
+    }
+    if (packet == "QStartNoAckMode") {
+        ack = false; // Takes effect after this reply
+        return "OK";
+    }
+    if (packet == "qAttached") {
+        return "1"; // Detaching leaves the program running
+    }
+    if (packet == "qfThreadInfo") {
+        return "m1";
+    }
+    if (packet == "qsThreadInfo") {
+        return "l";
+    }
+    if (packet == "qSymbol::") {
+        return "OK";
+    }
+    const std::string xfer = "qXfer:features:read:target.xml:";
+    if (packet.compare(0, xfer.size(), xfer) == 0) {
+        size_t pos = xfer.size();
+        uint32_t offset = parse_hex(packet, pos);
+        pos++;
+        uint32_t len = parse_hex(packet, pos);
+        std::string xml = target_xml();
+        if (offset >= xml.size()) {
+            return "l";
+        }
+        std::string part = xml.substr(offset, len);
+        return (offset + part.size() < xml.size() ? "m" : "l") + part;
+    }
+    return "";
+}
+
+int GdbStub::serve() {
+    printf("Waiting for GDB on %s\n", address.c_str());
+    fflush(stdout);
+    do {
+        fd = accept(listener, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Could not accept a GDB connection: ") + strerror(errno));
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on Unix sockets
+    printf("GDB connected\n");
+
+    std::string packet;
+    while (get_packet(packet)) {
+        std::string reply;
+        std::string args = packet.substr(1);
+        switch (packet[0]) {
+            case '?':
+                reply = "S05";
+                break;
+            case 'g':
+                reply = read_registers();
+                break;
+            case 'G':
+                reply = write_registers(args);
+                break;
+            case 'p':
+                reply = read_register(args);
+                break;
+            case 'P':
+                reply = write_register(args);
+                break;
+            case 'm':
+                reply = read_memory(args);
+                break;
+            case 'M':
+                reply = write_memory(args);
+                break;
+            case 'Z': case 'z':
+                reply = breakpoint(packet);
+                break;
+            case 'c': case 's': case 'C': case 'S': {
+                // Optional resume address (after the signal number for C and S, which is ignored)
+                size_t pos = (packet[0] == 'C' || packet[0] == 'S') ? args.find(';') : 0;
+                if (pos != std::string::npos && !replay) {
+                    pos += (packet[0] == 'C' || packet[0] == 'S');
+                    if (pos < args.size()) {
+                        core.setPC(parse_hex(args, pos));
+                    }
+                }
+                bool stopped;
+                int rc;
+                try {
+                    rc = resume(packet[0] == 's' || packet[0] == 'S', stopped);
+                } catch (const std::exception&) {
+                    platform.out.flush();
+                    put_packet("X04"); // SIGILL: the program cannot go on
+                    throw;
+                }
+                put_packet(stop_reply(rc, stopped));
+                if (rc == RC_EXIT && !replay) {
+                    return rc;
+                }
+                continue;
+            }
+            case 'b':
+                // Reverse execution: bs and bc
+                if (replay && (args == "s" || args == "c")) {
+                    try {
+                        reply = reverse(args == "s");
+                    } catch (const std::exception&) {
+                        platform.out.flush();
+                        put_packet("X04");
+                        throw;
+                    }
+                }
+                break;
+            case 'D': {
+                // Let the program run on to its end
+                put_packet("OK");
+                close(fd);
+                fd = -1;
+                for (xlen_t pc : sw_breaks) {
+                    core.setBreakpoint(pc, false);
+                }
+                for (xlen_t pc : hw_breaks) {
+                    core.setBreakpoint(pc, false);
+                }
+                while (!watches.empty()) {
+                    core.removeWatchpoint(watches.back().address, watches.back().len, watches.back().kind);
+                    watches.pop_back();
+                }
+                printf("GDB detached\n");
+                int rc = 0;
+                while (rc == 0) {
+                    rc = advance(GDB_SLICE);
+                }
+                return rc;
+            }
+            case 'k':
+                return 0; // No reply
+            case 'v':
+                if (packet.compare(0, 5, "vKill") == 0) {
+                    put_packet("OK");
+                    return 0;
+                }
+                break; // vCont and the rest are not supported: GDB falls back to c and s
+            case 'H': case 'T':
+                reply = "OK"; // A single thread
+                break;
+            case 'q': case 'Q':
+                reply = query(packet);
+                break;
+            default:
+                break;
+        }
+        put_packet(reply);
+    }
+    printf("GDB disconnected\n");
+    return 0;
+}
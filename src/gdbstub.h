@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <set>
+#include <vector>
+#include "core.h"
+#include "memory.h"
+#include "platform.h"
+#include "replay.h"
+
+// Instructions run between checks for an interrupt (Ctrl-C) from the debugger
+#define GDB_SLICE (1u << 20)
+
+// Largest packet accepted from the debugger (advertised in qSupported)
+#define GDB_PACKET_SIZE 4096
+
+// GDB remote serial protocol server for hart 0. Breakpoints are kept out of band: the
+// core decodes the instructions they are set on as EBREAK, so continue runs the selected
+// engine at full speed until one is reached. Watchpoints stop after the access, with the
+// pc on the next instruction.
+//
+// Debugging a replay, the program runs as recorded, state changes by the debugger are
+// refused, and reverse-step and reverse-continue go back through the replay's snapshots.
+class GdbStub {
+    private:
+        Core &core;
+        Memory &mem;
+        Platform &platform;
+        Replayer *replay;           // Replay being debugged, or nullptr
+        std::string address;        // TCP port or Unix socket path, for messages
+        std::string unix_path;      // Socket file removed by the destructor (Unix sockets)
+        int listener;               // Listening socket
+        int fd;                     // Connection to the debugger, or -1
+        std::string input;          // Received bytes not yet parsed
+        bool ack;                   // Acknowledge packets (until QStartNoAckMode)
+        std::set<xlen_t> sw_breaks; // Breakpoints set by Z0
+        std::set<xlen_t> hw_breaks; // Breakpoints set by Z1
+        std::vector<watchpoint_t> watches;  // Watchpoints set by Z2 (write), Z3 (read) and Z4 (access)
+
+        // Read more bytes from the debugger into input; false when it hung up
+        bool receive();
+
+        // Take the next packet from the debugger; false when it hung up
+        bool get_packet(std::string &packet);
+
+        // Send a packet
+        void put_packet(const std::string &data);
+
+        // Has the debugger sent an interrupt since the last packet?
+        bool interrupted();
+
+        // Run up to n instructions (through the replay, if any)
+        int advance(uint64_t n);
+
+        // Run one instruction, stepping over a breakpoint at pc
+        int step_over();
+
+        // Run until a breakpoint, an EBREAK, the end of the program or an interrupt
+        int resume(bool step, bool &stopped);
+
+        // Stop reply for the result of resume()
+        std::string stop_reply(int rc, bool stopped);
+
+        // Go back one instruction (bs) or to the previous breakpoint or watchpoint (bc); returns the reply
+        std::string reverse(bool step);
+
+        // Packet handlers; they return the reply
+        std::string read_registers();
+        std::string write_registers(const std::string &args);
+        std::string read_register(const std::string &args);
+        std::string write_register(const std::string &args);
+        std::string read_memory(const std::string &args);
+        std::string write_memory(const std::string &args);
+        std::string breakpoint(const std::string &packet);
+        std::string query(const std::string &packet);
+
+    public:
+        // Listen on a loopback TCP port ("1234" or ":1234") or a Unix socket path (throws on error);
+        // with a replayer, debug its replay of core
+        GdbStub(Core &core, Memory &mem, Platform &platform, const std::string &address, Replayer *replay = nullptr);
+
+        // Destructor
+        ~GdbStub();
+
+        // Wait for a debugger and serve it until the program ends or the debugger kills it;
+        // after a detach the program runs on to its end. Returns the run's return code.
+        int serve();
+};
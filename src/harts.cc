@@ -0,0 +1,124 @@
+#include "harts.h"
+#include <thread>
+
+HartGroup::HartGroup(const std::vector<Core*> &harts, DeviceBus *bus, uint64_t quantum, ReplayLog *log) :
+    harts(harts), bus(bus), quantum(quantum), log(log) {
+    stop = false;
+    result = 0;
+    stopped_hart = 0;
+    arrived = 0;
+    rounds = 0;
+    done = false;
+}
+
+void HartGroup::finish(size_t hart, int rc, std::exception_ptr e) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (!stop) {
+        result = rc;
+        stopped_hart = hart;
+        error = e;
+        stop = true;
+    }
+}
+
+void HartGroup::run_free(size_t hart) {
+    Core *core = harts[hart];
+    try {
+        while (!stop) {
+            int rc = core->run(HART_SLICE);
+            if (rc != 0) {
+                finish(hart, rc);
+            }
+        }
+    } catch (...) {
+        finish(hart, 0, std::current_exception());
+    }
+}
+
+void HartGroup::run_quantum(size_t hart) {
+    Core *core = harts[hart];
+    bool running = true;
+    for (uint64_t target = quantum; ; target += quantum) {
+        // Retire this round's instructions (a hart that overshot sits the round out)
+        try {
+            while (running && core->getInstret() < target) {
+                int rc = core->run(target - core->getInstret());
+                if (rc != 0) {
+                    finish(hart, rc);
+                    running = false;
+                }
+            }
+        } catch (...) {
+            finish(hart, 0, std::current_exception());
+            running = false;
+        }
+
+        sync();
+        std::lock_guard<std::mutex> guard(mutex);
+        if (done) {
+            return;
+        }
+    }
+}
+
+void HartGroup::run_recorded() {
+    while (!stop) {
+        for (size_t i = 0; i < harts.size() && !stop; ++i) {
+            Core *core = harts[i];
+            uint64_t end = core->getInstret() + quantum;
+            log->log_slice(i, end);
+            int rc = run_exact(*core, end);
+            if (rc != 0) {
+                finish(i, rc);
+            }
+        }
+        rounds++;
+        bus->set_time(rounds * quantum);
+    }
+}
+
+void HartGroup::sync() {
+    std::unique_lock<std::mutex> guard(mutex);
+    uint64_t round = rounds;
+    if (++arrived < harts.size()) {
+        round_done.wait(guard, [&] { return rounds != round; });
+        return;
+    }
+
+    // Last to arrive: everyone is stopped, so device state can change deterministically
+    arrived = 0;
+    rounds++;
+    bus->set_time(rounds * quantum);
+    done = stop || bus->exit_requested;
+    round_done.notify_all();
+}
+
+int HartGroup::run() {
+    for (size_t i = 0; i < harts.size(); ++i) {
+        harts[i]->setTimekeeper(quantum == 0 && i == 0);
+    }
+    if (quantum) {
+        bus->set_time(0);
+    }
+    if (log) {
+        run_recorded();
+        return bus->exit_requested ? RC_EXIT : result;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < harts.size(); ++i) {
+        if (quantum) {
+            threads.emplace_back(&HartGroup::run_quantum, this, i);
+        } else {
+            threads.emplace_back(&HartGroup::run_free, this, i);
+        }
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return bus->exit_requested ? RC_EXIT : result;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "core.h"
+#include "replay.h"
+
+// Instructions a free-running hart executes between checks for the end of the simulation
+#define HART_SLICE 100000
+
+// Runs harts that share one memory and device bus, each on a host thread of its own.
+//
+// With quantum == 0 the harts run freely and device time follows hart 0.
+// With quantum > 0 the harts meet at a barrier every quantum instructions; device time
+// then advances by exactly one quantum per round and interrupts are sampled only at
+// round boundaries, so timer and software interrupts arrive at the same instruction
+// counts on every run. The interleaving of ordinary memory accesses between harts is
+// still up to the host in both modes.
+//
+// With a replay log, the harts are recorded instead: they take turns of exactly quantum
+// instructions on the calling thread, and every turn is logged, so that the interleaving
+// can be replayed.
+//
+// The simulation ends when a device requests it, or when any hart stops (EBREAK).
+class HartGroup {
+    private:
+        std::vector<Core*> harts;
+        DeviceBus *bus;
+        uint64_t quantum;
+        ReplayLog *log;                 // Recording (nullptr: threads)
+
+        std::atomic<bool> stop;         // Some hart stopped: the others leave at their next check
+        std::mutex mutex;               // Guards the fields below
+        int result;                     // Return code of the first hart to stop
+        size_t stopped_hart;            // Index of that hart
+        std::exception_ptr error;       // Exception thrown on a hart thread
+
+        // Barrier state (quantum mode)
+        std::condition_variable round_done;
+        size_t arrived;                 // Harts waiting at the barrier
+        uint64_t rounds;                // Completed rounds
+        bool done;                      // Set by the last round
+
+        // Record that a hart stopped with rc (or threw)
+        void finish(size_t hart, int rc, std::exception_ptr e = nullptr);
+
+        // Thread bodies
+        void run_free(size_t hart);
+        void run_quantum(size_t hart);
+
+        // Run the harts in turns on this thread, logging the turns
+        void run_recorded();
+
+        // Wait for every hart to finish the round; the last one to arrive advances device time
+        void sync();
+
+    public:
+        // Constructor; harts are run from their current state
+        HartGroup(const std::vector<Core*> &harts, DeviceBus *bus, uint64_t quantum, ReplayLog *log = nullptr);
+
+        // Run all harts until the simulation ends; returns the first nonzero return code
+        int run();
+
+        // Hart that ended the simulation
+        size_t getStoppedHart() const { return stopped_hart; }
+};
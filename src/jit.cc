@@ -0,0 +1,726 @@
+#include "jit.h"
+#include "core.h"
+#include "exec.h"
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+
+// x86-64 registers
+enum x86_reg_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+// x86-64 condition codes
+enum x86_cc_t {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD
+};
+
+// Register usage in translated code:
+//   rbx = guest register file, r12 = Core*, r13 = retired instructions,
+//   r14 = instruction limit, r15 = JitContext*, rbp = next trace word;
+//   rax/rcx/rdx/rsi/rdi are scratch.
+
+// Minimal x86-64 instruction encoder
+struct Emitter {
+    uint8_t *p;
+
+    void u8(uint8_t v) { *p++ = v; }
+    void u32(uint32_t v) { memcpy(p, &v, 4); p += 4; }
+    void u64(uint64_t v) { memcpy(p, &v, 8); p += 8; }
+
+    // REX prefix (omitted when not needed)
+    void rex(bool w, int reg, int rm) {
+        uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (r != 0x40) u8(r);
+    }
+
+    // ModRM for [base + disp] (base must not be rsp/r12)
+    void modrm_mem(int reg, int base, int32_t disp) {
+        if (disp == 0 && (base & 7) != RBP) {
+            u8(((reg & 7) << 3) | (base & 7));
+        } else if (disp >= -128 && disp < 128) {
+            u8(0x40 | ((reg & 7) << 3) | (base & 7));
+            u8(disp);
+        } else {
+            u8(0x80 | ((reg & 7) << 3) | (base & 7));
+            u32(disp);
+        }
+    }
+
+    // op reg, [base + disp] / op [base + disp], reg
+    void op_rm(uint8_t opc, bool w, int reg, int base, int32_t disp) {
+        rex(w, reg, base);
+        u8(opc);
+        modrm_mem(reg, base, disp);
+    }
+
+    // op rm, reg (register direct)
+    void op_rr(uint8_t opc, bool w, int reg, int rm) {
+        rex(w, reg, rm);
+        u8(opc);
+        u8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // Group-1 ALU op with imm32: /0 add, /1 or, /4 and, /5 sub, /6 xor, /7 cmp
+    void alu_ri(int ext, bool w, int rm, int32_t imm) {
+        rex(w, 0, rm);
+        if (imm >= -128 && imm < 128) {
+            u8(0x83);
+            u8(0xC0 | (ext << 3) | (rm & 7));
+            u8(imm);
+        } else {
+            u8(0x81);
+            u8(0xC0 | (ext << 3) | (rm & 7));
+            u32(imm);
+        }
+    }
+
+    // Shift group: /4 shl, /5 shr, /7 sar; by cl or by imm8
+    void shift_cl(int ext, int rm) { rex(false, 0, rm); u8(0xD3); u8(0xC0 | (ext << 3) | (rm & 7)); }
+    void shift_ri(int ext, int rm, uint8_t imm) { rex(false, 0, rm); u8(0xC1); u8(0xC0 | (ext << 3) | (rm & 7)); u8(imm); }
+
+    void mov_ri(int r, uint32_t imm) { rex(false, 0, r); u8(0xB8 + (r & 7)); u32(imm); }
+    void mov_ri64(int r, uint64_t imm) { rex(true, 0, r); u8(0xB8 + (r & 7)); u64(imm); }
+    void mov_mi(int base, int32_t disp, uint32_t imm) { op_rm(0xC7, false, 0, base, disp); u32(imm); }
+    void setcc_eax(int cc) { u8(0x0F); u8(0x90 + cc); u8(0xC0); u8(0x0F); u8(0xB6); u8(0xC0); }
+    void push(int r) { rex(false, 0, r); u8(0x50 + (r & 7)); }
+    void pop(int r) { rex(false, 0, r); u8(0x58 + (r & 7)); }
+    void call_abs(const void *fn) { mov_ri64(RAX, (uint64_t)fn); u8(0xFF); u8(0xD0); }
+
+    // Jumps return the address of their rel32 field for patching
+    uint8_t *jmp() { u8(0xE9); u32(0); return p - 4; }
+    uint8_t *jcc(int cc) { u8(0x0F); u8(0x80 + cc); u32(0); return p - 4; }
+    void jmp_to(uint8_t *target) { patch(jmp(), target); }
+    void jcc_to(int cc, uint8_t *target) { patch(jcc(cc), target); }
+
+    static void patch(uint8_t *site, uint8_t *target) {
+        int32_t rel = (int32_t)(target - (site + 4));
+        memcpy(site, &rel, 4);
+    }
+
+    // Guest register access
+    void load_reg(int r, int greg) {
+        if (greg == 0) {
+            op_rr(0x31, false, r, r); // xor r, r
+        } else {
+            op_rm(0x8B, false, r, RBX, 4 * greg);
+        }
+    }
+    void store_reg(int greg, int r) {
+        if (greg != REG_SINK) {
+            op_rm(0x89, false, r, RBX, 4 * greg);
+        }
+    }
+    void store_reg_imm(int greg, uint32_t imm) {
+        if (greg != REG_SINK) {
+            mov_mi(RBX, 4 * greg, imm);
+        }
+    }
+
+    // Account for retired instructions
+    void retire(uint32_t count) {
+        if (count) {
+            alu_ri(0, true, R13, count);
+        }
+    }
+};
+
+// Memory helpers called from translated code
+
+template<int OP>
+int Jit::load_helper(Core *core, uint32_t address, uint32_t rd) {
+    core->rf[rd] = core->load<OP>(address);
+    return core->halt; // A watchpoint was hit
+}
+
+template<int OP>
+int Jit::store_helper(Core *core, uint32_t address, uint32_t value) {
+    core->store<OP>(address, value);
+    // Leave if translated code was overwritten or a device stopped the simulation
+    return core->bcache.epoch != core->jit->epoch || core->halt;
+}
+
+void Jit::partial_helper(Core *core, Block *b, uint32_t retired) {
+    core->count_partial(b, retired);
+}
+
+uint32_t Jit::profile_helper(Core *core, Block *b, uint32_t pc_next, uint64_t instret) {
+    core->profiler->retire_block(b->uops.data(), b->len, pc_next, instret);
+    return pc_next;
+}
+
+uint32_t Jit::lr_helper(Core *core, uint32_t address) {
+    return core->load_reserved(address);
+}
+
+template<int OP>
+int Jit::amo_helper(Core *core, uint32_t address, uint32_t value, uint32_t rd) {
+    core->rf[rd] = (OP == OP_SC_W) ? core->store_conditional(address, value) : core->amo(OP, address, value);
+    return core->bcache.epoch != core->jit->epoch || core->halt;
+}
+
+Jit::Jit(Core *core) {
+#if !defined(__x86_64__)
+    throw std::runtime_error("JIT engine requires an x86-64 host");
+#endif
+    this->core = core;
+    arena = (uint8_t *)mmap(nullptr, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        throw std::runtime_error("JIT arena allocation failed");
+    }
+    cur = arena;
+    emit_trampolines();
+    code_start = cur;
+    epoch = 0;
+    generation = 0;
+    rewrites.assign(1u << (32 - PAGE_SHIFT), 0);
+    flush();
+}
+
+Jit::~Jit() {
+    munmap(arena, JIT_ARENA_SIZE);
+}
+
+void Jit::emit_trampolines() {
+    Emitter e{cur};
+
+    // uint32_t enter(JitContext *ctx, uint8_t *code)
+    enter_fn = (uint32_t (*)(JitContext *, uint8_t *))e.p;
+    e.push(RBX); e.push(RBP); e.push(R12); e.push(R13); e.push(R14); e.push(R15);
+    e.alu_ri(5, true, RSP, 8); // keep the stack 16-byte aligned for helper calls
+    e.op_rr(0x89, true, RDI, R15);
+    e.op_rm(0x8B, true, RBX, R15, offsetof(JitContext, rf));
+    e.op_rm(0x8B, true, R12, R15, offsetof(JitContext, core));
+    e.op_rm(0x8B, true, R13, R15, offsetof(JitContext, instret));
+    e.op_rm(0x8B, true, R14, R15, offsetof(JitContext, end));
+    e.op_rm(0x8B, true, RBP, R15, offsetof(JitContext, trace_pos));
+    e.u8(0xFF); e.u8(0xE6); // jmp rsi
+
+    // Exit through a chainable jump: rcx = its rel32 site
+    epilogue_link = e.p;
+    e.op_rm(0x89, true, RCX, R15, offsetof(JitContext, link_site));
+    uint8_t *to_common = e.jmp();
+
+    // Plain exit
+    epilogue = e.p;
+    e.op_rm(0xC7, true, 0, R15, offsetof(JitContext, link_site)); e.u32(0);
+    Emitter::patch(to_common, e.p);
+    e.op_rm(0x89, true, R13, R15, offsetof(JitContext, instret));
+    e.op_rm(0x89, true, RBP, R15, offsetof(JitContext, trace_pos));
+    e.alu_ri(0, true, RSP, 8);
+    e.pop(R15); e.pop(R14); e.pop(R13); e.pop(R12); e.pop(RBP); e.pop(RBX);
+    e.u8(0xC3);
+
+    cur = e.p;
+}
+
+// Trace record of a block, written at rbp by its translation: the values of each retired
+// instruction go to fixed offsets as it runs, and each exit writes the header and moves rbp
+// past the values retired so far (see trace.h)
+struct TraceLayout {
+    bool on;                        // Tracing (otherwise nothing is emitted)
+    const Block *b;
+    std::vector<uint32_t> first;    // Index of each instruction's first value; the total after the last
+
+    TraceLayout(const Block *b, bool on) : on(on), b(b), first(b->uops.size() + 1, 0) {
+        for (uint32_t i = 0; i < b->uops.size(); ++i) {
+            uint8_t flags = (i < b->len) ? trace_flags(b->uops[i].op, b->uops[i].rd) : 0;
+            first[i + 1] = first[i] + ((flags & (TRACE_LOAD | TRACE_STORE)) != 0) + ((flags & TRACE_STORE) != 0) +
+                           ((flags & TRACE_WB) != 0);
+        }
+    }
+
+    // Offset from rbp of value k of instruction i
+    int32_t slot(uint32_t i, uint32_t k) const { return 4 * (2 + first[i] + k); }
+
+    // Store the data address of instruction i from reg
+    void address(Emitter &e, uint32_t i, int reg) const {
+        if (on && i < b->len) {
+            e.op_rm(0x89, false, reg, RBP, slot(i, 0));
+        }
+    }
+
+    // Store the value of rs2 of instruction i (a store or atomic) from reg
+    void data(Emitter &e, uint32_t i, int reg) const {
+        if (on && i < b->len) {
+            e.op_rm(0x89, false, reg, RBP, slot(i, 1));
+        }
+    }
+
+    // Store the value instruction i wrote to rd (clobbers eax)
+    void result(Emitter &e, uint32_t i) const {
+        const uop_t &u = b->uops[i];
+        if (!on || i >= b->len || !(trace_flags(u.op, u.rd) & TRACE_WB)) {
+            return;
+        }
+        int32_t disp = 4 * (2 + first[i + 1] - 1);
+        if (u.op == OP_JAL || u.op == OP_JALR) {
+            e.mov_mi(RBP, disp, u.pc + 4);
+        } else {
+            e.op_rm(0x8B, false, RAX, RBX, 4 * u.rd);
+            e.op_rm(0x89, false, RAX, RBP, disp);
+        }
+    }
+
+    // Finish the record after the first retired instructions
+    void end(Emitter &e, uint32_t retired) const {
+        if (on) {
+            e.mov_mi(RBP, 0, TRACE_REC_BLOCK | retired << 8);
+            e.mov_mi(RBP, 4, b->pc);
+            e.alu_ri(0, true, RBP, 4 * (2 + first[retired]));
+        }
+    }
+};
+
+// Leave the block towards a known guest pc; the jump can later be chained to its translation
+static void emit_exit(Emitter &e, uint8_t *epilogue_link, const TraceLayout &t, uint32_t retired, xlen_t target) {
+    t.end(e, retired);
+    e.retire(retired);
+    uint8_t *site = e.jmp();
+    Emitter::patch(site, e.p);
+    e.mov_ri(RAX, target);
+    // lea rcx, [rip + site]
+    e.u8(0x48); e.u8(0x8D); e.u8(0x0D); e.u32(0);
+    Emitter::patch(e.p - 4, site);
+    e.jmp_to(epilogue_link);
+}
+
+// After a memory helper for instruction i returned eax: leave the block at next_pc if it is
+// nonzero (translated code was overwritten, or a device or watchpoint stopped the simulation)
+static void emit_write_check(Emitter &e, uint8_t *epilogue, const void *partial_helper,
+                             const TraceLayout &t, uint32_t i, uint32_t retired, xlen_t next_pc) {
+    e.op_rr(0x85, false, RAX, RAX); // test eax, eax
+    uint8_t *ok = e.jcc(CC_E);
+    e.op_rr(0x89, true, R12, RDI);
+    e.mov_ri64(RSI, (uint64_t)t.b);
+    e.mov_ri(RDX, retired);
+    e.call_abs(partial_helper);
+    t.result(e, i);
+    t.end(e, retired);
+    e.retire(retired);
+    e.mov_ri(RAX, next_pc);
+    e.jmp_to(epilogue);
+    Emitter::patch(ok, e.p);
+}
+
+// Call the profile helper of a block ending in a jump to edx, before counting its last
+// pending instructions in r13; the next pc is back in eax
+static void emit_profile(Emitter &e, const void *profile_helper, const Block *b, uint32_t pending) {
+    e.op_rr(0x89, true, R12, RDI);
+    e.mov_ri64(RSI, (uint64_t)b);
+    e.op_rr(0x89, true, R13, RCX);
+    if (pending) {
+        e.alu_ri(0, true, RCX, pending);
+    }
+    e.call_abs(profile_helper);
+}
+
+// Probe a software TLB for a size-byte access at esi: on a hit rdx points at the data and
+// execution falls through; returns the rel32 of the jump taken on a miss
+static uint8_t *emit_tlb_probe(Emitter &e, const tlb_entry_t *tlb, unsigned size) {
+    static_assert(sizeof(tlb_entry_t) == 16, "TLB entries are indexed with a shift by 4");
+    e.op_rr(0x89, false, RSI, RCX);
+    e.shift_ri(5, RCX, PAGE_SHIFT);
+    e.alu_ri(4, false, RCX, TLB_SIZE - 1);
+    e.shift_ri(4, RCX, 4);
+    e.mov_ri64(RDX, (uint64_t)tlb);
+    e.op_rr(0x01, true, RCX, RDX); // add rdx, rcx
+
+    // Tag and alignment in one compare, as in Core::mem_load/mem_store
+    e.op_rr(0x89, false, RSI, RCX);
+    e.alu_ri(4, false, RCX, ~(PAGE_SIZE - 1) | (size - 1));
+    e.op_rm(0x3B, false, RCX, RDX, offsetof(tlb_entry_t, tag));
+    uint8_t *miss = e.jcc(CC_NE);
+
+    e.op_rm(0x8B, true, RDX, RDX, offsetof(tlb_entry_t, host));
+    e.op_rr(0x89, false, RSI, RCX);
+    e.alu_ri(4, false, RCX, PAGE_SIZE - 1);
+    e.op_rr(0x01, true, RCX, RDX); // add rdx, rcx
+    return miss;
+}
+
+uint8_t *Jit::compile(Block *b) {
+    const uop_t *uops = b->uops.data();
+    size_t n = b->uops.size();
+
+    if (!jit_supported(uops[0].op)) {
+        map[b->pc] = JitEntry{nullptr, b->end, {}}; // Always handled by the interpreter
+        pages[b->pc >> PAGE_SHIFT].push_back(b->pc);
+        return nullptr;
+    }
+
+    Emitter e{cur};
+    uint8_t *entry = e.p;
+    TraceLayout t(b, core->trace != nullptr);
+
+    // Stop before the block once the instruction budget is used up
+    e.op_rr(0x39, true, R14, R13); // cmp r13, r14
+    uint8_t *bail = e.jcc(CC_AE);
+
+    // ... or when its trace record might not fit
+    uint8_t *trace_bail = nullptr;
+    if (t.on) {
+        e.op_rm(0x8B, true, RAX, R15, offsetof(JitContext, trace_limit));
+        e.op_rr(0x29, true, RBP, RAX); // sub rax, rbp
+        e.alu_ri(7, true, RAX, 4 * TRACE_RECORD_WORDS);
+        trace_bail = e.jcc(CC_L);
+    }
+
+    // Count entries for the run statistics
+    e.mov_ri64(RAX, (uint64_t)&b->execs);
+    e.rex(true, 0, RAX); e.u8(0xFF); e.modrm_mem(0, RAX, 0); // inc qword [rax]
+
+    for (size_t i = 0; i < n; ++i) {
+        const uop_t &u = uops[i];
+        uint32_t retired = (i < b->len) ? i + 1 : b->len; // Including this instruction
+
+        if (!jit_supported(u.op)) {
+            // Hand the rest of the block to the interpreter
+            t.end(e, i);
+            e.retire(i);
+            e.mov_ri(RAX, u.pc);
+            e.jmp_to(epilogue);
+            break;
+        }
+
+        switch (u.op) {
+            case OP_NOP:
+                break;
+
+            case OP_LUI: case OP_AUIPC:
+                e.store_reg_imm(u.rd, u.imm);
+                break;
+
+            // Register-register ALU
+            case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND: {
+                static const uint8_t opc[] = {0x03, 0x2B, 0x33, 0x0B, 0x23};
+                int k = (u.op == OP_ADD) ? 0 : (u.op == OP_SUB) ? 1 : (u.op == OP_XOR) ? 2 : (u.op == OP_OR) ? 3 : 4;
+                e.load_reg(RAX, u.rs1);
+                e.op_rm(opc[k], false, RAX, RBX, 4 * u.rs2);
+                e.store_reg(u.rd, RAX);
+                break;
+            }
+            case OP_SLL: case OP_SRL: case OP_SRA:
+                e.load_reg(RAX, u.rs1);
+                e.load_reg(RCX, u.rs2);
+                e.shift_cl((u.op == OP_SLL) ? 4 : (u.op == OP_SRL) ? 5 : 7, RAX); // x86 masks the count to 5 bits
+                e.store_reg(u.rd, RAX);
+                break;
+            case OP_SLT: case OP_SLTU:
+                e.load_reg(RAX, u.rs1);
+                e.op_rm(0x3B, false, RAX, RBX, 4 * u.rs2);
+                e.setcc_eax((u.op == OP_SLT) ? CC_L : CC_B);
+                e.store_reg(u.rd, RAX);
+                break;
+
+            // Register-immediate ALU
+            case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI: {
+                int ext = (u.op == OP_ADDI) ? 0 : (u.op == OP_XORI) ? 6 : (u.op == OP_ORI) ? 1 : 4;
+                if (u.rs1 == 0 && ext != 4) {
+                    e.store_reg_imm(u.rd, u.imm); // li / mv-from-zero idioms
+                    break;
+                }
+                e.load_reg(RAX, u.rs1);
+                e.alu_ri(ext, false, RAX, u.imm);
+                e.store_reg(u.rd, RAX);
+                break;
+            }
+            case OP_SLLI: case OP_SRLI: case OP_SRAI:
+                e.load_reg(RAX, u.rs1);
+                e.shift_ri((u.op == OP_SLLI) ? 4 : (u.op == OP_SRLI) ? 5 : 7, RAX, u.imm);
+                e.store_reg(u.rd, RAX);
+                break;
+            case OP_SLTI: case OP_SLTIU:
+                e.load_reg(RAX, u.rs1);
+                e.alu_ri(7, false, RAX, u.imm);
+                e.setcc_eax((u.op == OP_SLTI) ? CC_L : CC_B);
+                e.store_reg(u.rd, RAX);
+                break;
+
+            // Memory accesses probe the TLBs inline and fall back to the Core helpers
+            case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU: {
+                static int (*const fn[])(Core *, uint32_t, uint32_t) = {
+                    &load_helper<OP_LB>, &load_helper<OP_LH>, &load_helper<OP_LW>, &load_helper<OP_LBU>, &load_helper<OP_LHU>
+                };
+                static const uint8_t size[] = {1, 2, 4, 1, 2};
+                e.load_reg(RSI, u.rs1);
+                if (u.imm) e.alu_ri(0, false, RSI, u.imm);
+                t.address(e, i, RSI);
+                uint8_t *miss = emit_tlb_probe(e, core->tlb_rd, size[u.op - OP_LB]);
+                switch (u.op) {
+                    case OP_LB:  e.u8(0x0F); e.u8(0xBE); e.modrm_mem(RAX, RDX, 0); break; // movsx eax, byte [rdx]
+                    case OP_LH:  e.u8(0x0F); e.u8(0xBF); e.modrm_mem(RAX, RDX, 0); break; // movsx eax, word [rdx]
+                    case OP_LBU: e.u8(0x0F); e.u8(0xB6); e.modrm_mem(RAX, RDX, 0); break; // movzx eax, byte [rdx]
+                    case OP_LHU: e.u8(0x0F); e.u8(0xB7); e.modrm_mem(RAX, RDX, 0); break; // movzx eax, word [rdx]
+                    default:     e.op_rm(0x8B, false, RAX, RDX, 0); break;                // mov eax, [rdx]
+                }
+                e.store_reg(u.rd, RAX);
+                uint8_t *done = e.jmp();
+
+                // Watched pages are never in the TLB, so only a miss can hit a watchpoint
+                Emitter::patch(miss, e.p);
+                e.mov_ri(RDX, u.rd);
+                e.op_rr(0x89, true, R12, RDI);
+                e.call_abs((const void *)fn[u.op - OP_LB]);
+                emit_write_check(e, epilogue, (const void *)&partial_helper, t, i, retired, u.pc + 4);
+                Emitter::patch(done, e.p);
+                break;
+            }
+            case OP_SB: case OP_SH: case OP_SW: {
+                static int (*const fn[])(Core *, uint32_t, uint32_t) = {
+                    &store_helper<OP_SB>, &store_helper<OP_SH>, &store_helper<OP_SW>
+                };
+                e.load_reg(RSI, u.rs1);
+                if (u.imm) e.alu_ri(0, false, RSI, u.imm);
+                e.load_reg(RAX, u.rs2);
+                t.address(e, i, RSI);
+                t.data(e, i, RAX);
+
+                // Directly writable pages never hold code, so a hit cannot invalidate translations
+                uint8_t *miss = emit_tlb_probe(e, core->tlb_wr, (u.op == OP_SB) ? 1 : (u.op == OP_SH) ? 2 : 4);
+                if (u.op == OP_SH) e.u8(0x66);
+                e.u8((u.op == OP_SB) ? 0x88 : 0x89);
+                e.modrm_mem(RAX, RDX, 0);
+                uint8_t *done = e.jmp();
+
+                Emitter::patch(miss, e.p);
+                e.op_rr(0x89, false, RAX, RDX);
+                e.op_rr(0x89, true, R12, RDI);
+                e.call_abs((const void *)fn[u.op - OP_SB]);
+                emit_write_check(e, epilogue, (const void *)&partial_helper, t, i, retired, u.pc + 4);
+                Emitter::patch(done, e.p);
+                break;
+            }
+
+            // Atomics always go through the Core helpers
+            case OP_FENCE:
+                e.u8(0x0F); e.u8(0xAE); e.u8(0xF0); // mfence
+                break;
+            case OP_LR_W:
+                e.load_reg(RSI, u.rs1);
+                t.address(e, i, RSI);
+                e.op_rr(0x89, true, R12, RDI);
+                e.call_abs((const void *)&lr_helper);
+                e.store_reg(u.rd, RAX);
+                break;
+            case OP_SC_W: case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W:
+            case OP_AMOOR_W: case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W: {
+                static int (*const fn[])(Core *, uint32_t, uint32_t, uint32_t) = {
+                    &amo_helper<OP_SC_W>, &amo_helper<OP_AMOSWAP_W>, &amo_helper<OP_AMOADD_W>,
+                    &amo_helper<OP_AMOXOR_W>, &amo_helper<OP_AMOAND_W>, &amo_helper<OP_AMOOR_W>,
+                    &amo_helper<OP_AMOMIN_W>, &amo_helper<OP_AMOMAX_W>, &amo_helper<OP_AMOMINU_W>,
+                    &amo_helper<OP_AMOMAXU_W>
+                };
+                e.load_reg(RSI, u.rs1);
+                e.load_reg(RDX, u.rs2);
+                t.address(e, i, RSI);
+                t.data(e, i, RDX);
+                e.mov_ri(RCX, u.rd);
+                e.op_rr(0x89, true, R12, RDI);
+                e.call_abs((const void *)fn[u.op - OP_SC_W]);
+                emit_write_check(e, epilogue, (const void *)&partial_helper, t, i, retired, u.pc + 4);
+                break;
+            }
+
+            // Control transfers end the block
+            case OP_JAL:
+                e.store_reg_imm(u.rd, u.pc + 4);
+                t.result(e, i);
+                if (b->profiled && i < b->len) {
+                    e.mov_ri(RDX, u.imm);
+                    emit_profile(e, (const void *)&profile_helper, b, retired);
+                }
+                emit_exit(e, epilogue_link, t, retired, u.imm);
+                break;
+
+            case OP_JALR: {
+                e.load_reg(RAX, u.rs1);
+                if (u.imm) e.alu_ri(0, false, RAX, u.imm);
+                e.alu_ri(4, false, RAX, ~1);
+                e.store_reg_imm(u.rd, u.pc + 4); // rs1 was read first
+                t.result(e, i);
+                t.end(e, retired);
+                e.retire(retired);
+                if (b->profiled) {
+                    e.op_rr(0x89, false, RAX, RDX);
+                    emit_profile(e, (const void *)&profile_helper, b, 0);
+                }
+
+                // Probe the lookup table, falling back to the dispatcher on a miss
+                e.op_rr(0x89, false, RAX, RCX);
+                e.shift_ri(5, RCX, 2);
+                e.alu_ri(4, false, RCX, JIT_JTAB_SIZE - 1);
+                e.shift_ri(4, RCX, 4);
+                e.mov_ri64(RDX, (uint64_t)jtab);
+                e.op_rr(0x01, true, RCX, RDX); // add rdx, rcx
+                e.op_rm(0x3B, false, RAX, RDX, offsetof(JitTarget, pc));
+                e.jcc_to(CC_NE, epilogue);
+                e.u8(0xFF); e.modrm_mem(4, RDX, offsetof(JitTarget, code)); // jmp [rdx + code]
+                break;
+            }
+
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+                static const uint8_t cc[] = {CC_E, CC_NE, CC_L, CC_GE, CC_B, CC_AE};
+                e.load_reg(RAX, u.rs1);
+                e.op_rm(0x3B, false, RAX, RBX, 4 * u.rs2);
+                uint8_t *taken = e.jcc(cc[u.op - OP_BEQ]);
+                emit_exit(e, epilogue_link, t, retired, u.pc + 4);
+                Emitter::patch(taken, e.p);
+                emit_exit(e, epilogue_link, t, retired, u.imm);
+                break;
+            }
+        }
+        if (!uop_ends_block(u.op)) {
+            t.result(e, i);
+        }
+    }
+
+    // Budget or trace room exhausted on entry
+    Emitter::patch(bail, e.p);
+    if (trace_bail) {
+        Emitter::patch(trace_bail, e.p);
+    }
+    e.mov_ri(RAX, b->pc);
+    e.jmp_to(epilogue);
+
+    cur = e.p;
+    map[b->pc] = JitEntry{entry, b->end, {}};
+    pages[b->pc >> PAGE_SHIFT].push_back(b->pc);
+    JitTarget &target = jtab[(b->pc >> 2) & (JIT_JTAB_SIZE - 1)];
+    target.pc = b->pc;
+    target.code = entry;
+    return entry;
+}
+
+void Jit::link(uint8_t *site, xlen_t pc) {
+    JitEntry &t = map[pc];
+    Emitter::patch(site, t.code);
+    t.links.push_back(site);
+}
+
+void Jit::invalidate(xlen_t address) {
+    xlen_t page = address >> PAGE_SHIFT;
+    auto p = pages.find(page);
+    if (p == pages.end()) {
+        return;
+    }
+    // Code patched over and over costs a translation each time; the interpreter only decodes it
+    bool all = (rewrites[page] < JIT_REWRITE_LIMIT && ++rewrites[page] == JIT_REWRITE_LIMIT);
+    xlen_t word = address & ~0b11;
+    std::vector<xlen_t> &pcs = p->second;
+    size_t keep = 0;
+    for (size_t i = 0; i < pcs.size(); ++i) {
+        auto m = map.find(pcs[i]);
+        if (!all && (word < m->first || word >= m->second.end)) {
+            pcs[keep++] = pcs[i];
+            continue;
+        }
+
+        // Chained exits go back to their exit code, which follows the jump
+        for (uint8_t *site : m->second.links) {
+            Emitter::patch(site, site + 4);
+        }
+        JitTarget &target = jtab[(m->first >> 2) & (JIT_JTAB_SIZE - 1)];
+        if (target.pc == m->first) {
+            target.pc = 1;
+            target.code = nullptr;
+        }
+        map.erase(m);
+    }
+    pcs.resize(keep);
+    if (pcs.empty()) {
+        pages.erase(p);
+    }
+}
+
+bool Jit::full() const {
+    return cur + JIT_BLOCK_RESERVE > arena + JIT_ARENA_SIZE;
+}
+
+void Jit::flush() {
+    cur = code_start;
+    map.clear();
+    pages.clear();
+    std::fill(rewrites.begin(), rewrites.end(), 0);
+    for (int i = 0; i < JIT_JTAB_SIZE; ++i) {
+        jtab[i].pc = 1; // Never matches: jump targets are even
+        jtab[i].code = nullptr;
+    }
+}
+
+int Core::run_jit(uint64_t max_instrs) {
+    if (!jit) {
+        jit = new Jit(this);
+    }
+
+    uint64_t end = instret + max_instrs;
+    JitContext ctx;
+    ctx.rf = rf;
+    ctx.core = this;
+    ctx.link_site = nullptr;
+    ctx.trace_pos = ctx.trace_limit = nullptr;
+
+    while (instret < end) {
+        if (jit->generation != bcache.generation || jit->full()) {
+            // Blocks were dropped (or no room left): start over. Overwritten code only
+            // drops its own translations, through invalidate_code().
+            jit->flush();
+            jit->generation = bcache.generation;
+            ctx.link_site = nullptr;
+        }
+        jit->epoch = bcache.epoch;
+
+        if (jit->rewritten(pc)) {
+            ctx.link_site = nullptr;
+            int rc = tick();
+            if (rc != 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        bool found;
+        uint8_t *code = jit->find(pc, found);
+        if (!found) {
+            code = jit->compile(lookup_block(pc));
+            if (jit->generation != bcache.generation) {
+                continue; // Translating flushed the block cache
+            }
+        }
+
+        // Chain the exit we left through to this translation
+        if (ctx.link_site && code) {
+            jit->link(ctx.link_site, pc);
+        }
+        ctx.link_site = nullptr;
+
+        if (!code) {
+            // Instruction the JIT leaves to the interpreter
+            int rc = tick();
+            if (rc != 0) {
+                return rc;
+            }
+            continue;
+        }
+
+        ctx.instret = instret;
+        ctx.end = end;
+        if (trace) {
+            ctx.trace_pos = trace->reserve();
+            ctx.trace_limit = trace->limit;
+        }
+        pc = jit->enter(ctx, code);
+        instret = ctx.instret;
+        if (trace) {
+            trace->pos = ctx.trace_pos;
+        }
+        if (halt) {
+            return halt_code();
+        }
+    }
+    return 0;
+}
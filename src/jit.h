@@ -0,0 +1,127 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include "defs.h"
+#include "decode.h"
+
+// Size of the executable code arena in bytes
+#define JIT_ARENA_SIZE (64 << 20)
+
+// Space kept free at the end of the arena for one more block
+#define JIT_BLOCK_RESERVE (64 << 10)
+
+// Number of entries in the JALR target lookup table (must be a power of 2)
+#define JIT_JTAB_SIZE 4096
+
+// Times the translations on a page are dropped for stores to its code before the page is left
+// to the interpreter (until the next flush)
+#define JIT_REWRITE_LIMIT 16
+
+class Core;
+struct Block;
+
+// State shared between the dispatcher and translated code
+struct JitContext {
+    xlen_t   *rf;           // Guest register file (pinned in rbx)
+    Core     *core;         // Core passed to memory helpers (pinned in r12)
+    uint64_t instret;       // Retired instructions (pinned in r13)
+    uint64_t end;           // Leave translated code once instret reaches this (pinned in r14)
+    uint8_t  *link_site;    // rel32 of the exit that left translated code, if it can be chained
+    uint32_t *trace_pos;    // Next trace word (pinned in rbp; see TraceBuffer)
+    uint32_t *trace_limit;  // End of the trace room: traced blocks leave before they could pass it
+};
+
+// Translation of a block
+struct JitEntry {
+    uint8_t *code;                  // nullptr: the first instruction is left to the interpreter
+    xlen_t end;                     // Address after the block's last instruction
+    std::vector<uint8_t*> links;    // rel32 sites of the exits chained to it
+};
+
+// JALR target lookup entry, probed inline by translated code
+struct JitTarget {
+    uint32_t pc;
+    uint32_t pad;
+    uint8_t  *code;
+};
+
+// x86-64 translator for RV32I basic blocks
+class Jit {
+    private:
+        Core *core;             // Core whose TLBs translated code probes
+        uint8_t *arena;         // Executable code buffer
+        uint8_t *cur;           // Next free byte in the arena
+        uint8_t *code_start;    // First byte after the fixed prologue/epilogue code
+
+        // Entry trampoline: (JitContext *ctx, uint8_t *code) -> next pc
+        uint32_t (*enter_fn)(JitContext *ctx, uint8_t *code);
+        uint8_t *epilogue;      // Leave translated code, eax = next pc
+        uint8_t *epilogue_link; // Same, with rcx = rel32 site to chain
+
+        std::unordered_map<xlen_t, JitEntry> map;   // Translations by guest PC
+        std::unordered_map<xlen_t, std::vector<xlen_t>> pages;  // Their PCs by page (blocks never cross one)
+        std::vector<uint8_t> rewrites;              // Invalidations of each page, up to JIT_REWRITE_LIMIT
+        JitTarget jtab[JIT_JTAB_SIZE];              // Inline lookup table for computed jumps
+
+        // Emit the fixed prologue and epilogue code
+        void emit_trampolines();
+
+        // Memory access helpers called from translated code; load_helper writes rd itself and
+        // returns like store_helper (nonzero: leave the block)
+        template<int OP> static int load_helper(Core *core, uint32_t address, uint32_t rd);
+        template<int OP> static int store_helper(Core *core, uint32_t address, uint32_t value);
+        static void partial_helper(Core *core, Block *b, uint32_t retired);
+
+        // Follow a block ending in a jump to pc_next for the profiler; returns pc_next
+        static uint32_t profile_helper(Core *core, Block *b, uint32_t pc_next, uint64_t instret);
+
+        // Atomic memory operation helpers; amo_helper writes rd itself and returns like store_helper
+        static uint32_t lr_helper(Core *core, uint32_t address);
+        template<int OP> static int amo_helper(Core *core, uint32_t address, uint32_t value, uint32_t rd);
+
+    public:
+        uint64_t epoch;         // BlockCache::epoch translated code last ran against
+        uint64_t generation;    // BlockCache::generation the translations were made against
+
+        // Constructor
+        Jit(Core *core);
+
+        // Destructor
+        ~Jit();
+
+        // Find the translation for pc; sets found to false if pc was never translated
+        uint8_t *find(xlen_t pc, bool &found) {
+            auto it = map.find(pc);
+            found = (it != map.end());
+            return found ? it->second.code : nullptr;
+        }
+
+        // Translate a block; returns nullptr if its first instruction must be interpreted
+        uint8_t *compile(Block *b);
+
+        // Point a chained exit at the translation of pc
+        void link(uint8_t *site, xlen_t pc);
+
+        // Drop the translations covering the word at address (all those on its page once it
+        // reaches JIT_REWRITE_LIMIT), unchaining the exits into them; their code stays in the
+        // arena until the next flush
+        void invalidate(xlen_t address);
+
+        // Is the code at pc rewritten too often to be worth translating again?
+        bool rewritten(xlen_t pc) const { return rewrites[pc >> PAGE_SHIFT] == JIT_REWRITE_LIMIT; }
+
+        // Is the arena too full to translate another block?
+        bool full() const;
+
+        // Drop all translations
+        void flush();
+
+        // Run translated code starting at code, returns the next guest pc
+        uint32_t enter(JitContext &ctx, uint8_t *code) { return enter_fn(&ctx, code); }
+};
+
+// Can the JIT translate the operation (otherwise it is left to the interpreter)?
+constexpr bool jit_supported(int op) {
+    return op != OP_EBREAK && op != OP_ILLEGAL && !uop_runs_alone(op);
+}
@@ -1,16 +1,226 @@
 #include "memory.h"
+#include "symtab.h"
 #include <stdexcept>
+#include <algorithm>
+#include <string.h>
+#include <elf.h>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-Memory::Memory(uint32_t size) {
-    if (size % 4 != 0) {
-        throw std::invalid_argument("Memory allocation failed: Size must be a multiple of 4");
+// Reservations of the live mmap-backed memories, scanned by the fault handler
+static std::atomic<uint8_t*> reservations[MEM_MAX_RESERVATIONS];
+
+// Committed-granule maps of the same memories, updated by the fault handler
+static uint8_t *granule_maps[MEM_MAX_RESERVATIONS];
+
+// Handler that was installed before ours, for faults outside any reservation
+static struct sigaction prev_segv;
+
+// Commit the granule around a faulting guest access; anything else is a real crash
+static void segv_handler(int sig, siginfo_t *info, void *ctx) {
+    uint8_t *addr = static_cast<uint8_t*>(info->si_addr);
+    for (int i = 0; i < MEM_MAX_RESERVATIONS; ++i) {
+        uint8_t *base = reservations[i].load(std::memory_order_acquire);
+        if (base && addr >= base && addr < base + MEM_RESERVE_SIZE) {
+            uintptr_t off = (addr - base) & ~(uintptr_t)(MEM_COMMIT_SIZE - 1);
+            if (mprotect(base + off, MEM_COMMIT_SIZE, PROT_READ | PROT_WRITE) == 0) {
+                granule_maps[i][off >> MEM_COMMIT_SHIFT] = 1;
+                return; // Retry the access
+            }
+            break;
+        }
+    }
+
+    // Not ours: hand over to the previous handler, or re-fault with the default action
+    if (prev_segv.sa_flags & SA_SIGINFO) {
+        prev_segv.sa_sigaction(sig, info, ctx);
+    } else if (prev_segv.sa_handler != SIG_DFL && prev_segv.sa_handler != SIG_IGN) {
+        prev_segv.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+Memory::Memory(mem_backend_t backend) {
+    for (int i = 0; i < (1 << MEM_DIR_BITS); ++i) {
+        dir[i] = nullptr;
+    }
+    npages = 0;
+    base = nullptr;
+    committed = nullptr;
+    quiet = false;
+    resv_pages.assign(1u << (32 - PAGE_SHIFT), 0);
+    memset(store_seqs, 0, sizeof(store_seqs));
+    if (backend == MEM_MMAP) {
+        reserve();
+    }
+}
+
+void Memory::reserve() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        struct sigaction sa = {};
+        sa.sa_sigaction = segv_handler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &prev_segv);
+    });
+
+    void *p = mmap(nullptr, MEM_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("Could not reserve guest address space");
+    }
+    base = static_cast<uint8_t*>(p);
+    committed = new uint8_t[MEM_RESERVE_SIZE >> MEM_COMMIT_SHIFT]();
+    for (int i = 0; i < MEM_MAX_RESERVATIONS; ++i) {
+        uint8_t *expected = nullptr;
+        if (reservations[i].compare_exchange_strong(expected, base)) {
+            granule_maps[i] = committed; // Nothing can fault in the reservation before we return
+            return;
+        }
+    }
+    munmap(base, MEM_RESERVE_SIZE);
+    base = nullptr;
+    delete[] committed;
+    committed = nullptr;
+    throw std::runtime_error("Too many mmap-backed memories");
+}
+
+void Memory::commit(uint32_t address, size_t size) {
+    uint64_t first = address & ~(uint64_t)(MEM_COMMIT_SIZE - 1);
+    uint64_t last = ((uint64_t)address + size + MEM_COMMIT_SIZE - 1) & ~(uint64_t)(MEM_COMMIT_SIZE - 1);
+    if (mprotect(base + first, last - first, PROT_READ | PROT_WRITE) != 0) {
+        throw std::runtime_error("Could not commit guest memory");
+    }
+    mark_committed(first, last - first);
+}
+
+void Memory::mark_committed(uint64_t address, uint64_t size) {
+    uint64_t end = address + size;
+    for (uint64_t g = address >> MEM_COMMIT_SHIFT; g < (end + MEM_COMMIT_SIZE - 1) >> MEM_COMMIT_SHIFT; ++g) {
+        committed[g] = 1;
     }
-    this->data = new char[size]; // Allocate memory
-    this->size = size; // Set the size
 }
 
 Memory::~Memory() {
-    delete[] data; // Deallocate memory
+    if (base) {
+        for (int i = 0; i < MEM_MAX_RESERVATIONS; ++i) {
+            uint8_t *expected = base;
+            if (reservations[i].compare_exchange_strong(expected, nullptr)) {
+                break;
+            }
+        }
+        munmap(base, MEM_RESERVE_SIZE);
+        delete[] committed;
+        return;
+    }
+    for (int i = 0; i < (1 << MEM_DIR_BITS); ++i) {
+        if (!dir[i]) continue;
+        for (int j = 0; j < (1 << MEM_TABLE_BITS); ++j) {
+            delete[] dir[i][j]; // Deallocate pages
+        }
+        delete[] dir[i];
+    }
+}
+
+uint8_t *Memory::alloc_page(uint32_t address) {
+    // Another hart may be allocating too: entries are published only once initialized
+    std::lock_guard<std::mutex> guard(alloc_lock);
+    uint8_t **&table = dir[address >> (32 - MEM_DIR_BITS)];
+    if (!table) {
+        __atomic_store_n(&table, new uint8_t*[1 << MEM_TABLE_BITS](), __ATOMIC_RELEASE);
+    }
+    uint8_t *&pg = table[(address >> PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)];
+    if (!pg) {
+        __atomic_store_n(&pg, new uint8_t[PAGE_SIZE](), __ATOMIC_RELEASE); // Zero-filled
+        npages++;
+    }
+    return pg;
+}
+
+void Memory::clear() {
+    std::fill(resv_pages.begin(), resv_pages.end(), 0);
+    if (base) {
+        // Map fresh zero pages over the whole reservation (also drops file mappings)
+        void *p = mmap(base, MEM_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not clear guest memory");
+        }
+        memset(committed, 0, MEM_RESERVE_SIZE >> MEM_COMMIT_SHIFT);
+        return;
+    }
+    for (int i = 0; i < (1 << MEM_DIR_BITS); ++i) {
+        if (!dir[i]) continue;
+        for (int j = 0; j < (1 << MEM_TABLE_BITS); ++j) {
+            if (dir[i][j]) {
+                memset(dir[i][j], 0, PAGE_SIZE);
+            }
+        }
+    }
+}
+
+std::vector<uint32_t> Memory::touched_pages() const {
+    std::vector<uint32_t> pages;
+    if (base) {
+        for (uint32_t g = 0; g < (MEM_RESERVE_SIZE >> MEM_COMMIT_SHIFT); ++g) {
+            if (!committed[g]) continue;
+            for (uint32_t off = 0; off < MEM_COMMIT_SIZE; off += PAGE_SIZE) {
+                pages.push_back((g << MEM_COMMIT_SHIFT) + off);
+            }
+        }
+        return pages;
+    }
+    for (uint32_t i = 0; i < (1u << MEM_DIR_BITS); ++i) {
+        if (!dir[i]) continue;
+        for (uint32_t j = 0; j < (1u << MEM_TABLE_BITS); ++j) {
+            if (dir[i][j]) {
+                pages.push_back((i << (32 - MEM_DIR_BITS)) | (j << PAGE_SHIFT));
+            }
+        }
+    }
+    return pages;
+}
+
+void Memory::load_image(uint32_t address, int fd, uint64_t offset, size_t size) {
+    if (base) {
+        void *p = mmap(base + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not map memory image");
+        }
+        mark_committed(address, size);
+        return;
+    }
+    for (size_t done = 0; done < size; done += PAGE_SIZE) {
+        if (pread(fd, page(address + done), PAGE_SIZE, offset + done) != PAGE_SIZE) {
+            throw std::runtime_error("Could not read memory image");
+        }
+    }
+}
+
+uint32_t Memory::getPageCount() const {
+    if (!base) {
+        return npages;
+    }
+
+    // Ask the host which pages of the reservation are resident
+    const size_t chunk = 1ul << 28;
+    std::vector<unsigned char> vec(chunk / PAGE_SIZE);
+    uint32_t count = 0;
+    for (size_t off = 0; off < MEM_RESERVE_SIZE; off += chunk) {
+        if (mincore(base + off, chunk, vec.data()) != 0) {
+            continue;
+        }
+        for (unsigned char v : vec) {
+            count += v & 1;
+        }
+    }
+    return count;
 }
 
 uint32_t Memory::read (uint32_t address) {
@@ -19,12 +229,7 @@ uint32_t Memory::read (uint32_t address) {
         printf("Address: 0x%08x\n", address);
         return 0;
     }
-    if (address >= size) {
-        printf("Read Error: Address out of bounds\n");
-        printf("Address: 0x%08x\n", address);
-        return 0;
-    }
-    return *(reinterpret_cast<uint32_t*>(data + address));
+    return *(reinterpret_cast<uint32_t*>(page(address) + (address & (PAGE_SIZE - 1))));
 }
 
 void Memory::write (uint32_t address, uint32_t value, uint8_t mask) {
@@ -33,20 +238,44 @@ void Memory::write (uint32_t address, uint32_t value, uint8_t mask) {
         printf("Address: 0x%08x\n", address);
         return;
     }
-    if (address >= size) {
-        printf("Write Error: Address out of bounds\n");
-        printf("Address: 0x%08x\n", address);
-        return;
-    }
+    uint8_t *data = page(address) + (address & (PAGE_SIZE - 1));
     
     // selectively write bytes based on the mask
     while(mask) {
         if(mask & 0b1)
-            *(reinterpret_cast<uint8_t*>(data + address)) = value & 0xff;
+            *data = value & 0xff;
         
         mask >>= 1;
         value >>= 8;
-        address++;
+        data++;
+    }
+}
+
+void Memory::write_bytes(uint32_t address, const void *src, size_t size) {
+    const uint8_t *from = static_cast<const uint8_t*>(src);
+    while (size > 0) {
+        uint32_t off = address & (PAGE_SIZE - 1);
+        size_t n = std::min<size_t>(size, PAGE_SIZE - off);
+        if (from) {
+            memcpy(page(address) + off, from, n);
+            from += n;
+        } else {
+            memset(page(address) + off, 0, n);
+        }
+        address += n;
+        size -= n;
+    }
+}
+
+void Memory::read_bytes(uint32_t address, void *dst, size_t size) {
+    uint8_t *to = static_cast<uint8_t*>(dst);
+    while (size > 0) {
+        uint32_t off = address & (PAGE_SIZE - 1);
+        size_t n = std::min<size_t>(size, PAGE_SIZE - off);
+        memcpy(to, page(address) + off, n);
+        to += n;
+        address += n;
+        size -= n;
     }
 }
 
@@ -55,16 +284,8 @@ void Memory::dump (uint32_t address, uint32_t size_w) {
         printf("Error: Address must be a multiple of 4\n");
         return;
     }
-    if (address >= size) {
-        printf("Error: Address out of bounds\n");
-        return;
-    }
-    if (address + size_w * 4 > size) {
-        printf("Error: Dump exceeds memory bounds\n");
-        return;
-    }
     for (uint32_t i = 0; i < size_w; i++) {
-        printf("0x%08x\n", *(reinterpret_cast<uint32_t*>(data + address + (4*i))));
+        printf("0x%08x\n", read(address + 4*i));
     }
     printf("\n");
 }
@@ -74,50 +295,281 @@ void Memory::fill (uint32_t address, uint32_t size_w, uint32_t value) {
         printf("Error: Address must be a multiple of 4\n");
         return;
     }
-    if (address >= size) {
-        printf("Error: Address out of bounds\n");
-        return;
+    for (uint32_t i = 0; i < size_w; i++) {
+        write(address + 4*i, value);
     }
-    if (address + size_w * 4 > size) {
-        printf("Error: Fill exceeds memory bounds\n");
-        return;
+}
+
+// Value of each character as a hex digit, or -1
+static const struct HexDigits {
+    int8_t v[256];
+    HexDigits() {
+        for (int c = 0; c < 256; ++c) {
+            v[c] = (c >= '0' && c <= '9') ? c - '0' :
+                   (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                   (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        }
     }
-    for (uint32_t i = 0; i < size_w; i++) {
-        *(reinterpret_cast<uint32_t*>(data + address + (4*i))) = value;
+    int8_t operator[](uint8_t c) const { return v[c]; }
+} hex_digit;
+
+void Memory::load_error(const std::string &message) const {
+    if (quiet) {
+        throw std::runtime_error(message);
     }
+    fprintf(stderr, "Error: %s\n", message.c_str());
 }
 
 void Memory::load_hex(const std::string &filename) {
     // Load the hex file
-    printf("Loading hex file: %s\n", filename.c_str());
-    std::ifstream hex_file(filename);
-    if(!hex_file.is_open()) {
-        fprintf(stderr, "Error: Could not open hex file: %s\n", filename.c_str());
+    if (!quiet) {
+        printf("Loading hex file: %s\n", filename.c_str());
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        load_error("Could not open hex file: " + filename);
         return;
     }
 
-    std::string line;
+    // Map the whole file and parse it in place
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        if (!quiet) {
+            printf("Loaded 0 bytes in mem\n");
+        }
+        return;
+    }
+    void *text = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        throw std::runtime_error("Could not map hex file: " + filename);
+    }
+
+    const char *p = static_cast<const char*>(text);
+    const char *end = p + st.st_size;
     uint32_t addr = 0x0000000;
     uint64_t nbytes_written = 0;
+    bool invalid = false;
 
-    while(std::getline(hex_file, line)) {
-        if(line.empty()) continue;
-        
-        // Update address if line starts with '@'
-        if(line[0] == '@') {
-            addr = std::stoul(line.substr(1, line.size() - 1), nullptr, 16);
+    while (p < end) {
+        // Skip blank lines and surrounding whitespace
+        if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
             continue;
         }
 
-        // Parse the data line
-        uint32_t data = std::stoul(line, nullptr, 16);
+        // Address lines start with '@'
+        bool is_addr = (*p == '@');
+        if (is_addr) {
+            p++;
+        }
+
+        uint32_t value = 0;
+        const char *start = p;
+        for (; p < end && hex_digit[(uint8_t)*p] >= 0; ++p) {
+            value = (value << 4) | hex_digit[(uint8_t)*p];
+        }
+        if (p == start) {
+            invalid = true;
+            break;
+        }
 
-        // Write the data word to the memory
-        write(addr, data);
+        // Update address
+        if (is_addr) {
+            addr = value;
+            continue;
+        }
+
+        // Write the data word straight into its page
+        if (addr % 4 != 0) {
+            write(addr, value);
+        } else {
+            *reinterpret_cast<uint32_t*>(page(addr) + (addr & (PAGE_SIZE - 1))) = value;
+        }
         addr += 4;
         nbytes_written += 4;
     }
 
-    hex_file.close();
-    printf("Loaded %lu bytes in mem\n", nbytes_written);
+    munmap(text, st.st_size);
+    if (invalid) {
+        load_error("Invalid hex file: " + filename);
+    }
+    if (!quiet) {
+        printf("Loaded %lu bytes in mem\n", nbytes_written);
+    }
+}
+
+void Memory::load_bin(const std::string &filename, uint32_t address) {
+    if (!quiet) {
+        printf("Loading binary file: %s\n", filename.c_str());
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        load_error("Could not open binary file: " + filename);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size > MEM_RESERVE_SIZE - address) {
+        close(fd);
+        char where[16];
+        snprintf(where, sizeof(where), "0x%08x", address);
+        load_error("Binary file does not fit at " + std::string(where) + ": " + filename);
+        return;
+    }
+    size_t size = st.st_size;
+
+    if (base && address % PAGE_SIZE == 0 && size > 0) {
+        // Map the image over the reservation; pages are copied only when the guest writes them
+        void *p = mmap(base + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not map binary file: " + filename);
+        }
+        mark_committed(address, size);
+        if (!quiet) {
+            printf("Mapped %lu bytes in mem\n", size);
+        }
+        return;
+    }
+
+    // Copy the image page by page
+    if (base) {
+        commit(address, size);
+    }
+    size_t done = 0;
+    while (done < size) {
+        uint32_t a = address + done;
+        size_t n = PAGE_SIZE - (a & (PAGE_SIZE - 1));
+        if (n > size - done) {
+            n = size - done;
+        }
+        ssize_t r = pread(fd, page(a) + (a & (PAGE_SIZE - 1)), n, done);
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+    }
+    close(fd);
+    if (!quiet) {
+        printf("Loaded %lu bytes in mem\n", done);
+    }
+}
+
+bool Memory::is_elf(const std::string &filename) {
+    std::ifstream f(filename, std::ios::binary);
+    char magic[SELFMAG];
+    return f.read(magic, SELFMAG) && memcmp(magic, ELFMAG, SELFMAG) == 0;
+}
+
+uint32_t Memory::load_elf(const std::string &filename, SymbolTable *symbols) {
+    if (!quiet) {
+        printf("Loading ELF file: %s\n", filename.c_str());
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open ELF file: " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        close(fd);
+        throw std::runtime_error("Invalid ELF file: " + filename);
+    }
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Could not map ELF file: " + filename);
+    }
+    const uint8_t *image = static_cast<const uint8_t*>(map);
+
+    // Accept little-endian RV32 executables only
+    const Elf32_Ehdr *eh = reinterpret_cast<const Elf32_Ehdr*>(image);
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+        eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_RISCV ||
+        eh->e_phentsize != sizeof(Elf32_Phdr) || eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf32_Phdr) > size) {
+        munmap(map, size);
+        close(fd);
+        throw std::runtime_error("Not an RV32 little-endian ELF executable: " + filename);
+    }
+
+    // Place segments in address order so a shared page is finished by the later segment
+    const Elf32_Phdr *ph = reinterpret_cast<const Elf32_Phdr*>(image + eh->e_phoff);
+    std::vector<const Elf32_Phdr*> segs;
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        if (ph[i].p_type == PT_LOAD && ph[i].p_memsz > 0) {
+            segs.push_back(&ph[i]);
+        }
+    }
+    std::sort(segs.begin(), segs.end(), [](const Elf32_Phdr *a, const Elf32_Phdr *b) {
+        return a->p_vaddr < b->p_vaddr;
+    });
+
+    uint64_t nbytes = 0;
+    for (const Elf32_Phdr *p : segs) {
+        if (p->p_filesz > p->p_memsz || p->p_offset + (uint64_t)p->p_filesz > size ||
+            p->p_vaddr + (uint64_t)p->p_memsz > MEM_RESERVE_SIZE) {
+            munmap(map, size);
+            close(fd);
+            throw std::runtime_error("Invalid ELF segment in: " + filename);
+        }
+        uint32_t filesz = p->p_filesz;
+        if (base && filesz > 0 && p->p_vaddr % PAGE_SIZE == 0 && p->p_offset % PAGE_SIZE == 0) {
+            // Page-aligned segment: map it copy-on-write straight from the file
+            if (mmap(base + p->p_vaddr, filesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, p->p_offset) == MAP_FAILED) {
+                munmap(map, size);
+                close(fd);
+                throw std::runtime_error("Could not map ELF segment in: " + filename);
+            }
+            mark_committed(p->p_vaddr, filesz);
+            // The mapping's last page continues with whatever follows in the file
+            uint32_t tail = (PAGE_SIZE - (filesz & (PAGE_SIZE - 1))) & (PAGE_SIZE - 1);
+            if (tail > 0) {
+                write_bytes(p->p_vaddr + filesz, nullptr, std::min<uint32_t>(tail, p->p_memsz - filesz));
+            }
+        } else {
+            write_bytes(p->p_vaddr, image + p->p_offset, filesz);
+        }
+
+        // Zero-fill .bss
+        write_bytes(p->p_vaddr + filesz, nullptr, p->p_memsz - filesz);
+        nbytes += p->p_memsz;
+    }
+    close(fd);
+
+    // Collect named function, object and untyped symbols (labels such as _start and _data)
+    if (symbols && eh->e_shentsize == sizeof(Elf32_Shdr) &&
+        eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf32_Shdr) <= size) {
+        const Elf32_Shdr *sh = reinterpret_cast<const Elf32_Shdr*>(image + eh->e_shoff);
+        for (int i = 0; i < eh->e_shnum; ++i) {
+            if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum) continue;
+            const Elf32_Shdr &strtab = sh[sh[i].sh_link];
+            if (sh[i].sh_offset + (uint64_t)sh[i].sh_size > size || strtab.sh_offset + (uint64_t)strtab.sh_size > size) continue;
+
+            const Elf32_Sym *sym = reinterpret_cast<const Elf32_Sym*>(image + sh[i].sh_offset);
+            const char *names = reinterpret_cast<const char*>(image + strtab.sh_offset);
+            size_t count = sh[i].sh_size / sizeof(Elf32_Sym);
+            for (size_t j = 1; j < count; ++j) {
+                int type = ELF32_ST_TYPE(sym[j].st_info);
+                if (sym[j].st_name == 0 || sym[j].st_name >= strtab.sh_size || sym[j].st_shndx == SHN_UNDEF) continue;
+                if (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE) continue;
+
+                // Untyped symbols in executable sections are code labels
+                bool func = (type == STT_FUNC);
+                if (type == STT_NOTYPE && sym[j].st_shndx < eh->e_shnum) {
+                    func = (sh[sym[j].st_shndx].sh_flags & SHF_EXECINSTR) != 0;
+                }
+                const char *name = names + sym[j].st_name;
+                symbols->add(std::string(name, strnlen(name, strtab.sh_size - sym[j].st_name)), sym[j].st_value, sym[j].st_size, func);
+            }
+        }
+        symbols->finalize();
+    }
+
+    uint32_t entry = eh->e_entry;
+    munmap(map, size);
+    if (!quiet) {
+        printf("Loaded %lu bytes in mem (entry: 0x%08x)\n", nbytes, entry);
+    }
+    return entry;
 }
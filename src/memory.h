@@ -2,25 +2,163 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <fstream>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include "defs.h"
+
+class SymbolTable;
+
+// Page table geometry: 10-bit directory index, 10-bit table index, 12-bit page offset
+#define MEM_DIR_BITS   10
+#define MEM_TABLE_BITS (32 - PAGE_SHIFT - MEM_DIR_BITS)
+
+// Size of the host reservation backing the guest address space (mmap backend)
+#define MEM_RESERVE_SIZE (1ull << 32)
+
+// Granularity at which the mmap backend commits reserved memory (bounds the number of host mappings)
+#define MEM_COMMIT_SHIFT 20
+#define MEM_COMMIT_SIZE  (1u << MEM_COMMIT_SHIFT)
+
+// Maximum number of live mmap-backed memories
+#define MEM_MAX_RESERVATIONS 256
+
+// Store sequence numbers kept for LR/SC, indexed by word address (words sharing one can only
+// make an SC fail spuriously)
+#define MEM_STORE_SEQS 4096
+
+// Guest memory storage
+enum mem_backend_t {
+    MEM_PAGED,  // Two-level table of heap pages
+    MEM_MMAP    // One PROT_NONE host reservation, committed on fault
+};
 
 class Memory {
     private:
-        char *data; // Pointer to the memory block
-        uint32_t size;   // Size of the memory block in bytes
+        uint8_t **dir[1 << MEM_DIR_BITS]; // Page directory: tables of page pointers, allocated on demand
+        uint32_t npages;                  // Number of allocated pages
+        uint8_t *base;                    // Host address of guest address 0 (mmap backend), else nullptr
+        uint8_t *committed;               // Granules made accessible so far (mmap backend), else nullptr
+        std::mutex alloc_lock;            // Serializes page allocation between harts
+        bool quiet;                       // Loaders print no progress messages and throw their errors
+        std::vector<uint8_t> resv_pages;  // Pages an LR was ever made to (their stores bump store_seqs)
+        uint32_t store_seqs[MEM_STORE_SEQS]; // Even, +2 per store to the words; odd while one is in progress
+
+        // Reserve the guest address space and register it with the fault handler
+        void reserve();
+
+        // Commit the reserved granules covering [address, address + size) ahead of host I/O into them
+        void commit(uint32_t address, size_t size);
+
+        // Record that [address, address + size) is accessible (mmap backend)
+        void mark_committed(uint64_t address, uint64_t size);
+
+        // Report a loader error: printed, or thrown when quiet so that the caller can report it
+        void load_error(const std::string &message) const;
 
     public:
-        // Constructor 
-        Memory(uint32_t size = 1024);
+        // Constructor
+        Memory(mem_backend_t backend = MEM_PAGED);
 
         // Destructor
         ~Memory();
 
-        // Read data from the specified address
+        // Host address of the page containing address (allocated on first touch)
+        uint8_t *page(uint32_t address) {
+            if (base) {
+                return base + (address & ~(PAGE_SIZE - 1)); // Committed by the fault handler on first touch
+            }
+            // Acquire loads pair with the release stores of alloc_page() on another hart
+            uint8_t **table = __atomic_load_n(&dir[address >> (32 - MEM_DIR_BITS)], __ATOMIC_ACQUIRE);
+            if (table) {
+                uint8_t *pg = __atomic_load_n(&table[(address >> PAGE_SHIFT) & ((1 << MEM_TABLE_BITS) - 1)], __ATOMIC_ACQUIRE);
+                if (pg) {
+                    return pg;
+                }
+            }
+            return alloc_page(address);
+        }
+
+        // Allocate the page containing address
+        uint8_t *alloc_page(uint32_t address);
+
+        // Zero all guest memory; heap pages stay allocated so that the memory can be reused
+        void clear();
+
+        // Does the page containing address hold LR/SC reservations? Stores to such pages are
+        // never made directly: they go through the store sequence of the word.
+        bool reservation_page(uint32_t address) const {
+            return __atomic_load_n(&resv_pages[address >> PAGE_SHIFT], __ATOMIC_SEQ_CST);
+        }
+
+        // Mark the page containing address for LR/SC; true if it was not marked yet
+        bool mark_reservation_page(uint32_t address) {
+            return !__atomic_exchange_n(&resv_pages[address >> PAGE_SHIFT], 1, __ATOMIC_SEQ_CST);
+        }
+
+        // Store sequence number of the word at address (accessed with __atomic builtins)
+        uint32_t *store_seq(uint32_t address) { return &store_seqs[(address >> 2) & (MEM_STORE_SEQS - 1)]; }
+
+        // Silence the progress messages of the loaders (errors are thrown instead of printed)
+        void setQuiet(bool quiet) { this->quiet = quiet; }
+
+        // Guest addresses of the pages that may hold nonzero data, in ascending order
+        std::vector<uint32_t> touched_pages() const;
+
+        // Fill [address, address + size) from the file at offset (mapped copy-on-write with the
+        // mmap backend, read otherwise); address, offset and size must be page-aligned
+        void load_image(uint32_t address, int fd, uint64_t offset, size_t size);
+
+        // Number of pages backed by host memory (committed pages for the mmap backend)
+        uint32_t getPageCount() const;
+
+        // Storage backend in use
+        mem_backend_t getBackend() const { return base ? MEM_MMAP : MEM_PAGED; }
+
+        // Typed accesses in host byte order (little-endian hosts); accesses that cross a page go byte by byte
+        uint8_t  load8 (uint32_t address) { return page(address)[address & (PAGE_SIZE - 1)]; }
+        uint16_t load16(uint32_t address) { return load<uint16_t>(address); }
+        uint32_t load32(uint32_t address) { return load<uint32_t>(address); }
+        void store8 (uint32_t address, uint8_t value)  { page(address)[address & (PAGE_SIZE - 1)] = value; }
+        void store16(uint32_t address, uint16_t value) { store<uint16_t>(address, value); }
+        void store32(uint32_t address, uint32_t value) { store<uint32_t>(address, value); }
+
+        template<typename T> T load(uint32_t address) {
+            uint32_t off = address & (PAGE_SIZE - 1);
+            T value = 0;
+            if (off <= PAGE_SIZE - sizeof(T)) {
+                memcpy(&value, page(address) + off, sizeof(T));
+                return value;
+            }
+            for (unsigned i = 0; i < sizeof(T); ++i) {
+                value |= (T)load8(address + i) << (8 * i);
+            }
+            return value;
+        }
+
+        template<typename T> void store(uint32_t address, T value) {
+            uint32_t off = address & (PAGE_SIZE - 1);
+            if (off <= PAGE_SIZE - sizeof(T)) {
+                memcpy(page(address) + off, &value, sizeof(T));
+                return;
+            }
+            for (unsigned i = 0; i < sizeof(T); ++i) {
+                store8(address + i, value >> (8 * i));
+            }
+        }
+
+        // Read the aligned word at the specified address
         uint32_t read (uint32_t address);
 
-        // Write data to the specified address
+        // Write the bytes selected by mask into the aligned word at the specified address (device registers)
         void write (uint32_t address, uint32_t value, uint8_t mask = 0b1111);
 
+        // Copy size bytes from src to guest memory at address (src == nullptr: zero-fill)
+        void write_bytes(uint32_t address, const void *src, size_t size);
+
+        // Copy size bytes of guest memory at address to dst
+        void read_bytes(uint32_t address, void *dst, size_t size);
+
         // Dump memory contents from a specified address
         void dump (uint32_t address, uint32_t size_w);
 
@@ -29,4 +167,13 @@ class Memory {
 
         // Load memory contents from a hex file
         void load_hex(const std::string &filename);
+
+        // Load a flat binary image at address (mapped copy-on-write from the file with the mmap backend)
+        void load_bin(const std::string &filename, uint32_t address);
+
+        // Load the PT_LOAD segments of an RV32 ELF file and its symbols; returns the entry point
+        uint32_t load_elf(const std::string &filename, SymbolTable *symbols = nullptr);
+
+        // Does the file start with the ELF magic?
+        static bool is_elf(const std::string &filename);
 };
@@ -0,0 +1,27 @@
+#include "platform.h"
+
+Platform::Platform(Memory *mem, const std::string &console_target, uint64_t flush_interval, const std::string &disk_path,
+                   bool private_disk) :
+    out(console_target, flush_interval), console(&out), uart(&out), finisher(&bus), marker(&bus), disk(nullptr) {
+    bus.attach(CONSOLE_ADDR, 4, &console);
+    bus.attach(UART_BASE, 8, &uart);
+    bus.attach(CLINT_BASE, 0x10000, &clint);
+    bus.attach(FINISHER_BASE, 4, &finisher);
+    bus.attach(MARKER_BASE, 4, &marker);
+    if (!disk_path.empty()) {
+        disk = new BlockDevice(mem, &bus, disk_path, private_disk);
+        bus.attach(BLKDEV_BASE, 0x18, disk);
+    }
+}
+
+uint32_t load_program(Memory &mem, const std::string &path, uint32_t load_addr, SymbolTable *symbols) {
+    if (Memory::is_elf(path)) {
+        return mem.load_elf(path, symbols);
+    }
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".hex") == 0) {
+        mem.load_hex(path);
+        return 0;
+    }
+    mem.load_bin(path, load_addr);
+    return load_addr;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "memory.h"
+#include "device.h"
+
+class SymbolTable;
+
+// Devices of one simulated machine
+struct Platform {
+    DeviceBus bus;
+    Console out;
+    ConsoleDevice console;
+    Uart uart;
+    Clint clint;
+    TestFinisher finisher;
+    Marker marker;
+    BlockDevice *disk;
+
+    // A private disk works on a copy of the image (a reference machine next to the simulated one)
+    Platform(Memory *mem, const std::string &console_target, uint64_t flush_interval, const std::string &disk_path,
+             bool private_disk = false);
+    ~Platform() { delete disk; }
+};
+
+// Load a program image and return its entry point: ELF files by magic, Verilog hex files
+// by extension, anything else as a flat binary entered at its load address
+uint32_t load_program(Memory &mem, const std::string &path, uint32_t load_addr, SymbolTable *symbols);
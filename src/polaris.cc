@@ -1,10 +1,35 @@
 #include "memory.h"
 #include "core.h"
+#include "symtab.h"
+#include "stats.h"
+#include "harts.h"
+#include "platform.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "fork.h"
+#include "sampling.h"
+#include "trace.h"
+#include "profile.h"
+#include "gdbstub.h"
+#include "replay.h"
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <stdexcept>
 #include <iostream>
+#include <thread>
 #include "argparse.h"
 
-#define DEFAULT_MEM_SIZE 1024
+// Instructions executed per call to Core::run() in normal mode
+#define RUN_SLICE 1000000
+
+// Instructions executed between state comparisons in differential mode
+#define DIFF_SLICE 1000
+
+// Return code for a differential check failure
+#define RC_DIFF_MISMATCH -2
 
 std::string header = 
 " _____      _            _\n"
@@ -17,7 +42,7 @@ std::string header =
 " RISC-V ISA Simulator  (v1.0)\n"
 "==================================\n";
 
-int interactive(Core &core, Memory &mem, bool verbose=false) {
+int interactive(Core &core, Memory &mem, Console &out, bool verbose=false) {
     std::string help =
         "Commands:\n"
         " h, help: Show this help message\n";
@@ -40,6 +65,7 @@ int interactive(Core &core, Memory &mem, bool verbose=false) {
             return 0;
         } else if (cmd == "s" || cmd == "step") {
             int rc = core.tick();
+            out.flush();
             core.dumpRF(!verbose);
             if (rc != 0) {
                 return rc;
@@ -56,14 +82,328 @@ int interactive(Core &core, Memory &mem, bool verbose=false) {
     return 0;
 }
 
-    
-int main(int argc, char** argv) {
-    std::cout << "\033[32m" << header << "\033[0m";
+// Hash of the nonzero pages of guest memory and their addresses (all-zero pages are skipped,
+// so that memories whose backends touch pages differently still compare equal)
+uint64_t hash_memory(Memory &mem) {
+    uint64_t h = 0;
+    for (uint32_t address : mem.touched_pages()) {
+        const uint64_t *words = (const uint64_t *)mem.page(address);
+        uint64_t ph = 0, any = 0;
+        for (uint32_t i = 0; i < PAGE_SIZE / 8; ++i) {
+            ph = (ph ^ words[i]) * 0x100000001b3ull;
+            any |= words[i];
+        }
+        if (any) {
+            h = (h ^ ph ^ address) * 0x9e3779b97f4a7c15ull;
+        }
+    }
+    return h;
+}
+
+// First guest page whose contents differ between two memories (UINT64_MAX if none)
+uint64_t first_diff_page(Memory &mem, Memory &ref_mem) {
+    std::vector<uint32_t> pages = mem.touched_pages(), ref_pages = ref_mem.touched_pages();
+    pages.insert(pages.end(), ref_pages.begin(), ref_pages.end());
+    std::sort(pages.begin(), pages.end());
+    std::vector<uint8_t> a(PAGE_SIZE), b(PAGE_SIZE);
+    for (uint32_t address : pages) {
+        mem.read_bytes(address, a.data(), PAGE_SIZE);
+        ref_mem.read_bytes(address, b.data(), PAGE_SIZE);
+        if (a != b) {
+            return address;
+        }
+    }
+    return UINT64_MAX;
+}
+
+// Run core in lockstep with a reference interpreter, comparing pc, registers, CSRs and guest
+// memory after every slice
+int run_diff(Core &core, Memory &mem, Core &ref, Memory &ref_mem) {
+    int rc = 0, ref_rc = 0;
+    while (rc == 0) {
+        rc = core.run(DIFF_SLICE);
+
+        // Bring the reference to the same point (run() so that device time matches)
+        if (ref_rc == 0 && ref.getInstret() < core.getInstret()) {
+            ref_rc = ref.run(core.getInstret() - ref.getInstret());
+        }
+        if (rc != 0 && ref_rc == 0) {
+            ref_rc = ref.tick();
+        }
+
+        bool match = (rc == ref_rc) && (core.getPC() == ref.getPC()) && (core.getInstret() == ref.getInstret());
+        for (int i = 0; i < 32 && match; ++i) {
+            match = (core.getReg(i) == ref.getReg(i));
+        }
+        core_state_t st, ref_st;
+        core.getState(st);
+        ref.getState(ref_st);
+        const char *csr_names[] = {"mstatus", "mie", "mtvec", "mscratch", "mepc", "mcause", "mtval"};
+        const xlen_t csrs[] = {st.mstatus, st.mie, st.mtvec, st.mscratch, st.mepc, st.mcause, st.mtval};
+        const xlen_t ref_csrs[] = {ref_st.mstatus, ref_st.mie, ref_st.mtvec, ref_st.mscratch, ref_st.mepc,
+                                   ref_st.mcause, ref_st.mtval};
+        for (int i = 0; i < 7 && match; ++i) {
+            if (csrs[i] != ref_csrs[i]) {
+                printf("Differential check failed after %lu instructions: %s is 0x%08x, the reference has 0x%08x\n",
+                       core.getInstret(), csr_names[i], csrs[i], ref_csrs[i]);
+                return RC_DIFF_MISMATCH;
+            }
+        }
+        if (match && hash_memory(mem) != hash_memory(ref_mem)) {
+            printf("Differential check failed after %lu instructions: memory differs in the page at 0x%08lx\n",
+                   core.getInstret(), first_diff_page(mem, ref_mem));
+            return RC_DIFF_MISMATCH;
+        }
+        if (!match) {
+            printf("Differential check failed after %lu instructions\n", core.getInstret());
+            printf("Engine (rc=%d):\n", rc);
+            core.dumpRF();
+            printf("Reference (rc=%d, instret=%lu):\n", ref_rc, ref.getInstret());
+            ref.dumpRF();
+            return RC_DIFF_MISMATCH;
+        }
+    }
+    return rc;
+}
+
+// Print an instruction address, with its symbol if known, and the rest of the line
+void print_site(xlen_t pc, const SymbolTable &symbols, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void print_site(xlen_t pc, const SymbolTable &symbols, const char *fmt, ...) {
+    printf("  0x%08x ", pc);
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    const Symbol *sym = symbols.lookup(pc);
+    if (sym) {
+        printf("  %s+0x%x", sym->name.c_str(), pc - sym->addr);
+    }
+    printf("\n");
+}
 
+// Print the instructions of hart 0 with the most misses in each cache level
+void print_cache_misses(const Core &core, const SymbolTable &symbols, int n) {
+    for (const Cache *level : core.getCaches()->levels()) {
+        printf("Top %s misses:\n", level->getStats().name.c_str());
+        for (auto &entry : level->top_misses(n)) {
+            print_site(entry.first, symbols, "%12lu", entry.second);
+        }
+    }
+}
+
+// Print the branches of hart 0 with the most mispredictions
+void print_branch_misses(const Core &core, const SymbolTable &symbols, int n) {
+    printf("Top mispredicted branches:        misses     executed\n");
+    for (auto &entry : core.getBranchPredictor()->top_misses(n)) {
+        const BranchSite &site = entry.second;
+        print_site(entry.first, symbols, "%12lu %12lu (%5.1f%%)", site.misses, site.count, 100.0 * site.misses / site.count);
+    }
+}
+
+// Print the functions of hart 0 that retired the most instructions
+void print_profile(const Core &core, const SymbolTable &symbols, int n, bool timing) {
+    std::vector<FunctionProfile> funcs = core.getProfiler()->functions(symbols);
+    uint64_t instrs = 0, cycles = 0;
+    for (const FunctionProfile &fp : funcs) {
+        instrs += fp.self_instrs;
+        cycles += fp.self_cycles;
+    }
+    printf("Top functions:        self          total%s\n", timing ? "         cycles    CPI" : "");
+    for (int i = 0; i < n && i < (int)funcs.size(); ++i) {
+        const FunctionProfile &fp = funcs[i];
+        printf("  %12lu %5.1f%% %12lu %5.1f%%", fp.self_instrs, 100.0 * fp.self_instrs / instrs,
+               fp.total_instrs, 100.0 * fp.total_instrs / instrs);
+        if (timing) {
+            printf(" %12lu %6.3f", fp.self_cycles, (double)fp.self_cycles / fp.self_instrs);
+        }
+        printf("  %s\n", fp.name.c_str());
+    }
+}
+
+// Parse watchpoints: comma-separated [r|w|a:]ADDR[+LEN], where ADDR is a number or a symbol
+// (LEN defaults to the symbol's size, else 4; the kind to w) (throws on a bad spec)
+std::vector<watchpoint_t> parse_watchpoints(const std::string &spec, const SymbolTable &symbols) {
+    std::vector<watchpoint_t> watches;
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        std::string item = spec.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        start = (end == std::string::npos) ? spec.size() + 1 : end + 1;
+
+        watchpoint_t w{0, 4, WATCH_WRITE};
+        if (item.size() > 2 && item[1] == ':') {
+            if (item[0] != 'r' && item[0] != 'w' && item[0] != 'a') {
+                throw std::runtime_error("Bad watchpoint kind (r, w or a): " + item);
+            }
+            w.kind = (item[0] == 'r') ? WATCH_READ : (item[0] == 'w') ? WATCH_WRITE : WATCH_ACCESS;
+            item = item.substr(2);
+        }
+        size_t plus = item.find('+');
+        std::string where = item.substr(0, plus);
+        char *rest;
+        w.address = strtoul(where.c_str(), &rest, 0);
+        if (where.empty() || *rest) {
+            if (!symbols.find(where, w.address)) {
+                throw std::runtime_error("Unknown watchpoint address or symbol: " + where);
+            }
+            const Symbol *sym = symbols.lookup(w.address);
+            if (sym && sym->addr == w.address && sym->size) {
+                w.len = sym->size;
+            }
+        }
+        if (plus != std::string::npos) {
+            std::string len = item.substr(plus + 1);
+            w.len = strtoul(len.c_str(), &rest, 0);
+            if (len.empty() || *rest || w.len == 0) {
+                throw std::runtime_error("Bad watchpoint length: " + item);
+            }
+        }
+        watches.push_back(w);
+    }
+    return watches;
+}
+
+// Print the access that stopped the core at a watchpoint
+void print_watch_hit(const Core &core, const SymbolTable &symbols) {
+    const watch_hit_t &hit = core.getWatchHit();
+    print_site(core.getPC() - 4, symbols, "%-5s %u bytes at 0x%08x: 0x%08x", hit.kind == WATCH_READ ? "read" : "write",
+               hit.size, hit.address, hit.value); // Loads and stores never jump: the access was the previous pc
+}
+
+// Run until the program stops or, if at is nonzero, until exactly at instructions have
+// retired; returns 0 in the latter case
+int run_until(Core &core, uint64_t at) {
+    int rc = 0;
+    while (rc == 0 && (!at || core.getInstret() + BLOCK_MAX_LEN < at)) {
+        uint64_t slice = RUN_SLICE;
+        if (at) {
+            slice = std::min<uint64_t>(slice, at - BLOCK_MAX_LEN - core.getInstret());
+        }
+        rc = core.run(slice); // Simulate a slice of instructions
+    }
+    // Engines may retire a whole block past their budget: single-step the rest
+    while (rc == 0 && at && core.getInstret() < at) {
+        rc = core.tick();
+    }
+    return rc;
+}
+
+// Run the rest of the program in n forked children (each reads its index from the marker) and
+// report their results; returns 0 if all of them passed
+int run_forks(Core &core, Platform &platform, int n) {
+    uint64_t fork_instret = core.getInstret();
+    platform.out.flush();
+    std::vector<ForkResult> results = fork_children(n, [&](unsigned child) {
+        auto t_start = std::chrono::steady_clock::now();
+        platform.bus.marker_requested = false;
+        platform.marker.arm(false);
+        platform.marker.setChild(child);
+        core.resume();
+
+        ForkResult r;
+        r.rc = run_until(core, 0);
+        platform.out.flush();
+        r.exit_code = platform.bus.exit_code;
+        r.instret = core.getInstret() - fork_instret;
+        r.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        return r;
+    });
+
+    int status = 0;
+    for (int i = 0; i < n; ++i) {
+        const ForkResult &r = results[i];
+        if (!r.ok) {
+            printf("Child %d: crashed\n", i);
+            status = 1;
+        } else if (r.rc == RC_EXIT) {
+            printf("Child %d: exited with code %d after %lu instructions (%.3f s)\n", i, r.exit_code, r.instret, r.wall_s);
+            status |= (r.exit_code != 0);
+        } else if (r.rc == RC_EBREAK) {
+            printf("Child %d: EBREAK after %lu instructions (%.3f s)\n", i, r.instret, r.wall_s);
+        } else {
+            printf("Child %d: terminated with unknown error\n", i);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Run every program of a batch and report the results; returns the process exit status
+int run_batch(const std::string &path, const BatchConfig &config, const std::string &report) {
+    std::vector<std::string> programs = batch_programs(path);
+    printf("Running %lu programs on %u threads\n", programs.size(), config.jobs);
+
+    auto t_start = std::chrono::steady_clock::now();
+    BatchRunner runner(config, programs);
+    const std::vector<BatchResult> &results = runner.run();
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    size_t passed = 0;
+    for (const BatchResult &r : results) {
+        if (r.status == BATCH_PASS) {
+            passed++;
+            continue;
+        }
+        switch (r.status) {
+            case BATCH_FAIL:  printf("FAIL  %s (exit code %d, rc %d)\n", r.path.c_str(), r.exit_code, r.rc); break;
+            case BATCH_LIMIT: printf("LIMIT %s (%lu instructions)\n", r.path.c_str(), r.instret); break;
+            default:          printf("ERROR %s: %s (%lu instructions)\n", r.path.c_str(), r.error.c_str(), r.instret); break;
+        }
+    }
+    printf("%lu passed, %lu failed in %.3f s\n", passed, results.size() - passed, wall_s);
+
+    if (!report.empty() && !write_batch_json(results, config, wall_s, report)) {
+        fprintf(stderr, "Error: Could not write batch report: %s\n", report.c_str());
+        return 1;
+    }
+    return passed == results.size() ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
     // Parse Arguments
     ArgParse::ArgumentParser parser("polaris", "RISC-V simulator");
     parser.add_argument({"-d", "--debug"}, "Enable debug mode", ArgParse::ArgType_t::BOOL, "false");
     parser.add_argument({"-v", "--verbose"}, "Enable verbose output", ArgParse::ArgType_t::BOOL, "false");
+    parser.add_argument({"-e", "--engine"}, "Execution engine: block, jit, interp", ArgParse::ArgType_t::STR, "block");
+    parser.add_argument({"--diff"}, "Check the engine against the interpreter", ArgParse::ArgType_t::BOOL, "false");
+    parser.add_argument({"--gdb"}, "Wait for GDB on a local TCP port (e.g. 1234) or a Unix socket path", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--record"}, "Record the device inputs, interrupts and hart turns of the run to a replay log", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--replay"}, "Run again exactly as recorded in a replay log (with --gdb, reverse execution too)", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--watch"}, "Report accesses to data: [r|w|a:]ADDR[+LEN] or a symbol, comma-separated (default w)", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--mem-backend"}, "Guest memory backend: paged, mmap", ArgParse::ArgType_t::STR, "paged");
+    parser.add_argument({"--load-addr"}, "Load address for flat binary images", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--console"}, "Guest console output: stdout, none, or a file", ArgParse::ArgType_t::STR, "stdout");
+    parser.add_argument({"--console-flush"}, "Flush partial console output every N instructions (0: never)", ArgParse::ArgType_t::INT, "10000000");
+    parser.add_argument({"--stats-json"}, "Write run statistics to a JSON file", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--disk"}, "Disk image file for the block device", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--harts"}, "Number of harts, each run on a host thread", ArgParse::ArgType_t::INT, "1");
+    parser.add_argument({"--quantum"}, "Synchronize harts every N instructions for deterministic interrupts (0: free-running)", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--timing"}, "Time instructions with the in-order pipeline model (interprets)", ArgParse::ArgType_t::BOOL, "false");
+    parser.add_argument({"--timing-config"}, "Pipeline model settings, e.g. mem=3,branch=2 (keys: alu shift mem amo branch jal jalr system)", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--cache"}, "Simulate L1I and L1D caches per hart and an L2 shared by the harts (interprets)", ArgParse::ArgType_t::BOOL, "false");
+    parser.add_argument({"--cache-config"}, "Cache settings, e.g. l1d.size=8k,l1d.assoc=2,l2.size=0,mem=80, or @file", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--cache-misses"}, "Report the N instructions with the most misses in each cache", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--bpred"}, "Model a branch predictor: bimodal, gshare, tage (interprets)", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--bpred-config"}, "Branch predictor settings, e.g. table=14,history=14,btb=1024,ras=16", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--bpred-misses"}, "Report the N branches with the most mispredictions", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--sample-period"}, "Sample the models every N instructions and fast-forward in between (0: model everything)", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--sample-warmup"}, "Instructions modelled before each sample to warm the models", ArgParse::ArgType_t::INT, "2000");
+    parser.add_argument({"--sample-window"}, "Instructions measured per sample", ArgParse::ArgType_t::INT, "1000");
+    parser.add_argument({"--bbv"}, "Write basic block vectors for SimPoint to a file (block and jit engines)", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--bbv-interval"}, "Instructions per basic block vector", ArgParse::ArgType_t::INT, "10000000");
+    parser.add_argument({"--trace"}, "Record every retired instruction to a compressed trace file", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--trace-decode"}, "Print a trace file as text and exit", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--profile"}, "Profile hart 0 by function and write its call stacks in folded form to a file", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--profile-top"}, "Functions listed in the profile report", ArgParse::ArgType_t::INT, "20");
+    parser.add_argument({"--batch"}, "Run every program of a directory or manifest file in parallel", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--jobs"}, "Worker threads in batch mode (0: one per host CPU)", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--batch-report"}, "Write batch results to a JSON file", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--max-instrs"}, "Stop each batch program after N instructions (0: no limit)", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--checkpoint"}, "Write a checkpoint file at the guest marker or at --checkpoint-at, then stop", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--checkpoint-at"}, "Take the checkpoint after N instructions (0: at the guest marker only)", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--restore"}, "Resume from a checkpoint file instead of loading a program", ArgParse::ArgType_t::STR, "");
+    parser.add_argument({"--fork"}, "Split into N copy-on-write child processes at the guest marker or at --fork-at", ArgParse::ArgType_t::INT, "0");
+    parser.add_argument({"--fork-at"}, "Fork after N instructions (0: at the guest marker only)", ArgParse::ArgType_t::INT, "0");
 
     if(parser.parse_args(argc, argv) != 0) {
         return 1;
@@ -71,34 +411,418 @@ int main(int argc, char** argv) {
     auto opt_args = parser.get_opt_args();
     auto pos_args = parser.get_pos_args();
 
+    // Decode a trace to stdout, with nothing else in the way
+    std::string trace_decode = opt_args["trace_decode"].value.as_str;
+    if (!trace_decode.empty()) {
+        try {
+            print_trace(trace_decode, stdout);
+        } catch (const std::exception& e) {
+            fflush(stdout);
+            fprintf(stderr, "Error: %s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    // Batch runs skip the banner: their output is meant for CI logs
+    std::string batch = opt_args["batch"].value.as_str;
+    if (batch.empty()) {
+        std::cout << "\033[32m" << header << "\033[0m";
+    }
+
     bool verbose = opt_args["verbose"].value.as_bool;
 
+    engine_t engine;
+    std::string engine_name = opt_args["engine"].value.as_str;
+    if (engine_name == "block") {
+        engine = ENGINE_BLOCK;
+    } else if (engine_name == "jit") {
+        engine = ENGINE_JIT;
+    } else if (engine_name == "interp") {
+        engine = ENGINE_INTERP;
+    } else {
+        fprintf(stderr, "Error: Unknown engine: %s\n", engine_name.c_str());
+        return 1;
+    }
+
+    mem_backend_t backend;
+    std::string backend_name = opt_args["mem_backend"].value.as_str;
+    if (backend_name == "paged") {
+        backend = MEM_PAGED;
+    } else if (backend_name == "mmap") {
+        backend = MEM_MMAP;
+    } else {
+        fprintf(stderr, "Error: Unknown memory backend: %s\n", backend_name.c_str());
+        return 1;
+    }
+    uint32_t load_addr = opt_args["load_addr"].value.as_int;
+
+    int nharts = opt_args["harts"].value.as_int;
+    if (nharts < 1 || nharts > CLINT_MAX_HARTS) {
+        fprintf(stderr, "Error: Number of harts must be between 1 and %d\n", CLINT_MAX_HARTS);
+        return 1;
+    }
+    if (nharts > 1 && (opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool)) {
+        fprintf(stderr, "Error: Debug and differential modes support a single hart\n");
+        return 1;
+    }
+    uint64_t quantum = opt_args["quantum"].value.as_int;
+
+    std::string checkpoint = opt_args["checkpoint"].value.as_str;
+    uint64_t checkpoint_at = checkpoint.empty() ? 0 : opt_args["checkpoint_at"].value.as_int;
+    std::string restore = opt_args["restore"].value.as_str;
+    if (!restore.empty() && nharts > 1) {
+        fprintf(stderr, "Error: Checkpoints support a single hart\n");
+        return 1;
+    }
+    int nforks = opt_args["fork"].value.as_int;
+    uint64_t fork_at = nforks ? opt_args["fork_at"].value.as_int : 0;
+    if (nforks < 0) {
+        fprintf(stderr, "Error: Number of forks must not be negative\n");
+        return 1;
+    }
+    if (nforks && !checkpoint.empty()) {
+        fprintf(stderr, "Error: Use either --checkpoint or --fork\n");
+        return 1;
+    }
+    bool stop_at_marker = !checkpoint.empty() || nforks;
+    uint64_t stop_at = checkpoint_at ? checkpoint_at : fork_at;
+    if (stop_at_marker && (nharts > 1 || opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool)) {
+        fprintf(stderr, "Error: Checkpoints and forks are taken in single-hart normal mode only\n");
+        return 1;
+    }
+
+    if (!batch.empty()) {
+        if (nharts > 1 || opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool) {
+            fprintf(stderr, "Error: Batch mode runs single-hart programs only\n");
+            return 1;
+        }
+        BatchConfig config;
+        config.engine = engine;
+        config.backend = backend;
+        config.load_addr = load_addr;
+        config.max_instrs = opt_args["max_instrs"].value.as_int;
+        config.jobs = opt_args["jobs"].value.as_int;
+        if (config.jobs == 0) {
+            config.jobs = std::max(1u, std::thread::hardware_concurrency());
+        }
+        try {
+            return run_batch(batch, config, opt_args["batch_report"].value.as_str);
+        } catch (const std::exception& e) {
+            std::cerr << "Exception: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    bool timing = opt_args["timing"].value.as_bool;
+    PipelineConfig timing_config;
+    try {
+        timing_config.parse(opt_args["timing_config"].value.as_str);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    bool caches = opt_args["cache"].value.as_bool;
+    int cache_misses = opt_args["cache_misses"].value.as_int;
+    CacheHierarchyConfig cache_config;
+    try {
+        std::string settings = opt_args["cache_config"].value.as_str;
+        if (!settings.empty() && settings[0] == '@') {
+            cache_config.parse_file(settings.substr(1));
+        } else {
+            cache_config.parse(settings);
+        }
+        cache_config.attribute = cache_misses > 0;
+        if (caches) {
+            CacheHierarchy check(cache_config); // Report a bad geometry before loading anything
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    std::string bpred = opt_args["bpred"].value.as_str;
+    int bpred_misses = opt_args["bpred_misses"].value.as_int;
+    BranchPredictorConfig bpred_config;
+    try {
+        bpred_config.parse(opt_args["bpred_config"].value.as_str);
+        bpred_config.kind = bpred;
+        bpred_config.attribute = bpred_misses > 0;
+        if (!bpred.empty()) {
+            BranchPredictor check(bpred_config); // Report an unknown predictor before loading anything
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    SamplingConfig sampling;
+    sampling.period = opt_args["sample_period"].value.as_int;
+    sampling.warmup = opt_args["sample_warmup"].value.as_int;
+    sampling.window = opt_args["sample_window"].value.as_int;
+    std::string bbv_path = opt_args["bbv"].value.as_str;
+    uint64_t bbv_interval = opt_args["bbv_interval"].value.as_int;
+    if (sampling.period || !bbv_path.empty()) {
+        if (nharts > 1 || stop_at_marker || opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool) {
+            fprintf(stderr, "Error: Sampling and basic block vectors are for single-hart normal runs\n");
+            return 1;
+        }
+    }
+    if (sampling.period) {
+        if (!timing) {
+            fprintf(stderr, "Error: Sampling estimates CPI with the timing model: add --timing\n");
+            return 1;
+        }
+        if (sampling.window == 0 || sampling.period <= sampling.warmup + sampling.window) {
+            fprintf(stderr, "Error: The sample period must exceed the warm-up and measurement windows\n");
+            return 1;
+        }
+    }
+    if (!bbv_path.empty() && (engine == ENGINE_INTERP || bbv_interval == 0)) {
+        fprintf(stderr, "Error: Basic block vectors need the block or jit engine and a nonzero interval\n");
+        return 1;
+    }
+
+    std::string gdb = opt_args["gdb"].value.as_str;
+    if (!gdb.empty() && (nharts > 1 || stop_at_marker || sampling.period || !bbv_path.empty() ||
+                         opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool)) {
+        fprintf(stderr, "Error: GDB debugs a single hart in normal mode\n");
+        return 1;
+    }
+
+    std::string watch = opt_args["watch"].value.as_str;
+    if (!watch.empty() && (nharts > 1 || nforks || sampling.period || !bbv_path.empty() ||
+                           opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool)) {
+        fprintf(stderr, "Error: Watchpoints are for single-hart normal runs and GDB\n");
+        return 1;
+    }
+
+    std::string record_path = opt_args["record"].value.as_str;
+    std::string replay_path = opt_args["replay"].value.as_str;
+    if (!record_path.empty() || !replay_path.empty()) {
+        if (!record_path.empty() && !replay_path.empty()) {
+            fprintf(stderr, "Error: Use either --record or --replay\n");
+            return 1;
+        }
+        if (stop_at_marker || !restore.empty() || sampling.period || !bbv_path.empty() ||
+            opt_args["debug"].value.as_bool || opt_args["diff"].value.as_bool) {
+            fprintf(stderr, "Error: Record and replay cover whole runs in normal mode\n");
+            return 1;
+        }
+        if (!record_path.empty() && !gdb.empty()) {
+            fprintf(stderr, "Error: GDB can debug a replay, not a recording\n");
+            return 1;
+        }
+    }
+
+    std::string trace_path = opt_args["trace"].value.as_str;
+    std::string profile_path = opt_args["profile"].value.as_str;
+    if ((!trace_path.empty() || !profile_path.empty()) && (nforks || sampling.period)) {
+        fprintf(stderr, "Error: Traces and profiles cannot be recorded across forks or in sampled runs\n");
+        return 1;
+    }
+
     int rc = 0;
+    int status = 0;
     try {
         // Construct memory object
-        Memory mem(DEFAULT_MEM_SIZE); 
+        Memory mem(backend);
 
-        // Create a core object
-        Core core(&mem);
+        // Attach devices
+        std::string disk_path = opt_args["disk"].value.as_str;
+        Platform platform(&mem, opt_args["console"].value.as_str, opt_args["console_flush"].value.as_int, disk_path);
 
-        // Load the program file into memory
-        if(pos_args.size() > 0) {
-            std::string hex_file = pos_args[0];
-            mem.load_hex(hex_file);
+        // Create one core per hart
+        std::vector<std::unique_ptr<Core>> harts;
+        for (int i = 0; i < nharts; ++i) {
+            harts.emplace_back(new Core(&mem, i));
+            harts[i]->setEngine(engine);
+            harts[i]->setBus(&platform.bus);
+            harts[i]->setClint(&platform.clint);
+            if (timing) {
+                harts[i]->enableTiming(timing_config);
+            }
+            if (caches) {
+                harts[i]->enableCaches(cache_config, i ? harts[0].get() : nullptr); // One L2 for all
+            }
+            if (!bpred.empty()) {
+                harts[i]->enableBranchPredictor(bpred_config);
+            }
+        }
+        Core &core = *harts[0];
+        std::vector<Core*> cores;
+        for (auto &hart : harts) {
+            cores.push_back(hart.get());
+        }
+
+        // Trace writer thread, fed by every hart
+        std::unique_ptr<TraceWriter> trace;
+        if (!trace_path.empty()) {
+            trace.reset(new TraceWriter(trace_path, nharts));
+            for (int i = 0; i < nharts; ++i) {
+                harts[i]->enableTrace(trace->buffer(i));
+            }
+        }
+
+        // Load the program file into memory; every hart starts at the entry point
+        SymbolTable symbols;
+        uint32_t entry = 0;
+        if (!restore.empty()) {
+            restore_checkpoint(restore, core, mem, platform.clint);
+            printf("Restored %s at %lu instructions\n", restore.c_str(), core.getInstret());
+        } else if(pos_args.size() > 0) {
+            entry = load_program(mem, pos_args[0], load_addr, &symbols);
+            for (auto &hart : harts) {
+                hart->reset(entry);
+            }
         } else {
             fprintf(stderr, "Error: No program file specified\n");
             return 1;
         }
+        if (!profile_path.empty()) {
+            core.enableProfiler(&symbols);
+        }
+        if (!watch.empty()) {
+            std::vector<watchpoint_t> watches = parse_watchpoints(watch, symbols);
+            for (const watchpoint_t &w : watches) {
+                core.addWatchpoint(w.address, w.len, w.kind);
+            }
+            printf("Watching %lu data ranges\n", watches.size());
+        }
+        uint64_t start_instret = core.getInstret(); // Nonzero after a restore
+
+        // Replay log, fed by every hart and the disk
+        std::unique_ptr<ReplayLog> replay_log;
+        if (!record_path.empty() || !replay_path.empty()) {
+            bool replaying = !replay_path.empty();
+            replay_log.reset(new ReplayLog(replaying ? replay_path : record_path, replaying, nharts,
+                                           replay_image(mem, entry), platform.disk ? REPLAY_HAS_DISK : 0));
+            for (auto &hart : harts) {
+                hart->setReplay(replay_log.get());
+            }
+            if (platform.disk) {
+                platform.disk->setReplay(replay_log.get());
+            }
+        }
+        platform.marker.arm(stop_at_marker);
+
+        // Reference interpreter for differential mode (console output discarded, own copy of the disk)
+        std::unique_ptr<Memory> ref_mem;
+        std::unique_ptr<Platform> ref_platform;
+        std::unique_ptr<Core> ref;
+        if (opt_args["diff"].value.as_bool) {
+            ref_mem.reset(new Memory());
+            ref_platform.reset(new Platform(ref_mem.get(), "none", 0, disk_path, true));
+            ref.reset(new Core(ref_mem.get()));
+            ref->setBus(&ref_platform->bus);
+            ref->setClint(&ref_platform->clint);
+            if (!restore.empty()) {
+                restore_checkpoint(restore, *ref, *ref_mem, ref_platform->clint);
+            } else {
+                load_program(*ref_mem, pos_args[0], load_addr, nullptr);
+                ref->reset(entry);
+            }
+        }
+
+        std::unique_ptr<BbvWriter> bbv;
+        if (!bbv_path.empty()) {
+            bbv.reset(new BbvWriter(bbv_path, bbv_interval, start_instret));
+        }
+        SamplingResult sampled;
 
         // Run the simulator
+        Core *stopped = &core; // Hart that ended the run
+        HostCounter host_counter;
+        auto t_start = std::chrono::steady_clock::now();
+        host_counter.start();
         if(opt_args["debug"].value.as_bool) {
             std::cout << "Debug mode enabled\n";
-            rc = interactive(core, mem, verbose);
+            rc = interactive(core, mem, platform.out, verbose);
+        }
+        else if (!gdb.empty()) {
+            std::unique_ptr<Replayer> replayer;
+            if (replay_log) {
+                printf("Replaying %s\n", replay_path.c_str());
+                replayer.reset(new Replayer(cores, &mem, &platform.bus, &platform.out, *replay_log, REPLAY_SNAPSHOT_INTERVAL));
+            }
+            GdbStub stub(core, mem, platform, gdb, replayer.get());
+            rc = stub.serve();
+        }
+        else if (replay_log && replay_log->replaying()) {
+            printf("Replaying %s\n", replay_path.c_str());
+            Replayer replayer(cores, &mem, &platform.bus, nullptr, *replay_log, 0);
+            rc = replayer.run();
+            stopped = harts[replayer.getHart()].get();
+        }
+        else if(opt_args["diff"].value.as_bool) {
+            std::cout << "Running in differential mode\n";
+            rc = run_diff(core, mem, *ref, *ref_mem);
+        }
+        else if (nharts > 1) {
+            if (replay_log) {
+                quantum = quantum ? quantum : REPLAY_QUANTUM;
+                printf("Running %d harts (recorded in turns of %lu instructions)\n", nharts, quantum);
+            } else {
+                printf("Running %d harts (%s)\n", nharts, quantum ? "synchronized" : "free-running");
+            }
+            HartGroup group(cores, &platform.bus, quantum, replay_log.get());
+            rc = group.run();
+            stopped = harts[group.getStoppedHart()].get();
+        }
+        else if (sampling.period || bbv) {
+            if (sampling.period) {
+                printf("Running in sampled mode (%lu of every %lu instructions measured)\n", sampling.window, sampling.period);
+                rc = run_sampled(core, sampling, bbv.get(), sampled);
+            } else {
+                std::cout << "Running in normal mode\n";
+                rc = run_functional(core, 0, bbv.get());
+            }
+            if (bbv) {
+                bbv->finish(core);
+                printf("Basic block vectors written to %s (%lu blocks)\n", bbv_path.c_str(), bbv->blocks());
+            }
         }
         else {
             std::cout << "Running in normal mode\n";
-            while(rc == 0) {
-                rc = core.tick(); // Simulate a clock tick
+            while ((rc = run_until(core, stop_at)) == RC_WATCH) {
+                platform.out.flush();
+                print_watch_hit(core, symbols);
+            }
+        }
+
+        uint64_t host_instrs = host_counter.stop();
+        auto t_end = std::chrono::steady_clock::now();
+        platform.out.flush();
+        if (trace) {
+            trace->finish();
+            printf("Trace written to %s (%lu instructions, %.2f bytes each)\n", trace_path.c_str(),
+                   trace->getRecords(), trace->getRecords() ? (double)trace->getBytes() / trace->getRecords() : 0.0);
+        }
+        if (replay_log && !replay_log->replaying()) {
+            replay_log->finish(rc, cores);
+            printf("Replay log written to %s (%lu events, %lu bytes)\n", record_path.c_str(), replay_log->getEvents(),
+                   replay_log->getBytes());
+        }
+
+        // Stopped at the checkpoint or fork instruction count, or at the guest marker?
+        bool at_stop = stop_at_marker && (rc == 0 || (rc == RC_EXIT && !platform.bus.exit_requested));
+        if (nforks) {
+            if (at_stop) {
+                printf("Forking %d children at %lu instructions\n", nforks, core.getInstret());
+                status = run_forks(core, platform, nforks);
+                rc = 0;
+            } else {
+                printf("No fork taken\n");
+            }
+        }
+        if (!checkpoint.empty()) {
+            if (at_stop) {
+                uint32_t pages = save_checkpoint(checkpoint, core, mem, platform.clint);
+                printf("Checkpoint written to %s at %lu instructions (%u pages)\n", checkpoint.c_str(), core.getInstret(), pages);
+                rc = 0;
+            } else {
+                printf("No checkpoint taken\n");
             }
         }
 
@@ -106,18 +830,127 @@ int main(int argc, char** argv) {
         switch(rc) {
             case 0:
                 break;
-            case -1:
-                printf("EBREAK encountered at PC: 0x%08x\n", core.getPC()); // Print the program counter
+            case RC_EBREAK:
+                if (nharts > 1) {
+                    printf("EBREAK encountered at PC: 0x%08x on hart %u\n", stopped->getPC(), stopped->getHartId());
+                } else {
+                    printf("EBREAK encountered at PC: 0x%08x\n", stopped->getPC()); // Print the program counter
+                }
+                break;
+            case RC_EXIT:
+                printf("Program exited with code %d\n", platform.bus.exit_code);
+                status = platform.bus.exit_code;
+                break;
+            case RC_DIFF_MISMATCH:
+                printf("Program terminated: engine diverged from the interpreter\n");
+                status = 1;
                 break;
             default:
                 printf("Program terminated with unknown error\n");
+                status = 1;
                 break;
         }
+
+        // Report run statistics
+        RunStats st;
+        st.engine = engine_name;
+        st.instret = 0;
+        st.cycles = 0;
+        for (int c = 0; c < CLASS_COUNT; ++c) {
+            st.classes[c] = 0;
+        }
+        st.timing = timing;
+        st.sampled = sampling.period;
+        st.samples = sampling.period ? sampled.samples : 0;
+        st.cpi_ci95 = sampling.period ? sampled.ci95 : 0;
+        st.bpred = bpred;
+        st.branches = BranchStats{0, 0, 0, 0, 0, 0, 0, 0};
+        for (int i = 0; i < STALL_COUNT; ++i) {
+            st.stalls[i] = 0;
+        }
+        for (auto &hart : harts) {
+            uint64_t counts[CLASS_COUNT];
+            hart->getClassCounts(counts);
+            for (int c = 0; c < CLASS_COUNT; ++c) {
+                st.classes[c] += counts[c];
+            }
+            st.instret += hart->getInstret() - start_instret; // All harts, since the start or restore
+            st.cycles = std::max(st.cycles, hart->getCycles() - (timing ? 0 : start_instret)); // The slowest hart
+            if (timing) {
+                uint64_t stalls[STALL_COUNT];
+                hart->getTiming()->getStalls(stalls);
+                for (int i = 0; i < STALL_COUNT; ++i) {
+                    st.stalls[i] += stalls[i];
+                }
+            }
+            if (caches) {
+                std::vector<const Cache*> levels = hart->getCaches()->levels();
+                st.caches.resize(levels.size(), CacheStats{"", 0, 0, 0, 0, 0, 0});
+                for (size_t i = 0; i < levels.size(); ++i) {
+                    if (hart != harts[0] && levels[i] == core.getCaches()->levels()[i]) {
+                        continue; // The shared L2, counted with hart 0
+                    }
+                    const CacheStats &c = levels[i]->getStats();
+                    st.caches[i].name = c.name;
+                    st.caches[i].reads += c.reads;
+                    st.caches[i].writes += c.writes;
+                    st.caches[i].read_misses += c.read_misses;
+                    st.caches[i].write_misses += c.write_misses;
+                    st.caches[i].evictions += c.evictions;
+                    st.caches[i].writebacks += c.writebacks;
+                }
+            }
+            if (!bpred.empty()) {
+                const BranchStats &b = hart->getBranchPredictor()->getStats();
+                st.branches.cond += b.cond;
+                st.branches.cond_misses += b.cond_misses;
+                st.branches.jumps += b.jumps;
+                st.branches.indirect += b.indirect;
+                st.branches.indirect_misses += b.indirect_misses;
+                st.branches.returns += b.returns;
+                st.branches.return_misses += b.return_misses;
+                st.branches.late += b.late;
+            }
+            if (nharts > 1) {
+                printf("Hart %u: %lu instructions\n", hart->getHartId(), hart->getInstret());
+            }
+        }
+        st.modelled = st.instret;
+        if (sampling.period) {
+            st.modelled = sampled.detailed;
+            st.cycles = llround(sampled.cpi * st.instret); // Extrapolated from the samples
+        }
+        st.wall_s = std::chrono::duration<double>(t_end - t_start).count();
+        st.host_instrs = host_instrs;
+        st.peak_rss_kb = peak_rss_kb();
+        print_stats(st, stdout);
+        if (caches && cache_misses > 0) {
+            print_cache_misses(core, symbols, cache_misses);
+        }
+        if (!bpred.empty() && bpred_misses > 0) {
+            print_branch_misses(core, symbols, bpred_misses);
+        }
+        if (!profile_path.empty()) {
+            print_profile(core, symbols, opt_args["profile_top"].value.as_int, timing);
+            FILE *f = fopen(profile_path.c_str(), "w");
+            if (!f) {
+                fprintf(stderr, "Error: Could not write profile: %s\n", profile_path.c_str());
+            } else {
+                core.getProfiler()->write_folded(f, symbols, timing);
+                fclose(f);
+                printf("Call stacks written to %s (%s)\n", profile_path.c_str(), timing ? "cycles" : "instructions");
+            }
+        }
+        std::string stats_json = opt_args["stats_json"].value.as_str;
+        if (!stats_json.empty() && !write_stats_json(st, stats_json)) {
+            fprintf(stderr, "Error: Could not write stats file: %s\n", stats_json.c_str());
+        }
         printf("Exiting...\n");
 
     }
     catch (const std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
+        status = 1;
     }
-    return 0;
+    return status; // Guest exit status when stopped through the test finisher
 }   
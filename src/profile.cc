@@ -0,0 +1,145 @@
+#include "profile.h"
+#include <algorithm>
+
+// Function symbol covering addr, or nullptr
+static const Symbol *function_at(const SymbolTable &symbols, xlen_t addr) {
+    const Symbol *sym = symbols.lookup_func(addr);
+    return (sym && (sym->size == 0 || addr - sym->addr < sym->size)) ? sym : nullptr;
+}
+
+// Name of the function entered at addr, or the address if there is no symbol for it
+static std::string function_name(const SymbolTable &symbols, xlen_t addr) {
+    const Symbol *sym = function_at(symbols, addr);
+    if (sym) {
+        return sym->name;
+    }
+    char hex[16];
+    snprintf(hex, sizeof(hex), "0x%08x", addr);
+    return hex;
+}
+
+Profiler::Profiler(const SymbolTable *symbols, xlen_t pc, uint64_t instret, uint64_t cycles) :
+    symbols(symbols), entries(PROFILE_ENTRY_CACHE, {PROFILE_NO_FUNC, 0}),
+    links(PROFILE_LINK_CACHE, FrameLink{PROFILE_NO_NODE, PROFILE_NO_FUNC, 0}), node(PROFILE_NO_NODE), lost(0),
+    last_cycles(cycles), charged(instret) {
+    // Start the bottom frame
+    xlen_t func = entry_of(pc);
+    node = frame(PROFILE_NO_NODE, func == PROFILE_NO_FUNC ? pc : func);
+}
+
+xlen_t Profiler::entry_of(xlen_t pc) {
+    std::pair<xlen_t, xlen_t> &e = entries[(pc >> 2) & (PROFILE_ENTRY_CACHE - 1)];
+    if (e.first != pc) {
+        const Symbol *sym = function_at(*symbols, pc);
+        e = {pc, sym ? sym->addr : PROFILE_NO_FUNC};
+    }
+    return e.second;
+}
+
+uint32_t Profiler::new_frame(uint32_t parent, xlen_t func) {
+    auto it = children.emplace((uint64_t)parent << 32 | func, nodes.size()).first;
+    if (it->second == nodes.size()) {
+        uint32_t depth = (parent == PROFILE_NO_NODE) ? 0 : nodes[parent].depth + 1;
+        nodes.push_back(Node{func, parent, depth, 0, 0});
+    }
+    return it->second;
+}
+
+void Profiler::transfer(const uop_t &u, xlen_t pc_next) {
+    // Return-address stack hints of the RISC-V calling convention. A return must go back to
+    // a call site on the stack (several frames down after a longjmp); otherwise it is a jump.
+    bool push = (u.rd == 1 || u.rd == 5);
+    bool pop = u.op == OP_JALR && (u.rs1 == 1 || u.rs1 == 5) && !(push && u.rd == u.rs1);
+    if (pop) {
+        size_t depth = returns.size();
+        while (depth > 0 && returns[depth - 1] != pc_next) {
+            depth--;
+        }
+        pop = depth > 0;
+        while (pop && returns.size() >= depth) {
+            returns.pop_back();
+            if (lost) {
+                lost--;
+            } else {
+                node = nodes[node].parent;
+            }
+        }
+    }
+    xlen_t func = entry_of(pc_next);
+    if (push) {
+        returns.push_back(u.pc + 4);
+        if (nodes[node].depth + 1 >= PROFILE_MAX_DEPTH) {
+            lost++;
+        } else {
+            node = frame(node, func == PROFILE_NO_FUNC ? pc_next : func);
+        }
+    } else if (!pop && func != PROFILE_NO_FUNC && func != nodes[node].func && !lost) {
+        node = frame(nodes[node].parent, func); // Tail call
+    }
+}
+
+std::vector<std::string> Profiler::node_names(const SymbolTable &symbols) const {
+    std::vector<std::string> names(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        names[i] = function_name(symbols, nodes[i].func);
+    }
+    return names;
+}
+
+void Profiler::write_folded(FILE *f, const SymbolTable &symbols, bool cycles) const {
+    std::vector<std::string> names = node_names(symbols);
+    std::vector<uint32_t> path;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        uint64_t weight = nodes[i].instrs + (cycles ? nodes[i].stalls : 0);
+        if (!weight) {
+            continue;
+        }
+        path.clear();
+        for (uint32_t n = i; n != PROFILE_NO_NODE; n = nodes[n].parent) {
+            path.push_back(n);
+        }
+        for (size_t j = path.size(); j-- > 0; ) {
+            fprintf(f, "%s%c", names[path[j]].c_str(), j ? ';' : ' ');
+        }
+        fprintf(f, "%lu\n", weight);
+    }
+}
+
+std::vector<FunctionProfile> Profiler::functions(const SymbolTable &symbols) const {
+    std::vector<FunctionProfile> funcs;
+    std::unordered_map<std::string, size_t> index;
+    auto entry = [&](const std::string &name) -> size_t {
+        auto it = index.emplace(name, funcs.size()).first;
+        if (it->second == funcs.size()) {
+            funcs.push_back(FunctionProfile{name, 0, 0, 0});
+        }
+        return it->second;
+    };
+
+    // Self counts from the frames, inclusive counts once per function on each stack (recursion)
+    std::vector<std::string> names = node_names(symbols);
+    std::vector<size_t> on_stack;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!nodes[i].instrs) {
+            continue;
+        }
+        FunctionProfile &self = funcs[entry(names[i])];
+        self.self_instrs += nodes[i].instrs;
+        self.self_cycles += nodes[i].instrs + nodes[i].stalls;
+        on_stack.clear();
+        for (uint32_t n = i; n != PROFILE_NO_NODE; n = nodes[n].parent) {
+            size_t f = entry(names[n]);
+            if (std::find(on_stack.begin(), on_stack.end(), f) == on_stack.end()) {
+                on_stack.push_back(f);
+            }
+        }
+        for (size_t f : on_stack) {
+            funcs[f].total_instrs += nodes[i].instrs;
+        }
+    }
+
+    std::sort(funcs.begin(), funcs.end(), [](const FunctionProfile &a, const FunctionProfile &b) {
+        return a.self_instrs != b.self_instrs ? a.self_instrs > b.self_instrs : a.name < b.name;
+    });
+    return funcs;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "decode.h"
+#include "symtab.h"
+
+// Call depth tracked; deeper calls are charged to the deepest frame
+#define PROFILE_MAX_DEPTH 256
+
+// Entries of the cache of call tree edges (must be a power of 2)
+#define PROFILE_LINK_CACHE 1024
+
+// Parent of a bottom frame
+#define PROFILE_NO_NODE 0xffffffffu
+
+// Function entry of code without a function symbol (pcs are never odd)
+#define PROFILE_NO_FUNC 1
+
+// Instructions and cycles of one function
+struct FunctionProfile {
+    std::string name;
+    uint64_t self_instrs;       // Retired in the function itself
+    uint64_t self_cycles;
+    uint64_t total_instrs;      // Retired while the function was on the call stack
+};
+
+// Entries of the cache of the functions containing jump targets (must be a power of 2)
+#define PROFILE_ENTRY_CACHE 1024
+
+// Guest profiler: counts retired instructions, and cycles when the timing model runs, by
+// call stack. Stacks are rebuilt from the calling convention: JAL or JALR writing
+// ra or t0 is a call, JALR to x0 through ra or t0 a return; other jumps into another
+// function are tail calls, replacing the current frame. Traps stay in the frame they leave.
+// Translated blocks are charged to the current frame at their calls and returns.
+class Profiler {
+    private:
+        // Call tree node: a function reached through the path of its parents
+        struct Node {
+            xlen_t func;            // Entry address
+            uint32_t parent;
+            uint32_t depth;
+            uint64_t instrs;        // Retired with exactly this stack
+            uint64_t stalls;        // Cycles beyond one per instruction
+        };
+
+        // Recently followed calls and tail calls
+        struct FrameLink {
+            uint32_t parent;
+            xlen_t func;
+            uint32_t node;
+        };
+
+        const SymbolTable *symbols;
+        std::vector<std::pair<xlen_t, xlen_t>> entries;     // Jump target -> function entry
+        std::vector<Node> nodes;
+        std::unordered_map<uint64_t, uint32_t> children;    // parent << 32 | func -> node
+        std::vector<FrameLink> links;                   // Cache of children, direct-mapped
+        uint32_t node;                                  // Current frame
+        std::vector<xlen_t> returns;                    // Return address of each call on the stack
+        uint32_t lost;                                  // Calls past PROFILE_MAX_DEPTH not yet returned
+        uint64_t last_cycles;
+        uint64_t charged;                               // Retired instructions charged to frames
+
+        // Entry address of the function containing pc, or PROFILE_NO_FUNC
+        xlen_t entry_of(xlen_t pc);
+
+        // Frame of func called from parent (PROFILE_NO_NODE: bottom frame)
+        uint32_t frame(uint32_t parent, xlen_t func) {
+            FrameLink &l = links[(parent * 0x9e3779b1u ^ (func >> 2)) & (PROFILE_LINK_CACHE - 1)];
+            if (l.parent != parent || l.func != func) {
+                l = FrameLink{parent, func, new_frame(parent, func)};
+            }
+            return l.node;
+        }
+
+        // Find or add the call tree node of func called from parent
+        uint32_t new_frame(uint32_t parent, xlen_t func);
+
+        // Follow a JAL or JALR to pc_next
+        void transfer(const uop_t &u, xlen_t pc_next);
+
+        // Function name of each call tree node
+        std::vector<std::string> node_names(const SymbolTable &symbols) const;
+
+    public:
+        // Functions are looked up in symbols as the program runs; counting starts at pc,
+        // after instret instructions and cycles simulated cycles
+        Profiler(const SymbolTable *symbols, xlen_t pc, uint64_t instret, uint64_t cycles);
+
+        // Charge the instructions retired up to instret that are not in a frame yet (those of
+        // translated blocks since their last call or return) to the current one, one cycle each
+        // (restoring a snapshot can move instret back)
+        void charge(uint64_t instret) {
+            uint64_t n = (instret > charged) ? instret - charged : 0;
+            charged = instret;
+            nodes[node].instrs += n;
+            last_cycles += n;
+        }
+
+        // Count a retired instruction; instret and cycles are the counts after it
+        void retire(const uop_t &u, xlen_t pc_next, uint64_t instret, uint64_t cycles) {
+            charge(instret - 1);
+            charged = instret;
+            uint64_t stalls = cycles - last_cycles - 1;
+            last_cycles = cycles;
+            nodes[node].instrs++;
+            nodes[node].stalls += stalls;
+            if (u.op == OP_JAL || u.op == OP_JALR) {
+                transfer(u, pc_next);
+            }
+        }
+
+        // Follow a translated block whose n retired instructions went on to pc_next, if it
+        // ended in a jump; instret is the count after them
+        void retire_block(const uop_t *uops, uint32_t n, xlen_t pc_next, uint64_t instret) {
+            if (n && (uops[n - 1].op == OP_JAL || uops[n - 1].op == OP_JALR)) {
+                charge(instret);
+                transfer(uops[n - 1], pc_next);
+            }
+        }
+
+        // Write the call stacks in folded form ("f;g;h count" per line, for flamegraph tools),
+        // weighted by cycles or instructions
+        void write_folded(FILE *f, const SymbolTable &symbols, bool cycles) const;
+
+        // Counts by function, most self instructions first; self counts go to the function of
+        // the frame that retired them, like the totals, so local labels inside it get none
+        std::vector<FunctionProfile> functions(const SymbolTable &symbols) const;
+};
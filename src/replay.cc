@@ -0,0 +1,622 @@
+#include "replay.h"
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+// Buffered events written out at once when recording
+#define REPLAY_WRITE_BATCH (64u << 10)
+
+// Names of the event types, for messages
+static const char *const event_names[] = {
+    "a device read", "a CSR read", "a disk command", "an interrupt", "a turn", "the end of the run", "repeated reads"
+};
+
+ReplayLog::ReplayLog(const std::string &path, bool replay, unsigned nharts, uint64_t image, uint32_t flags) :
+    path(path), replay(replay), f(nullptr), nharts(nharts), cur{0, 0, 0, 0, REPLAY_READ, 0, 0}, peeked(false), control_pos(0),
+    control_cur{0, 0, 0, 0, REPLAY_READ, 0, 0}, repeatable(false), events(0), bytes(0), failed(false) {
+    replay_header_t expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, REPLAY_MAGIC, sizeof(expected.magic));
+    expected.version = REPLAY_VERSION;
+    expected.nharts = nharts;
+    expected.image = image;
+    expected.flags = flags;
+
+    if (!replay) {
+        f = fopen(path.c_str(), "wb");
+        if (!f) {
+            throw std::runtime_error("Could not open replay log: " + path);
+        }
+        failed = fwrite(&expected, sizeof(expected), 1, f) != 1;
+        bytes = sizeof(expected);
+        return;
+    }
+
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) {
+        throw std::runtime_error("Could not open replay log: " + path);
+    }
+    std::unique_ptr<FILE, int (*)(FILE*)> guard(in, fclose);
+    replay_header_t header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) ||
+        header.version != REPLAY_VERSION) {
+        throw std::runtime_error("Not a replay log (or from another version): " + path);
+    }
+    if (header.nharts != nharts) {
+        throw std::runtime_error("The replay log was recorded with " + std::to_string(header.nharts) +
+                                 " harts: pass --harts " + std::to_string(header.nharts));
+    }
+    if (header.image != image) {
+        throw std::runtime_error("The replay log was recorded for another program: " + path);
+    }
+    if (header.flags != flags) {
+        throw std::runtime_error((header.flags & REPLAY_HAS_DISK) ? "The replay log was recorded with a disk: pass --disk"
+                                                                  : "The replay log was recorded without a disk");
+    }
+    uint8_t buf[REPLAY_WRITE_BATCH];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    bytes = sizeof(header) + data.size();
+}
+
+ReplayLog::~ReplayLog() {
+    if (f) {
+        put_repeats();
+        write_out(true);
+        fclose(f);
+    }
+}
+
+void ReplayLog::put_event(int type, unsigned hart) {
+    put_repeats();
+    data.push_back(type | hart << 3);
+    events++;
+    repeatable = false;
+}
+
+void ReplayLog::put_repeats() {
+    if (cur.repeats) {
+        data.push_back(REPLAY_REPEAT | cur.hart << 3);
+        put_varint(cur.repeats);
+        cur.repeats = 0;
+    }
+}
+
+void ReplayLog::put_varint(uint64_t value) {
+    while (value >= 0x80) {
+        data.push_back(value | 0x80);
+        value >>= 7;
+    }
+    data.push_back(value);
+}
+
+// Signed differences as small unsigned numbers: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+void ReplayLog::put_delta(uint32_t from, uint32_t to) {
+    int32_t delta = to - from;
+    put_varint(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+}
+
+void ReplayLog::write_out(bool all) {
+    if (data.size() < REPLAY_WRITE_BATCH && !all) {
+        return;
+    }
+    failed |= fwrite(data.data(), 1, data.size(), f) != data.size();
+    bytes += data.size();
+    data.clear();
+}
+
+uint8_t ReplayLog::get_byte(replay_cursor_t &c) const {
+    if (c.pos >= data.size()) {
+        throw std::runtime_error("Truncated replay log: " + path);
+    }
+    return data[c.pos++];
+}
+
+uint64_t ReplayLog::get_varint(replay_cursor_t &c) const {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = get_byte(c);
+        value |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Corrupt replay log: " + path);
+}
+
+uint32_t ReplayLog::get_delta(replay_cursor_t &c, uint32_t from) const {
+    uint32_t v = get_varint(c);
+    return from + ((v >> 1) ^ -(v & 1));
+}
+
+bool ReplayLog::take_input(int type, unsigned hart) {
+    if (cur.pos == data.size() || data[cur.pos] != (type | hart << 3)) {
+        return false;
+    }
+    cur.pos++;
+    return true;
+}
+
+bool ReplayLog::take_repeat(int type, unsigned hart) {
+    if (!cur.repeats && take_input(REPLAY_REPEAT, cur.hart)) {
+        cur.repeats = get_varint(cur);
+    }
+    if (!cur.repeats) {
+        return false;
+    }
+    if (type != cur.last || hart != cur.hart) {
+        diverged("hart " + std::to_string(hart) + " read " + (type == REPLAY_READ ? "a device register" : "a CSR") +
+                 " instead of hart " + std::to_string(cur.hart) + " repeating " + event_names[cur.last]);
+    }
+    cur.repeats--;
+    return true;
+}
+
+std::string ReplayLog::describe() const {
+    if (cur.pos == data.size()) {
+        return "the log ends";
+    }
+    int type = data[cur.pos] & 7;
+    if (type > REPLAY_REPEAT) {
+        return "the log is corrupt";
+    }
+    return std::string("the log has ") + event_names[type] + " of hart " + std::to_string(data[cur.pos] >> 3);
+}
+
+void ReplayLog::diverged(const std::string &what) const {
+    throw std::runtime_error("Replay diverged from " + path + " at byte " + std::to_string(sizeof(replay_header_t) + cur.pos) +
+                             ": " + what);
+}
+
+void ReplayLog::log_read(unsigned hart, uint32_t address, uint32_t value) {
+    if (repeatable && cur.last == REPLAY_READ && hart == cur.hart && address == cur.address && value == cur.value) {
+        cur.repeats++; // Polling: written as a count before the next event
+        events++;
+        return;
+    }
+    put_event(REPLAY_READ, hart);
+    put_delta(cur.address, address);
+    put_varint(value);
+    cur.address = address;
+    cur.value = value;
+    cur.hart = hart;
+    cur.last = REPLAY_READ;
+    repeatable = true;
+    write_out(false);
+}
+
+uint32_t ReplayLog::replay_read(unsigned hart, uint32_t address) {
+    char what[96];
+    if (take_repeat(REPLAY_READ, hart)) {
+        if (address != cur.address) {
+            snprintf(what, sizeof(what), "hart %u read device register 0x%08x instead of repeating 0x%08x",
+                     hart, address, cur.address);
+            diverged(what);
+        }
+        return cur.value;
+    }
+    if (!take_input(REPLAY_READ, hart)) {
+        snprintf(what, sizeof(what), "hart %u read device register 0x%08x, but ", hart, address);
+        diverged(what + describe());
+    }
+    uint32_t logged = get_delta(cur, cur.address);
+    cur.value = get_varint(cur);
+    cur.address = logged;
+    cur.hart = hart;
+    cur.last = REPLAY_READ;
+    if (logged != address) {
+        snprintf(what, sizeof(what), "hart %u read device register 0x%08x instead of 0x%08x", hart, address, logged);
+        diverged(what);
+    }
+    return cur.value;
+}
+
+uint32_t ReplayLog::csr(unsigned hart, uint32_t value) {
+    if (!replay) {
+        if (repeatable && cur.last == REPLAY_CSR && hart == cur.hart && value == cur.csr) {
+            cur.repeats++; // Polling the time
+            events++;
+            return value;
+        }
+        put_event(REPLAY_CSR, hart);
+        put_delta(cur.csr, value);
+        cur.csr = value;
+        cur.hart = hart;
+        cur.last = REPLAY_CSR;
+        repeatable = true;
+        write_out(false);
+        return value;
+    }
+    if (take_repeat(REPLAY_CSR, hart)) {
+        return cur.csr;
+    }
+    if (!take_input(REPLAY_CSR, hart)) {
+        diverged("hart " + std::to_string(hart) + " read a time or interrupt CSR, but " + describe());
+    }
+    cur.csr = get_delta(cur, cur.csr);
+    cur.hart = hart;
+    cur.last = REPLAY_CSR;
+    return cur.csr;
+}
+
+void ReplayLog::log_disk(Memory &mem, uint32_t address, uint32_t sectors) {
+    put_event(REPLAY_DISK, 0);
+    put_varint(address);
+    put_varint(sectors);
+    size_t at = data.size();
+    data.resize(at + (size_t)sectors * BLKDEV_SECTOR);
+    mem.read_bytes(address, data.data() + at, (size_t)sectors * BLKDEV_SECTOR);
+    write_out(false);
+}
+
+uint32_t ReplayLog::replay_disk(Memory &mem) {
+    if (!take_input(REPLAY_DISK, 0)) {
+        diverged("the block device ran a command, but " + describe());
+    }
+    uint32_t address = get_varint(cur);
+    uint32_t sectors = get_varint(cur);
+    size_t size = (size_t)sectors * BLKDEV_SECTOR;
+    if (size > data.size() - cur.pos) {
+        throw std::runtime_error("Truncated replay log: " + path);
+    }
+    mem.write_bytes(address, data.data() + cur.pos, size);
+    cur.pos += size;
+    return sectors;
+}
+
+void ReplayLog::log_interrupt(unsigned hart, uint64_t instret, uint32_t irq) {
+    put_event(REPLAY_IRQ, hart);
+    put_varint(instret);
+    put_varint(irq);
+    write_out(false);
+}
+
+void ReplayLog::log_slice(unsigned hart, uint64_t instret) {
+    put_event(REPLAY_SLICE, hart);
+    put_varint(instret);
+    write_out(false);
+}
+
+void ReplayLog::finish(int rc, const std::vector<Core*> &harts) {
+    put_event(REPLAY_END, 0);
+    put_delta(0, rc);
+    for (const Core *core : harts) {
+        put_varint(core->getInstret());
+    }
+    write_out(true);
+    failed |= fclose(f) != 0;
+    f = nullptr;
+    if (failed) {
+        throw std::runtime_error("Could not write replay log: " + path);
+    }
+}
+
+const replay_control_t &ReplayLog::next_control() {
+    if (peeked) {
+        return control;
+    }
+    // Skip the inputs up to the next control event
+    replay_cursor_t c = cur;
+    while (c.pos < data.size()) {
+        int type = data[c.pos] & 7;
+        if (type == REPLAY_READ) {
+            c.pos++;
+            c.address = get_delta(c, c.address);
+            get_varint(c);
+        } else if (type == REPLAY_REPEAT) {
+            c.pos++;
+            get_varint(c);
+        } else if (type == REPLAY_CSR) {
+            c.pos++;
+            c.csr = get_delta(c, c.csr);
+        } else if (type == REPLAY_DISK) {
+            c.pos++;
+            get_varint(c);
+            size_t size = (size_t)get_varint(c) * BLKDEV_SECTOR;
+            if (size > data.size() - c.pos) {
+                throw std::runtime_error("Truncated replay log: " + path);
+            }
+            c.pos += size;
+        } else {
+            break;
+        }
+    }
+
+    control_pos = c.pos;
+    control.instrets.clear();
+    control.complete = c.pos < data.size();
+    if (!control.complete) {
+        control.type = REPLAY_END; // The recording stopped short: run on to wherever the guest stops
+        control.rc = 0;
+    } else {
+        uint8_t b = get_byte(c);
+        control.type = b & 7;
+        control.hart = b >> 3;
+        if (control.type == REPLAY_IRQ) {
+            control.instret = get_varint(c);
+            control.irq = get_varint(c);
+        } else if (control.type == REPLAY_SLICE) {
+            control.instret = get_varint(c);
+        } else if (control.type == REPLAY_END) {
+            control.rc = get_delta(c, 0);
+            for (unsigned i = 0; i < nharts; ++i) {
+                control.instrets.push_back(get_varint(c));
+            }
+        } else {
+            throw std::runtime_error("Corrupt replay log: " + path);
+        }
+    }
+    control_cur = c;
+    peeked = true;
+    return control;
+}
+
+void ReplayLog::take_control() {
+    next_control();
+    if (cur.pos != control_pos || cur.repeats) {
+        diverged(std::string("the guest skipped inputs before ") + event_names[control.type] + ": " + describe());
+    }
+    cur = control_cur;
+    peeked = false;
+}
+
+uint64_t replay_image(Memory &mem, xlen_t entry) {
+    // FNV-1a over the entry point and the address and contents of every nonzero page
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&](const void *p, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            h = (h ^ ((const uint8_t*)p)[i]) * 1099511628211ull;
+        }
+    };
+    mix(&entry, sizeof(entry));
+    std::vector<uint8_t> page(PAGE_SIZE);
+    for (uint32_t address : mem.touched_pages()) {
+        mem.read_bytes(address, page.data(), PAGE_SIZE);
+        if (std::all_of(page.begin(), page.end(), [](uint8_t b) { return b == 0; })) {
+            continue;
+        }
+        mix(&address, sizeof(address));
+        mix(page.data(), PAGE_SIZE);
+    }
+    return h;
+}
+
+int run_exact(Core &core, uint64_t instret) {
+    int rc = 0;
+    while (rc == 0 && core.getInstret() + BLOCK_MAX_LEN < instret) {
+        rc = core.run(std::min<uint64_t>(REPLAY_SLICE_INSTRS, instret - BLOCK_MAX_LEN - core.getInstret()));
+    }
+    // Engines may retire a whole block past their budget: single-step the rest
+    while (rc == 0 && core.getInstret() < instret) {
+        rc = core.tick();
+    }
+    return rc;
+}
+
+Replayer::Replayer(const std::vector<Core*> &harts, Memory *mem, DeviceBus *bus, Console *console,
+                   ReplayLog &log, uint64_t interval) :
+    harts(harts), mem(mem), bus(bus), console(console), log(log), hart(0), ended(false), end_rc(0),
+    interval(harts.size() == 1 ? interval : 0), shown(harts[0]->getInstret()) {
+    // A single hart runs until its events; several start with the first logged turn
+    turn_end = (harts.size() == 1) ? UINT64_MAX : harts[0]->getInstret();
+    for (size_t i = 0; i < harts.size(); ++i) {
+        harts[i]->setTimekeeper(i == 0);
+    }
+    if (this->interval) {
+        snapshot();
+    }
+}
+
+void Replayer::snapshot() {
+    ReplaySnapshot s;
+    harts[0]->getState(s.core);
+    std::vector<uint8_t> page(PAGE_SIZE);
+    for (uint32_t address : mem->touched_pages()) {
+        mem->read_bytes(address, page.data(), PAGE_SIZE);
+        if (std::all_of(page.begin(), page.end(), [](uint8_t b) { return b == 0; })) {
+            continue;
+        }
+        s.pages.push_back(address);
+        s.data.insert(s.data.end(), page.begin(), page.end());
+    }
+    s.cursor = log.getCursor();
+    s.exited = bus->exit_requested;
+    s.exit_code = bus->exit_code;
+    snapshots.push_back(std::move(s));
+}
+
+void Replayer::restore(const ReplaySnapshot &s) {
+    for (uint32_t address : mem->touched_pages()) {
+        if (!std::binary_search(s.pages.begin(), s.pages.end(), address)) {
+            mem->write_bytes(address, nullptr, PAGE_SIZE);
+        }
+    }
+    for (size_t i = 0; i < s.pages.size(); ++i) {
+        mem->write_bytes(s.pages[i], s.data.data() + i * PAGE_SIZE, PAGE_SIZE);
+    }
+    harts[0]->setState(s.core); // Drops the decoded code and the TLBs
+    log.setCursor(s.cursor);
+    bus->exit_requested = s.exited;
+    bus->exit_code = s.exit_code;
+    ended = false;
+    end_rc = 0;
+}
+
+bool Replayer::debugger_stop(int rc) const {
+    const Core *core = harts[hart];
+    return rc == RC_WATCH || (rc == RC_EBREAK && core->isBreakpoint(core->getPC()));
+}
+
+int Replayer::run(uint64_t max_instrs) {
+    if (ended) {
+        return end_rc;
+    }
+    uint64_t limit = (max_instrs == UINT64_MAX) ? UINT64_MAX : harts[hart]->getInstret() + max_instrs;
+    char what[160];
+    while (true) {
+        const replay_control_t &c = log.next_control();
+        Core *core = harts[hart];
+        uint64_t now = core->getInstret();
+
+        // Events due now; an interrupt is taken before stopping there, so that each
+        // instruction count is a single point of the replay
+        if (c.type == REPLAY_IRQ && c.hart == hart && c.instret == now) {
+            core->interrupt(c.irq);
+            log.take_control();
+            continue;
+        }
+        if (interval && harts[0]->getInstret() >= snapshots.back().core.instret + interval) {
+            snapshot();
+        }
+        if (now == limit) {
+            return 0;
+        }
+        if (c.type == REPLAY_SLICE && now == turn_end) {
+            hart = c.hart;
+            turn_end = c.instret;
+            log.take_control();
+            continue;
+        }
+
+        // Run to the next one
+        uint64_t target = std::min(turn_end, limit);
+        if (c.type == REPLAY_IRQ) {
+            if (c.hart != hart || c.instret < now) {
+                snprintf(what, sizeof(what), "hart %zu is at %lu instructions, but the next interrupt is for hart %u at %lu",
+                         hart, now, c.hart, c.instret);
+                log.diverged(what);
+            }
+            target = std::min(target, c.instret);
+        }
+        if (now >= target) {
+            snprintf(what, sizeof(what), "hart %zu ended its turn at %lu instructions, but the log has %s",
+                     hart, now, c.type == REPLAY_END ? "the run ending in it" : "more for it");
+            log.diverged(what);
+        }
+        if (interval) {
+            target = std::min(target, snapshots.back().core.instret + interval);
+            if (now < shown) {
+                target = std::min(target, shown); // Output up to there was shown
+            }
+            if (console) {
+                console->setMuted(now < shown);
+            }
+        }
+
+        int rc = run_exact(*core, target);
+        shown = std::max(shown, harts[0]->getInstret());
+        if (rc != 0) {
+            if (debugger_stop(rc)) {
+                return rc;
+            }
+            const replay_control_t &e = log.next_control();
+            if (e.type != REPLAY_END) {
+                snprintf(what, sizeof(what), "hart %zu stopped (code %d) at %lu instructions, but the log goes on",
+                         hart, rc, core->getInstret());
+                log.diverged(what);
+            }
+            if (e.complete) {
+                for (size_t i = 0; i < harts.size(); ++i) {
+                    if (e.rc != rc || e.instrets[i] != harts[i]->getInstret()) {
+                        snprintf(what, sizeof(what), "hart %zu stopped (code %d) with hart %zu at %lu instructions, "
+                                 "where the recording stopped (code %d) at %lu", hart, rc, i, harts[i]->getInstret(),
+                                 e.rc, e.instrets[i]);
+                        log.diverged(what);
+                    }
+                }
+                log.take_control();
+            }
+            ended = true;
+            end_rc = rc;
+            return rc;
+        }
+    }
+}
+
+int Replayer::run_to(uint64_t instret) {
+    Core *core = harts[0];
+    int rc = 0;
+    xlen_t pc = core->getPC();
+    if (core->isBreakpoint(pc) && core->getInstret() < instret) {
+        core->setBreakpoint(pc, false);
+        rc = run(1);
+        core->setBreakpoint(pc, true);
+    }
+    if (rc == 0 && core->getInstret() < instret) {
+        rc = run(instret - core->getInstret());
+    }
+    return rc;
+}
+
+void Replayer::seek(uint64_t instret) {
+    Core *core = harts[0];
+    if (ended && instret >= core->getInstret()) {
+        return; // Nothing past the end; stay there, with the END event taken
+    }
+    if (instret < core->getInstret()) {
+        size_t i = snapshots.size() - 1;
+        while (i > 0 && snapshots[i].core.instret > instret) {
+            i--;
+        }
+        restore(snapshots[i]);
+    }
+    while (core->getInstret() < instret) {
+        int rc = run_to(instret);
+        if (rc != 0 && !debugger_stop(rc)) {
+            break; // The end of the log
+        }
+    }
+}
+
+bool Replayer::reverse_step() {
+    uint64_t now = harts[0]->getInstret();
+    if (now <= snapshots[0].core.instret) {
+        return false;
+    }
+    seek(now - 1);
+    return true;
+}
+
+int Replayer::reverse_continue() {
+    Core *core = harts[0];
+    uint64_t now = core->getInstret();
+    size_t i = snapshots.size();
+    while (i > 0 && snapshots[i - 1].core.instret >= now) {
+        i--;
+    }
+
+    // Search the stretches between snapshots, the latest first, for the last stop before now
+    while (i-- > 0) {
+        uint64_t to = (i + 1 < snapshots.size()) ? std::min(snapshots[i + 1].core.instret, now) : now;
+        restore(snapshots[i]);
+        uint64_t hit = 0;
+        int hit_rc = 0;
+        if (core->isBreakpoint(core->getPC())) {
+            hit = core->getInstret();
+            hit_rc = RC_EBREAK;
+        }
+        while (core->getInstret() < to) {
+            int rc = run_to(to);
+            if (!debugger_stop(rc)) {
+                break;
+            }
+            if (core->getInstret() < now) {
+                hit = core->getInstret();
+                hit_rc = rc;
+            }
+        }
+        if (hit_rc == RC_WATCH) {
+            seek(hit - 1); // Stop after the access again, to report it
+            return run_to(hit);
+        }
+        if (hit_rc == RC_EBREAK) {
+            seek(hit);
+            return RC_EBREAK;
+        }
+    }
+    seek(snapshots[0].core.instret);
+    return 0;
+}
@@ -0,0 +1,247 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "core.h"
+#include "memory.h"
+#include "device.h"
+
+// Replay log layout:
+//   replay_header_t
+//   events         in the order they happened (recorded harts run one at a time)
+// An event is a byte holding its type (REPLAY_*) in the low 3 bits and the hart in the
+// high 5, followed by:
+//   REPLAY_READ    address - previous read address, zigzag varint; value read, varint
+//   REPLAY_REPEAT  number of times the previous read (device or CSR) was repeated with the same
+//                  result, varint
+//   REPLAY_CSR     value - previous CSR value, zigzag varint
+//   REPLAY_DISK    guest address, varint; sectors read, varint; then the sector data
+//   REPLAY_IRQ     instructions retired by the hart, varint; interrupt number, varint
+//   REPLAY_SLICE   instructions the hart has retired at the end of its turn, varint
+//   REPLAY_END     return code, zigzag varint; then the instructions of every hart, varints
+// Inputs (READ, REPEAT, CSR, DISK) are taken in order as the guest asks for them; control events
+// (IRQ, SLICE, END) are due at an exact instruction count of their hart. Only the inputs
+// and the schedule are logged, never the instructions in between.
+#define REPLAY_MAGIC    "PLRSRPLY"
+#define REPLAY_VERSION  1
+
+struct replay_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t nharts;
+    uint64_t image;             // replay_image() of the program
+    uint32_t flags;             // REPLAY_HAS_*
+    uint32_t reserved;
+};
+
+// Header flags
+#define REPLAY_HAS_DISK 0x01    // Recorded with a block device
+
+// Event types
+#define REPLAY_READ     0       // Device register read
+#define REPLAY_CSR      1       // Read of a CSR fed by the devices (time, mip)
+#define REPLAY_DISK     2       // Block device command
+#define REPLAY_IRQ      3       // Interrupt taken
+#define REPLAY_SLICE    4       // Turn of a hart (multi-hart logs)
+#define REPLAY_END      5       // End of the run
+#define REPLAY_REPEAT   6       // Read repeated (a polling loop)
+
+// Instructions per turn when harts are recorded without a --quantum
+#define REPLAY_QUANTUM 10000
+
+// Instructions run between checks for the next event when nothing is due sooner
+#define REPLAY_SLICE_INSTRS 1000000
+
+// Instructions between the snapshots of a replay under a debugger
+#define REPLAY_SNAPSHOT_INTERVAL 10000000
+
+// Position in a log, with the decoder state there
+struct replay_cursor_t {
+    size_t pos;                 // Offset of the next event
+    uint32_t address;           // Previous read: address, value and hart
+    uint32_t value;
+    unsigned hart;
+    int last;                   // Type of the previous read (REPLAY_READ or REPLAY_CSR)
+    uint64_t repeats;           // Repeats of the previous read not yet written, or not yet replayed
+    uint32_t csr;               // Previous CSR value
+};
+
+// Control event of a log being replayed
+struct replay_control_t {
+    int type;                   // REPLAY_IRQ, REPLAY_SLICE or REPLAY_END
+    unsigned hart;
+    uint64_t instret;           // Instruction count at which it is due (IRQ and SLICE)
+    uint32_t irq;               // Interrupt number (IRQ)
+    int rc;                     // Return code (END)
+    std::vector<uint64_t> instrets; // Instructions of each hart (END)
+    bool complete;              // END: false when the log stops short (the recording crashed)
+};
+
+// Log of the nondeterministic inputs of a run: device register reads, device-fed CSRs,
+// block device transfers, interrupts and the turns of the harts. Recording writes the events
+// as the cores and devices report them; replaying loads the whole log and hands the inputs
+// back in the same order, throwing as soon as the guest asks for something else.
+class ReplayLog {
+    private:
+        std::string path;
+        bool replay;                // Replaying (else recording)
+        FILE *f;                    // File being recorded
+        std::vector<uint8_t> data;  // Events not yet written (recording), or all of them (replaying)
+        unsigned nharts;
+        replay_cursor_t cur;        // Encoder state, or the next event to replay
+        bool peeked;                // control holds the next control event
+        replay_control_t control;
+        size_t control_pos;         // Offset of that event
+        replay_cursor_t control_cur;    // Cursor after it
+        bool repeatable;            // The previous event recorded was a read
+        uint64_t events;
+        uint64_t bytes;             // Bytes written (recording)
+        bool failed;                // A write failed (reported by finish())
+
+        // Encoding
+        void put_event(int type, unsigned hart);
+        void put_repeats();
+        void put_varint(uint64_t value);
+        void put_delta(uint32_t from, uint32_t to);
+
+        // Write out buffered events once there are enough of them (or all of them)
+        void write_out(bool all);
+
+        // Decoding at a cursor (throw past the end of the log)
+        uint8_t get_byte(replay_cursor_t &c) const;
+        uint64_t get_varint(replay_cursor_t &c) const;
+        uint32_t get_delta(replay_cursor_t &c, uint32_t from) const;
+
+        // Move past the next event if it is an input of type for hart
+        bool take_input(int type, unsigned hart);
+
+        // Take a repeat of the previous read if one is due; it must be of type by hart
+        bool take_repeat(int type, unsigned hart);
+
+        // The next event, for messages
+        std::string describe() const;
+
+    public:
+        // Record to path, or replay from it; a replayed log must have been recorded for the same
+        // number of harts, program (image) and devices (throws otherwise or on error)
+        ReplayLog(const std::string &path, bool replay, unsigned nharts, uint64_t image, uint32_t flags);
+
+        // Destructor (writes what was recorded if finish() was not called)
+        ~ReplayLog();
+
+        bool replaying() const { return replay; }
+
+        // Device register read by a hart (the device is not called when replaying)
+        void log_read(unsigned hart, uint32_t address, uint32_t value);
+        uint32_t replay_read(unsigned hart, uint32_t address);
+
+        // CSR value read by a hart: logged when recording, the logged value when replaying
+        uint32_t csr(unsigned hart, uint32_t value);
+
+        // Block device command: the sectors it read into guest memory at address (none for a
+        // write or a failure) are logged, or written to memory again when replaying
+        void log_disk(Memory &mem, uint32_t address, uint32_t sectors);
+        uint32_t replay_disk(Memory &mem); // Returns the sectors written
+
+        // Interrupt taken by a hart after instret instructions
+        void log_interrupt(unsigned hart, uint64_t instret, uint32_t irq);
+
+        // A hart's turn, which ends once it has retired instret instructions
+        void log_slice(unsigned hart, uint64_t instret);
+
+        // Record the end of the run and close the file (throws if a write failed)
+        void finish(int rc, const std::vector<Core*> &harts);
+
+        // Next control event, past the inputs before it (replaying)
+        const replay_control_t &next_control();
+
+        // Move past the control event returned by next_control(); every input before it must
+        // have been taken
+        void take_control();
+
+        // Position of the next event, to replay from there again
+        const replay_cursor_t &getCursor() const { return cur; }
+        void setCursor(const replay_cursor_t &c) { cur = c; peeked = false; }
+
+        // Report a replay that no longer matches the log: what happened instead
+        [[noreturn]] void diverged(const std::string &what) const;
+
+        uint64_t getEvents() const { return events; } // Events recorded
+        uint64_t getBytes() const { return bytes; } // File size (recording)
+};
+
+// Hash of a program's initial memory and entry point, to match logs to programs
+uint64_t replay_image(Memory &mem, xlen_t entry);
+
+// Run core until it has retired exactly instret instructions (returns 0) or it stops
+int run_exact(Core &core, uint64_t instret);
+
+// State of a single-hart replay at a snapshot
+struct ReplaySnapshot {
+    core_state_t core;
+    std::vector<uint32_t> pages;    // Guest pages holding nonzero data
+    std::vector<uint8_t> data;      // Their contents, back to back
+    replay_cursor_t cursor;
+    bool exited;                    // Device bus exit request
+    int exit_code;
+};
+
+// Runs a recorded program again from its log. The harts take their logged turns one at a
+// time on the calling thread, interrupts are taken at the instruction counts they were taken
+// at, and device reads return the logged values, so every run is the recorded one.
+//
+// With snapshots (single hart), the machine state is saved every interval instructions as
+// the replay first gets there; going back restores the last snapshot before the target
+// and replays forward to it, with the console muted for output already shown.
+class Replayer {
+    private:
+        std::vector<Core*> harts;
+        Memory *mem;
+        DeviceBus *bus;
+        Console *console;           // Muted while replaying what was already shown (or nullptr)
+        ReplayLog &log;
+        size_t hart;                // Hart of the current turn
+        uint64_t turn_end;          // Its instruction count at the end of the turn
+        bool ended;                 // The end of the log was reached
+        int end_rc;                 // Return code there
+        uint64_t interval;          // Instructions between snapshots (0: none)
+        std::vector<ReplaySnapshot> snapshots;  // By ascending instruction count
+        uint64_t shown;             // Most instructions replayed so far (hart 0)
+
+        // Save the state at hart 0's instruction count
+        void snapshot();
+
+        // Go back to a snapshot
+        void restore(const ReplaySnapshot &s);
+
+        // Is rc a stop for the debugger (a breakpoint or watchpoint of hart 0)?
+        bool debugger_stop(int rc) const;
+
+        // Run hart 0 to instret, stepping off a breakpoint it is stopped at first; returns 0
+        // there, or the code of an earlier stop
+        int run_to(uint64_t instret);
+
+    public:
+        // Replay harts (reset to the program's start) from log; snapshots need a single hart
+        Replayer(const std::vector<Core*> &harts, Memory *mem, DeviceBus *bus, Console *console,
+                 ReplayLog &log, uint64_t interval);
+
+        // Replay until the end of the log (returns the recorded return code, again on later
+        // calls), a breakpoint or watchpoint, or max_instrs more instructions of the current
+        // hart (returns 0)
+        int run(uint64_t max_instrs = UINT64_MAX);
+
+        // Go back to where hart 0 had retired one instruction fewer; false at the first snapshot
+        bool reverse_step();
+
+        // Go back to the last breakpoint or watchpoint stop of hart 0 (returns its code), or to
+        // the first snapshot if there is none (returns 0)
+        int reverse_continue();
+
+        // Bring hart 0 to instret instructions, before or after the current point (snapshots)
+        void seek(uint64_t instret);
+
+        bool atEnd() const { return ended; } // The whole log has been replayed
+        size_t getHart() const { return hart; } // Hart of the current turn (the one that stopped at the end)
+};
@@ -0,0 +1,102 @@
+#include "sampling.h"
+#include <math.h>
+#include <algorithm>
+#include <stdexcept>
+
+// Instructions executed per call to Core::run()
+#define SAMPLING_SLICE 1000000
+
+BbvWriter::BbvWriter(const std::string &path, uint64_t interval, uint64_t start) :
+    interval(interval), next(start + interval) {
+    f = fopen(path.c_str(), "w");
+    if (!f) {
+        throw std::runtime_error("Could not open BBV file: " + path);
+    }
+}
+
+BbvWriter::~BbvWriter() {
+    fclose(f);
+}
+
+void BbvWriter::emit(Core &core) {
+    counts.clear();
+    core.takeBlockCounts(counts);
+
+    // Number new blocks in address order, so that ids do not depend on hash order
+    std::vector<std::pair<xlen_t, uint64_t>> sorted(counts.begin(), counts.end());
+    std::sort(sorted.begin(), sorted.end());
+    fputc('T', f);
+    for (auto &entry : sorted) {
+        auto it = ids.emplace(entry.first, ids.size() + 1).first;
+        fprintf(f, ":%u:%lu ", it->second, entry.second);
+    }
+    fputc('\n', f);
+    next += interval;
+}
+
+void BbvWriter::finish(Core &core) {
+    if (core.getInstret() > next - interval) {
+        emit(core);
+    }
+}
+
+int run_functional(Core &core, uint64_t n, BbvWriter *bbv) {
+    uint64_t end = core.getInstret() + n;
+    int rc = 0;
+    while (rc == 0 && (!n || core.getInstret() < end)) {
+        if (bbv && core.getInstret() >= bbv->boundary()) {
+            bbv->emit(core);
+        }
+        uint64_t slice = SAMPLING_SLICE;
+        if (n) {
+            slice = std::min(slice, end - core.getInstret());
+        }
+        if (bbv) {
+            slice = std::min(slice, bbv->boundary() - core.getInstret());
+        }
+        rc = core.run(slice);
+    }
+    if (bbv && core.getInstret() >= bbv->boundary()) {
+        bbv->emit(core);
+    }
+    return rc;
+}
+
+int run_sampled(Core &core, const SamplingConfig &config, BbvWriter *bbv, SamplingResult &result) {
+    double sum = 0, sum_sq = 0;
+    result.samples = 0;
+    result.detailed = 0;
+
+    int rc = 0;
+    while (rc == 0) {
+        core.setDetailed(false);
+        rc = run_functional(core, config.period - config.warmup - config.window, bbv);
+        if (rc != 0) {
+            break;
+        }
+
+        // The models see every instruction, so these windows end exactly on count
+        core.setDetailed(true);
+        uint64_t start = core.getInstret();
+        rc = core.run(config.warmup);
+        uint64_t cycles = core.getCycles(), instret = core.getInstret();
+        if (rc == 0) {
+            rc = core.run(config.window);
+        }
+        result.detailed += core.getInstret() - start;
+        if (rc == 0) {
+            double cpi = (double)(core.getCycles() - cycles) / (core.getInstret() - instret);
+            sum += cpi;
+            sum_sq += cpi * cpi;
+            result.samples++;
+        }
+    }
+    core.setDetailed(true);
+
+    // Normal approximation of the sampling distribution of the mean
+    unsigned n = result.samples;
+    result.cpi = n ? sum / n : 0;
+    double variance = (n > 1) ? std::max(0.0, (sum_sq - n * result.cpi * result.cpi) / (n - 1)) : 0;
+    result.ci95 = (n > 1) ? 1.96 * sqrt(variance / n) : 0;
+    return rc;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "core.h"
+
+// Basic block vector output for SimPoint: one line per interval of retired instructions,
+// "T:id:count :id:count ...", with count the instructions retired in the block numbered id
+// (numbered from 1 in order of first appearance). Counts come from the translated blocks,
+// so instructions run through the models or by the interpreter engine are left out.
+class BbvWriter {
+    private:
+        FILE *f;
+        uint64_t interval;
+        uint64_t next;                                  // Instruction count ending the current interval
+        std::unordered_map<xlen_t, unsigned> ids;       // Block number by block address
+        std::unordered_map<xlen_t, uint64_t> counts;    // Scratch for Core::takeBlockCounts()
+
+    public:
+        // Start a file; intervals end every interval instructions from start (throws on error)
+        BbvWriter(const std::string &path, uint64_t interval, uint64_t start);
+
+        // Destructor
+        ~BbvWriter();
+
+        // Instruction count at which the current interval ends
+        uint64_t boundary() const { return next; }
+
+        // Write the current interval
+        void emit(Core &core);
+
+        // Write the last, partial interval, if it retired anything
+        void finish(Core &core);
+
+        // Number of distinct blocks seen
+        size_t blocks() const { return ids.size(); }
+};
+
+// Settings of sampled simulation: every period instructions, warmup instructions run
+// through the models unmeasured, then window instructions are measured
+struct SamplingConfig {
+    uint64_t period;
+    uint64_t warmup;
+    uint64_t window;
+};
+
+// CPI estimate of a sampled run
+struct SamplingResult {
+    unsigned samples;           // Complete measurement windows
+    double cpi;                 // Mean CPI of the windows
+    double ci95;                // Half-width of the 95% confidence interval of cpi
+    uint64_t detailed;          // Instructions run through the models
+};
+
+// Run with the core's engine until the program stops, or n instructions when n is
+// nonzero (engines may overshoot by a block); with a BBV writer, emits each interval
+// as it completes
+int run_functional(Core &core, uint64_t n, BbvWriter *bbv);
+
+// SMARTS-style systematic sampling: run functionally with the models idle, and
+// periodically run them for a warm-up and a measurement window. The models keep their
+// state across fast-forwards (no functional warming), so the warm-up must cover the
+// cache and predictor state the windows rely on. Runs until the program stops.
+int run_sampled(Core &core, const SamplingConfig &config, BbvWriter *bbv, SamplingResult &result);
@@ -0,0 +1,167 @@
+#include "stats.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Names of the instruction classes, indexed by uop_class_t
+static const char *const class_names[CLASS_COUNT] = {
+    "alu", "load", "store", "branch", "jump", "system"
+};
+
+HostCounter::HostCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+HostCounter::~HostCounter() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void HostCounter::start() {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+uint64_t HostCounter::stop() {
+    uint64_t count = 0;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+    return count;
+}
+
+long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+void print_stats(const RunStats &st, FILE *out) {
+    double mips = (st.wall_s > 0) ? st.instret / st.wall_s / 1e6 : 0;
+    fprintf(out, "------------------------------------------------\n");
+    fprintf(out, "Engine          : %s\n", st.engine.c_str());
+    fprintf(out, "Instructions    : %lu\n", st.instret);
+    fprintf(out, "Cycles          : %lu\n", st.cycles);
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        double pct = st.instret ? 100.0 * st.classes[c] / st.instret : 0;
+        fprintf(out, "  %-14s: %lu (%.1f%%)\n", class_names[c], st.classes[c], pct);
+    }
+    if (st.timing && st.instret) {
+        // CPI breakdown: one cycle per instruction, pipeline fill, then the stalls (per
+        // instruction the models saw, which is all of them unless sampled)
+        uint64_t stalled = 0;
+        for (int i = 0; i < STALL_COUNT; ++i) {
+            stalled += st.stalls[i];
+        }
+        if (st.sampled) {
+            fprintf(out, "CPI             : %.3f +/- %.3f (95%% confidence, %u samples, %.2f%% of instructions modelled)\n",
+                    (double)st.cycles / st.instret, st.cpi_ci95, st.samples, 100.0 * st.modelled / st.instret);
+        } else {
+            fprintf(out, "CPI             : %.3f\n", (double)st.cycles / st.instret);
+        }
+        fprintf(out, "  %-14s: %.3f\n", "base", 1.0);
+        if (!st.sampled) {
+            fprintf(out, "  %-14s: %.3f\n", "fill", (double)(st.cycles - st.instret - stalled) / st.instret);
+        }
+        for (int i = 0; i < STALL_COUNT; ++i) {
+            fprintf(out, "  %-14s: %.3f (%lu cycles)\n", stall_names[i],
+                    st.modelled ? (double)st.stalls[i] / st.modelled : 0.0, st.stalls[i]);
+        }
+    }
+    if (!st.caches.empty()) {
+        fprintf(out, "Caches          :    accesses      misses   miss%%   evictions  writebacks\n");
+        for (const CacheStats &c : st.caches) {
+            uint64_t accesses = c.reads + c.writes, misses = c.read_misses + c.write_misses;
+            fprintf(out, "  %-14s: %11lu %11lu %6.2f%% %11lu %11lu\n", c.name.c_str(), accesses, misses,
+                    accesses ? 100.0 * misses / accesses : 0.0, c.evictions, c.writebacks);
+        }
+    }
+    if (!st.bpred.empty()) {
+        const BranchStats &b = st.branches;
+        uint64_t misses = b.cond_misses + b.indirect_misses + b.return_misses;
+        fprintf(out, "Predictor       : %s, %.3f mispredictions per 1000 instructions\n", st.bpred.c_str(),
+                st.modelled ? 1000.0 * misses / st.modelled : 0.0);
+        fprintf(out, "  %-14s: %lu (%lu mispredicted, %.2f%%)\n", "conditional", b.cond, b.cond_misses,
+                b.cond ? 100.0 * b.cond_misses / b.cond : 0.0);
+        fprintf(out, "  %-14s: %lu (%lu mispredicted)\n", "indirect", b.indirect, b.indirect_misses);
+        fprintf(out, "  %-14s: %lu (%lu mispredicted)\n", "returns", b.returns, b.return_misses);
+        fprintf(out, "  %-14s: %lu\n", "jumps", b.jumps);
+        fprintf(out, "  %-14s: %lu\n", "btb misses", b.late);
+    }
+    fprintf(out, "Wall time       : %.3f s\n", st.wall_s);
+    fprintf(out, "Speed           : %.2f MIPS\n", mips);
+    if (st.host_instrs && st.instret) {
+        fprintf(out, "Host instr/instr: %.2f\n", (double)st.host_instrs / st.instret);
+    }
+    fprintf(out, "Peak RSS        : %ld KiB\n", st.peak_rss_kb);
+    fprintf(out, "------------------------------------------------\n");
+}
+
+bool write_stats_json(const RunStats &st, const std::string &path) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    double mips = (st.wall_s > 0) ? st.instret / st.wall_s / 1e6 : 0;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"engine\": \"%s\",\n", st.engine.c_str());
+    fprintf(f, "  \"instret\": %lu,\n", st.instret);
+    fprintf(f, "  \"cycles\": %lu,\n", st.cycles);
+    fprintf(f, "  \"classes\": {");
+    for (int c = 0; c < CLASS_COUNT; ++c) {
+        fprintf(f, "%s\"%s\": %lu", c ? ", " : "", class_names[c], st.classes[c]);
+    }
+    fprintf(f, "},\n");
+    if (st.timing) {
+        fprintf(f, "  \"cpi\": %.6f,\n", st.instret ? (double)st.cycles / st.instret : 0);
+        if (st.sampled) {
+            fprintf(f, "  \"sampling\": {\"samples\": %u, \"cpi_ci95\": %.6f, \"modelled\": %lu},\n",
+                    st.samples, st.cpi_ci95, st.modelled);
+        }
+        fprintf(f, "  \"stalls\": {");
+        for (int i = 0; i < STALL_COUNT; ++i) {
+            fprintf(f, "%s\"%s\": %lu", i ? ", " : "", stall_names[i], st.stalls[i]);
+        }
+        fprintf(f, "},\n");
+    }
+    if (!st.caches.empty()) {
+        fprintf(f, "  \"caches\": {\n");
+        for (size_t i = 0; i < st.caches.size(); ++i) {
+            const CacheStats &c = st.caches[i];
+            fprintf(f, "    \"%s\": {\"reads\": %lu, \"writes\": %lu, \"read_misses\": %lu, \"write_misses\": %lu, "
+                    "\"evictions\": %lu, \"writebacks\": %lu}%s\n", c.name.c_str(), c.reads, c.writes,
+                    c.read_misses, c.write_misses, c.evictions, c.writebacks, (i + 1 < st.caches.size()) ? "," : "");
+        }
+        fprintf(f, "  },\n");
+    }
+    if (!st.bpred.empty()) {
+        const BranchStats &b = st.branches;
+        fprintf(f, "  \"branches\": {\"predictor\": \"%s\", \"conditional\": %lu, \"conditional_misses\": %lu, "
+                "\"indirect\": %lu, \"indirect_misses\": %lu, \"returns\": %lu, \"return_misses\": %lu, "
+                "\"jumps\": %lu, \"btb_misses\": %lu},\n", st.bpred.c_str(), b.cond, b.cond_misses,
+                b.indirect, b.indirect_misses, b.returns, b.return_misses, b.jumps, b.late);
+    }
+    fprintf(f, "  \"wall_s\": %.6f,\n", st.wall_s);
+    fprintf(f, "  \"mips\": %.3f,\n", mips);
+    fprintf(f, "  \"host_instrs\": %lu,\n", st.host_instrs);
+    fprintf(f, "  \"peak_rss_kb\": %ld\n", st.peak_rss_kb);
+    fprintf(f, "}\n");
+    return fclose(f) == 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "decode.h"
+#include "timing.h"
+#include "cache.h"
+#include "bpred.h"
+
+// Summary of one simulation run
+struct RunStats {
+    std::string engine;                 // Engine name
+    uint64_t instret;                   // Retired instructions
+    uint64_t cycles;                    // Simulated cycles
+    uint64_t classes[CLASS_COUNT];      // Retired instructions by class
+    bool timing;                        // Cycles come from the pipeline model
+    uint64_t modelled;                  // Instructions run through the models (all of them unless sampled)
+    bool sampled;                       // Cycles extrapolated from sampled windows
+    unsigned samples;                   // Complete measurement windows
+    double cpi_ci95;                    // Half-width of the 95% confidence interval of the sampled CPI
+    uint64_t stalls[STALL_COUNT];       // Stall cycles by cause (timing model only)
+    std::vector<CacheStats> caches;     // Cache levels, all harts summed (cache model only)
+    std::string bpred;                  // Branch predictor ("": none)
+    BranchStats branches;               // Control transfers, all harts summed (branch predictor only)
+    double wall_s;                      // Wall-clock time of the run
+    uint64_t host_instrs;               // Host instructions executed (0 if unavailable)
+    long peak_rss_kb;                   // Peak resident set size of the process
+};
+
+// Host instruction counter (hardware performance counters, where the host allows it)
+class HostCounter {
+    private:
+        int fd;     // perf event, or -1
+
+    public:
+        // Constructor
+        HostCounter();
+
+        // Destructor
+        ~HostCounter();
+
+        // Start counting from zero
+        void start();
+
+        // Stop counting and return the count (0 if unavailable)
+        uint64_t stop();
+};
+
+// Peak resident set size of the process in KiB
+long peak_rss_kb();
+
+// Print a human-readable summary
+void print_stats(const RunStats &st, FILE *out);
+
+// Write the summary as a JSON object; returns false if the file cannot be written
+bool write_stats_json(const RunStats &st, const std::string &path);
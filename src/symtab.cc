@@ -0,0 +1,57 @@
+#include "symtab.h"
+#include <algorithm>
+
+void SymbolTable::add(const std::string &name, xlen_t addr, uint32_t size, bool func) {
+    syms.push_back({name, addr, size, func});
+}
+
+void SymbolTable::finalize() {
+    // Sized symbols first at equal addresses so lookups prefer them over plain labels
+    std::sort(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) {
+        if (a.addr != b.addr) return a.addr < b.addr;
+        if (a.size != b.size) return a.size > b.size;
+        return a.name < b.name;
+    });
+    syms.erase(std::unique(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) {
+        return a.addr == b.addr && a.name == b.name;
+    }), syms.end());
+}
+
+const Symbol *SymbolTable::lookup(xlen_t addr) const {
+    // Last symbol starting at or below addr
+    auto it = std::upper_bound(syms.begin(), syms.end(), addr, [](xlen_t a, const Symbol &s) {
+        return a < s.addr;
+    });
+    if (it == syms.begin()) {
+        return nullptr;
+    }
+    xlen_t start = (it - 1)->addr;
+    while (it != syms.begin() && (it - 1)->addr == start) {
+        --it;
+    }
+    return &*it;
+}
+
+const Symbol *SymbolTable::lookup_func(xlen_t addr) const {
+    auto it = std::upper_bound(syms.begin(), syms.end(), addr, [](xlen_t a, const Symbol &s) {
+        return a < s.addr;
+    });
+    const Symbol *found = nullptr;
+    while (it != syms.begin() && (!found || (it - 1)->addr == found->addr)) {
+        --it;
+        if (it->func) {
+            found = &*it; // Keep going: the first of several at this address is preferred
+        }
+    }
+    return found;
+}
+
+bool SymbolTable::find(const std::string &name, xlen_t &addr) const {
+    for (const Symbol &s : syms) {
+        if (s.name == name) {
+            addr = s.addr;
+            return true;
+        }
+    }
+    return false;
+}
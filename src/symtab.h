@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "defs.h"
+
+// Symbol read from a program image
+struct Symbol {
+    std::string name;
+    xlen_t addr;
+    uint32_t size;
+    bool func;      // STT_FUNC (or a label in .text) rather than data
+};
+
+// Program symbols sorted by address, for the profiler and debugger
+class SymbolTable {
+    private:
+        std::vector<Symbol> syms;   // Sorted by address once finalized
+
+    public:
+        // Add a symbol (call finalize() once all are added)
+        void add(const std::string &name, xlen_t addr, uint32_t size, bool func);
+
+        // Sort symbols by address and drop duplicates
+        void finalize();
+
+        // Symbol containing addr, or the closest one below it; nullptr if none
+        const Symbol *lookup(xlen_t addr) const;
+
+        // Function symbol containing addr, or the closest one below it; nullptr if none
+        const Symbol *lookup_func(xlen_t addr) const;
+
+        // Address of the named symbol; returns false if not found
+        bool find(const std::string &name, xlen_t &addr) const;
+
+        // Number of symbols
+        size_t size() const { return syms.size(); }
+
+        // Drop all symbols
+        void clear() { syms.clear(); }
+};
@@ -0,0 +1,157 @@
+#include "timing.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <stdexcept>
+
+const char *const stall_names[STALL_COUNT] = {
+    "load_use", "data", "unit", "control", "system", "icache", "dcache"
+};
+
+void PipelineConfig::parse(const std::string &settings) {
+    struct { const char *key; unsigned *value; } fields[] = {
+        {"alu", &alu}, {"shift", &shift}, {"mem", &mem}, {"amo", &amo},
+        {"branch", &branch}, {"jal", &jal}, {"jalr", &jalr}, {"system", &system}
+    };
+    size_t pos = 0;
+    while (pos < settings.size()) {
+        size_t end = settings.find(',', pos);
+        if (end == std::string::npos) {
+            end = settings.size();
+        }
+        std::string item = settings.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty()) {
+            continue;
+        }
+
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        char *rest = nullptr;
+        long value = (eq == std::string::npos) ? -1 : strtol(item.c_str() + eq + 1, &rest, 0);
+        if (value < 0 || value > 1000 || (rest && *rest) || eq + 1 == item.size()) {
+            throw std::runtime_error("Invalid timing setting: " + item);
+        }
+        bool found = false;
+        for (auto &f : fields) {
+            if (key == f.key) {
+                *f.value = value;
+                found = true;
+            }
+        }
+        if (!found) {
+            throw std::runtime_error("Unknown timing setting: " + key);
+        }
+    }
+    if (alu == 0 || shift == 0 || mem == 0) {
+        throw std::runtime_error("Unit latencies must be at least 1 cycle");
+    }
+}
+
+// Registers used by an operation (the decoder fills rd, rs1 and rs2 from their fields whatever the format)
+static bool reads_rs1(int op) {
+    return !(op == OP_LUI || op == OP_AUIPC || op == OP_JAL || op <= OP_FENCE_I || (op >= OP_CSRRWI && op <= OP_CSRRCI));
+}
+static bool reads_rs2(int op) {
+    return (op >= OP_BEQ && op <= OP_BGEU) || uop_is_store(op) || (uop_is_atomic(op) && op != OP_LR_W) ||
+           (op >= OP_ADD && op <= OP_AND);
+}
+
+Pipeline::Pipeline(const PipelineConfig &config) : config(config) {
+    now = 0;
+    unit_free = 0;
+    unit_hit_free = 0;
+    for (int i = 0; i < 33; ++i) {
+        ready[i] = 0;
+        from_load[i] = false;
+    }
+    penalty = 0;
+    penalty_cause = STALL_CONTROL;
+    retired = 0;
+    for (int i = 0; i < STALL_COUNT; ++i) {
+        stalls[i] = 0;
+    }
+}
+
+void Pipeline::retire(const uop_t &u, xlen_t pc_next, unsigned fetch_miss, unsigned data_miss,
+                      bp_result_t prediction) {
+    int op = u.op;
+
+    // Earliest cycle: right behind the previous instruction, after any fetch redirect
+    uint64_t t = now + 1 + penalty;
+    stalls[penalty_cause] += penalty;
+    penalty = 0;
+    t += fetch_miss;
+    stalls[STALL_ICACHE] += fetch_miss;
+
+    // A multi-cycle operation ahead still holds EX or MEM (longer if it missed the cache)
+    if (unit_free > t) {
+        uint64_t hit = std::max(t, std::min(unit_hit_free, unit_free));
+        stalls[STALL_UNIT] += hit - t;
+        stalls[STALL_DCACHE] += unit_free - hit;
+        t = unit_free;
+    }
+
+    // Wait for the sources (forwarded as soon as they are produced)
+    uint64_t need = 0;
+    bool load = false;
+    if (reads_rs1(op) && ready[u.rs1] > need) {
+        need = ready[u.rs1];
+        load = from_load[u.rs1];
+    }
+    if (reads_rs2(op) && ready[u.rs2] > need) {
+        need = ready[u.rs2];
+        load = from_load[u.rs2];
+    }
+    if (need > t) {
+        stalls[load ? STALL_LOAD_USE : STALL_DATA] += need - t;
+        t = need;
+    }
+
+    // Result latency and stage occupancy
+    unsigned ex = 1, mem = 1;
+    uint64_t result = t + 1;
+    bool is_load = false;
+    switch (uop_class(op)) {
+        case CLASS_ALU:
+            ex = (op == OP_SLL || op == OP_SRL || op == OP_SRA || op == OP_SLLI || op == OP_SRLI || op == OP_SRAI) ?
+                 config.shift : config.alu;
+            result = t + ex;
+            break;
+        case CLASS_LOAD:
+        case CLASS_STORE:
+            mem = config.mem + (uop_is_atomic(op) && op != OP_LR_W ? config.amo : 0) + data_miss;
+            result = t + 1 + mem; // Out of MEM
+            is_load = true;
+            break;
+        default:
+            break;
+    }
+    unit_free = t + std::max(ex, mem);
+    unit_hit_free = t + std::max(ex, mem - data_miss);
+    if (uop_writes_rd(op)) {
+        ready[u.rd] = result; // x0 is REG_SINK here, never read back
+        from_load[u.rd] = is_load;
+    }
+
+    // Redirects
+    if (uop_runs_alone(op)) {
+        penalty = config.system;
+        penalty_cause = STALL_SYSTEM;
+    } else if (prediction != BP_NONE) {
+        penalty = (prediction == BP_LATE) ? config.jal :
+                  (prediction == BP_MISS) ? (op == OP_JALR ? config.jalr : config.branch) : 0;
+        penalty_cause = STALL_CONTROL;
+    } else if (op == OP_JAL) {
+        penalty = config.jal;
+        penalty_cause = STALL_CONTROL;
+    } else if (op == OP_JALR) {
+        penalty = config.jalr;
+        penalty_cause = STALL_CONTROL;
+    } else if (op >= OP_BEQ && op <= OP_BGEU && pc_next != u.pc + 4) {
+        penalty = config.branch;
+        penalty_cause = STALL_CONTROL;
+    }
+
+    now = t;
+    retired++;
+}
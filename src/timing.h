@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "decode.h"
+#include "bpred.h"
+
+// Stages of the modelled pipeline: IF ID EX MEM WB
+#define PIPE_DEPTH 5
+
+// Latencies and penalties of the pipeline model, in cycles
+struct PipelineConfig {
+    unsigned alu = 1;       // EX latency of arithmetic, logic and compare operations
+    unsigned shift = 1;     // EX latency of shifts
+    unsigned mem = 1;       // MEM latency of loads, stores and atomics
+    unsigned amo = 2;       // Extra MEM cycles of an atomic read-modify-write
+    unsigned branch = 2;    // Mispredicted conditional branch (resolved in EX); without a predictor, any taken one
+    unsigned jal = 1;       // Jump or taken branch redirected from ID (without a predictor, every JAL)
+    unsigned jalr = 2;      // Mispredicted JALR (target known in EX); without a predictor, every JALR
+    unsigned system = 4;    // Pipeline drain around CSR accesses, traps, MRET, WFI and FENCE.I
+
+    // Apply comma-separated key=value settings, e.g. "mem=3,branch=3"; throws on bad input
+    void parse(const std::string &settings);
+};
+
+// Causes of cycles beyond one per instruction
+enum stall_t {
+    STALL_LOAD_USE, // Waiting for a load result
+    STALL_DATA,     // Waiting for another multi-cycle result
+    STALL_UNIT,     // A multi-cycle operation ahead occupies EX or MEM
+    STALL_CONTROL,  // Fetch redirected by a taken branch or a jump
+    STALL_SYSTEM,   // Pipeline drained around a system operation
+    STALL_ICACHE,   // Instruction cache miss
+    STALL_DCACHE,   // Data cache miss holding MEM
+    STALL_COUNT
+};
+
+// Names of the stall causes, indexed by stall_t
+extern const char *const stall_names[STALL_COUNT];
+
+// Cycle-approximate model of a 5-stage in-order pipeline with full forwarding. It is fed
+// the retired instruction stream and times each instruction by the cycle it enters EX:
+// one cycle after its predecessor, later if a source register is not ready yet, a
+// multi-cycle operation ahead still holds EX or MEM, or fetch was redirected.
+class Pipeline {
+    private:
+        PipelineConfig config;
+        uint64_t now;                   // Cycle the last instruction entered EX
+        uint64_t unit_free;             // First cycle the next instruction can enter EX
+        uint64_t unit_hit_free;         // The same, had the last data access hit the cache
+        uint64_t ready[33];             // Cycle each register's value can be forwarded
+        bool from_load[33];             // The pending value comes from a load
+        unsigned penalty;               // Redirect penalty for the next instruction
+        stall_t penalty_cause;
+        uint64_t retired;
+        uint64_t stalls[STALL_COUNT];
+
+    public:
+        Pipeline(const PipelineConfig &config);
+
+        // Time one retired instruction; pc_next is the address of the next one. fetch_miss
+        // and data_miss are the cycles its cache accesses took beyond a hit; prediction is
+        // how the branch predictor fared on it (BP_NONE: predict not taken).
+        void retire(const uop_t &u, xlen_t pc_next, unsigned fetch_miss = 0, unsigned data_miss = 0,
+                    bp_result_t prediction = BP_NONE);
+
+        // Cycles to run everything retired so far, including filling the pipeline
+        uint64_t getCycles() const { return retired ? now + PIPE_DEPTH - 1 : 0; }
+
+        // Stall cycles by cause
+        void getStalls(uint64_t out[STALL_COUNT]) const {
+            for (int i = 0; i < STALL_COUNT; ++i) {
+                out[i] = stalls[i];
+            }
+        }
+};
@@ -0,0 +1,393 @@
+#include "trace.h"
+#include "decode.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+// Entries of the per-chunk table of instruction words (must be a power of 2)
+#define TRACE_INSN_TABLE 4096
+
+// Empty entry of the instruction table (pc is never odd)
+#define TRACE_INSN_NONE (~0ull)
+
+// Largest encoded record: flags, pc, word, rd and value, address, data
+#define TRACE_RECORD_MAX (1 + 5 + 4 + 1 + 5 + 5 + 5)
+
+// Entries of the writer's cache of block code (must be a power of 2)
+#define TRACE_BLOCK_CACHE 4096
+
+// Words the writer takes from a ring before handing them back
+#define TRACE_DRAIN_WORDS 4096
+
+// Longest writer thread pause when no ring is full
+#define TRACE_IDLE_US 1000
+
+void TraceBuffer::refill() {
+    publish();
+    uint32_t *end = ring.data() + TRACE_RING_WORDS;
+    if (end - pos < TRACE_RECORD_WORDS) {
+        // Records never wrap: continue at the start of the ring
+        if (pos != end) {
+            *pos = TRACE_REC_WRAP;
+        }
+        lap += TRACE_RING_WORDS;
+        pos = ring.data();
+        publish();
+    }
+
+    uint64_t h = lap + (pos - ring.data());
+    uint64_t room = TRACE_RING_WORDS - (h - tail.load(std::memory_order_acquire));
+    if (room < TRACE_RECORD_WORDS) {
+        writer->notify_full();
+        while ((room = TRACE_RING_WORDS - (h - tail.load(std::memory_order_acquire))) < TRACE_RECORD_WORDS) {
+            std::this_thread::yield();
+        }
+    }
+    limit = pos + std::min<uint64_t>(std::min<uint64_t>(room, end - pos), TRACE_WINDOW_WORDS);
+}
+
+static uint8_t *put_varint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = value | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+// Signed differences as small unsigned numbers: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+static uint8_t *put_delta(uint8_t *out, uint32_t from, uint32_t to) {
+    int32_t delta = to - from;
+    return put_varint(out, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+}
+
+// Reads the encoded records of a chunk, throwing if they run past its end
+struct ChunkReader {
+    const uint8_t *p, *end;
+
+    uint8_t byte() {
+        if (p == end) {
+            throw std::runtime_error("Truncated trace chunk");
+        }
+        return *p++;
+    }
+
+    uint32_t varint() {
+        uint32_t value = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            uint8_t b = byte();
+            value |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Malformed trace chunk");
+    }
+
+    uint32_t delta(uint32_t from) {
+        uint32_t z = varint();
+        return from + ((z >> 1) ^ -(z & 1));
+    }
+};
+
+TraceWriter::TraceWriter(const std::string &path, unsigned nharts) :
+    path(path), full(false), stop(false), failed(false), records(0), bytes(0) {
+    f = fopen(path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("Could not open trace file: " + path);
+    }
+    trace_header_t header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.nharts = nharts;
+    failed = fwrite(&header, sizeof(header), 1, f) != 1;
+    bytes = sizeof(header);
+
+    for (unsigned i = 0; i < nharts; ++i) {
+        streams.emplace_back(new Stream(this));
+        Stream &s = *streams.back();
+        s.data.resize(TRACE_CHUNK_RECORDS * TRACE_RECORD_MAX);
+        s.insns.resize(TRACE_INSN_TABLE);
+        s.recent.assign(TRACE_BLOCK_CACHE, {1, nullptr}); // Never matches: pcs are even
+        flush(s, i); // Empty: just sets up the encoder state
+    }
+    thread = std::thread(&TraceWriter::run, this);
+}
+
+TraceWriter::~TraceWriter() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stop = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+    if (f) {
+        fclose(f);
+    }
+}
+
+// Record flags by operation, for an rd other than x0
+static const uint8_t op_flags[OP_COUNT] = {
+#define UOP_FLAGS(name) trace_flags(OP_##name, 0),
+    UOP_LIST(UOP_FLAGS)
+#undef UOP_FLAGS
+};
+
+// Record flags of an operation, less TRACE_JUMP and TRACE_INSN
+static uint8_t insn_flags(uint8_t op, uint8_t rd) {
+    return op_flags[op] & ~(rd == REG_SINK ? TRACE_WB : 0);
+}
+
+TraceWriter::Insn TraceWriter::decode_insn(uint32_t word, xlen_t pc) {
+    uop_t u;
+    decode(u, word, pc);
+    return Insn{word, u.op, u.rd, insn_flags(u.op, u.rd)};
+}
+
+void TraceWriter::encode(Stream &s, xlen_t pc, const Insn &in, const uint32_t *&values) {
+    uint8_t *out = s.data.data() + s.size;
+    uint64_t &insn = s.insns[(pc >> 2) & (TRACE_INSN_TABLE - 1)];
+    uint64_t tagged = (uint64_t)pc << 32 | in.word;
+    uint8_t flags = in.flags | (pc != s.pc_next ? TRACE_JUMP : 0) | (insn != tagged ? TRACE_INSN : 0);
+    *out++ = flags;
+
+    // Values come in the order address, rs2, rd
+    xlen_t address = (flags & (TRACE_LOAD | TRACE_STORE)) ? *values++ : 0;
+    xlen_t data = (flags & TRACE_STORE) ? *values++ : 0;
+    if (flags & TRACE_JUMP) {
+        out = put_delta(out, s.pc_next, pc);
+    }
+    if (flags & TRACE_INSN) {
+        memcpy(out, &in.word, 4); // Little-endian host
+        out += 4;
+        insn = tagged;
+    }
+    if (flags & TRACE_WB) {
+        xlen_t value = *values++;
+        *out++ = in.rd;
+        out = put_delta(out, s.regs[in.rd], value);
+        s.regs[in.rd] = value;
+    }
+    if (flags & (TRACE_LOAD | TRACE_STORE)) {
+        out = put_delta(out, s.address, address);
+        s.address = address;
+    }
+    if (flags & TRACE_STORE) {
+        out = put_varint(out, uop_is_store(in.op) ? data & (~0u >> (32 - 8 * uop_access_size(in.op))) : data);
+    }
+    s.size = out - s.data.data();
+    s.pc_next = pc + 4;
+    s.records++;
+}
+
+void TraceWriter::flush(Stream &s, uint32_t hart) {
+    if (s.records && !failed) {
+        trace_chunk_t chunk{hart, s.records, s.size};
+        failed = fwrite(&chunk, sizeof(chunk), 1, f) != 1 || fwrite(s.data.data(), 1, s.size, f) != s.size;
+        bytes += sizeof(chunk) + s.size;
+        records += s.records;
+    }
+    s.size = 0;
+    s.records = 0;
+    s.pc_next = 0;
+    memset(s.regs, 0, sizeof(s.regs));
+    s.address = 0;
+    std::fill(s.insns.begin(), s.insns.end(), TRACE_INSN_NONE);
+}
+
+uint64_t TraceWriter::take(Stream &s, uint32_t hart, uint64_t t) {
+    uint32_t index = t & (TRACE_RING_WORDS - 1);
+    const uint32_t *w = &s.buffer.ring[index];
+    const uint32_t *values;
+    switch (w[0] & 0xff) {
+        case TRACE_REC_WRAP:
+            return t + TRACE_RING_WORDS - index;
+
+        case TRACE_REC_CODE: {
+            std::vector<Insn> &code = s.blocks[w[1]];
+            code.resize(w[0] >> 8);
+            for (uint32_t k = 0; k < code.size(); ++k) {
+                code[k] = decode_insn(w[2 + k], w[1] + 4 * k);
+            }
+            s.recent[(w[1] >> 2) & (TRACE_BLOCK_CACHE - 1)] = {w[1], &code};
+            return t + 2 + code.size();
+        }
+
+        case TRACE_REC_INSN: {
+            // Keep the values the instruction's flags call for, as in a block
+            Insn in{w[2], (uint8_t)(w[0] >> 8), (uint8_t)(w[0] >> 16), 0};
+            in.flags = insn_flags(in.op, in.rd);
+            uint32_t kept[3], n = 0;
+            if (in.flags & (TRACE_LOAD | TRACE_STORE)) {
+                kept[n++] = w[3];
+            }
+            if (in.flags & TRACE_STORE) {
+                kept[n++] = w[4];
+            }
+            if (in.flags & TRACE_WB) {
+                kept[n++] = w[5];
+            }
+            values = kept;
+            encode(s, w[1], in, values);
+            if (s.records == TRACE_CHUNK_RECORDS) {
+                flush(s, hart);
+            }
+            return t + 6;
+        }
+
+        default: {
+            // A block: its code was recorded when it was translated
+            std::pair<xlen_t, const std::vector<Insn>*> &e = s.recent[(w[1] >> 2) & (TRACE_BLOCK_CACHE - 1)];
+            if (e.first != w[1]) {
+                e = {w[1], &s.blocks[w[1]]};
+            }
+            const Insn *code = e.second->data();
+            uint32_t n = w[0] >> 8;
+            values = w + 2;
+            for (uint32_t k = 0; k < n; ++k) {
+                encode(s, w[1] + 4 * k, code[k], values);
+                if (s.records == TRACE_CHUNK_RECORDS) {
+                    flush(s, hart);
+                }
+            }
+            return t + (values - w);
+        }
+    }
+}
+
+void TraceWriter::drain() {
+    for (size_t i = 0; i < streams.size(); ++i) {
+        Stream &s = *streams[i];
+        TraceBuffer &b = s.buffer;
+        uint64_t t = b.tail.load(std::memory_order_relaxed);
+        uint64_t h = b.head.load(std::memory_order_acquire);
+        uint64_t released = t;
+        while (t != h) {
+            t = take(s, i, t);
+            if (t - released >= TRACE_DRAIN_WORDS) {
+                b.tail.store(t, std::memory_order_release);
+                released = t;
+            }
+        }
+        b.tail.store(t, std::memory_order_release);
+    }
+}
+
+void TraceWriter::notify_full() {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        full = true;
+    }
+    wake.notify_one();
+}
+
+void TraceWriter::run() {
+    std::unique_lock<std::mutex> guard(mutex);
+    while (!stop) {
+        full = false;
+        guard.unlock();
+        drain();
+        guard.lock();
+        // Let the rings fill up unless a hart is already waiting
+        wake.wait_for(guard, std::chrono::microseconds(TRACE_IDLE_US), [&] { return full || stop; });
+    }
+}
+
+void TraceWriter::finish() {
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stop = true;
+    }
+    wake.notify_one();
+    thread.join();
+    drain(); // Recorded after the thread's last pass
+    for (size_t i = 0; i < streams.size(); ++i) {
+        flush(*streams[i], i);
+    }
+    failed |= fclose(f) != 0;
+    f = nullptr;
+    if (failed) {
+        throw std::runtime_error("Could not write trace file: " + path);
+    }
+}
+
+// Mnemonics by uop_id_t, e.g. AMOSWAP_W for amoswap.w
+static const char *const uop_names[OP_COUNT] = {
+#define UOP_NAME(name) #name,
+    UOP_LIST(UOP_NAME)
+#undef UOP_NAME
+};
+
+uint64_t print_trace(const std::string &path, FILE *out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        throw std::runtime_error("Could not open trace file: " + path);
+    }
+    std::unique_ptr<FILE, int (*)(FILE*)> guard(f, fclose);
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION) {
+        throw std::runtime_error("Not a trace file (or from another version): " + path);
+    }
+
+    uint64_t total = 0;
+    std::vector<uint8_t> data;
+    std::vector<uint64_t> insns(TRACE_INSN_TABLE);
+    trace_chunk_t chunk;
+    while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+        data.resize(chunk.size);
+        if (fread(data.data(), 1, chunk.size, f) != chunk.size) {
+            throw std::runtime_error("Truncated trace file: " + path);
+        }
+
+        // Same state as the encoder at the start of a chunk
+        ChunkReader in{data.data(), data.data() + data.size()};
+        xlen_t pc_next = 0, address = 0, regs[32] = {0};
+        std::fill(insns.begin(), insns.end(), TRACE_INSN_NONE);
+        for (uint32_t n = 0; n < chunk.records; ++n) {
+            uint8_t flags = in.byte();
+            xlen_t pc = (flags & TRACE_JUMP) ? in.delta(pc_next) : pc_next;
+            uint64_t &insn = insns[(pc >> 2) & (TRACE_INSN_TABLE - 1)];
+            if (flags & TRACE_INSN) {
+                uint32_t word = 0;
+                for (int i = 0; i < 4; ++i) {
+                    word |= (uint32_t)in.byte() << (8 * i);
+                }
+                insn = (uint64_t)pc << 32 | word;
+            } else if (insn >> 32 != pc) {
+                throw std::runtime_error("Malformed trace chunk");
+            }
+
+            uop_t u;
+            decode(u, (uint32_t)insn, pc);
+            char name[16];
+            size_t len = 0;
+            for (const char *c = uop_names[u.op]; *c && len < sizeof(name) - 1; ++c) {
+                name[len++] = (*c == '_') ? '.' : (*c | 0x20);
+            }
+            name[len] = '\0';
+            fprintf(out, "%u %08x %08x %-10s", chunk.hart, pc, (uint32_t)insn, name);
+
+            if (flags & TRACE_WB) {
+                uint8_t rd = in.byte() & 31;
+                regs[rd] = in.delta(regs[rd]);
+                fprintf(out, " x%u=%08x", rd, regs[rd]);
+            }
+            if (flags & (TRACE_LOAD | TRACE_STORE)) {
+                address = in.delta(address);
+                fprintf(out, " [%08x]", address);
+            }
+            if (flags & TRACE_STORE) {
+                fprintf(out, "=%08x", in.varint());
+            }
+            fputc('\n', out);
+            pc_next = pc + 4;
+        }
+        total += chunk.records;
+    }
+    return total;
+}
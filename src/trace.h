@@ -0,0 +1,230 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "defs.h"
+#include "decode.h"
+#include "block.h"
+
+// Trace file layout:
+//   trace_header_t
+//   chunks             trace_chunk_t followed by size bytes of encoded records
+// Each chunk holds consecutive instructions of one hart and decodes on its own: the
+// encoder state below starts over at every chunk. A record is encoded as a flag byte
+// (TRACE_*), then, when flagged:
+//   TRACE_JUMP     pc - (previous pc + 4), zigzag varint
+//   TRACE_INSN     instruction word, 4 bytes little-endian (else the word last seen at pc)
+//   TRACE_WB       rd byte, then value - previous value of rd, zigzag varint
+//   TRACE_LOAD/STORE  address - previous data address, zigzag varint
+//   TRACE_STORE    value stored, varint (the operand of an atomic)
+// Chunks of different harts are written in the order they fill up.
+#define TRACE_MAGIC     "PLRSTRCE"
+#define TRACE_VERSION   1
+
+struct trace_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t nharts;
+};
+
+struct trace_chunk_t {
+    uint32_t hart;
+    uint32_t records;
+    uint32_t size;              // Bytes of encoded records that follow
+};
+
+// Record flags
+#define TRACE_JUMP  0x01        // Not the instruction after the previous one
+#define TRACE_INSN  0x02        // Instruction word included
+#define TRACE_WB    0x04        // Register writeback
+#define TRACE_LOAD  0x08        // Memory read
+#define TRACE_STORE 0x10        // Memory write
+
+// Record flags of an operation, less TRACE_JUMP and TRACE_INSN
+constexpr uint8_t trace_flags(int op, int rd) {
+    return (uop_writes_rd(op) && rd != REG_SINK ? TRACE_WB : 0) |
+           (uop_class(op) == CLASS_LOAD || (uop_is_atomic(op) && op != OP_SC_W) ? TRACE_LOAD : 0) |
+           (uop_class(op) == CLASS_STORE ? TRACE_STORE : 0);
+}
+
+// Records from a hart to the writer thread are runs of 32-bit words, the kind in the low
+// byte of the first one:
+//   TRACE_REC_CODE | len << 8, pc, len instruction words    code of a translated block
+//   TRACE_REC_BLOCK | n << 8, pc, values                    first n instructions of that block retired
+//   TRACE_REC_INSN | op << 8 | rd << 16, pc, instruction word, address, rs2, rd
+//                                                           one interpreted instruction retired
+//   TRACE_REC_WRAP                                          the rest of the ring is unused
+// The values of each instruction of a block are its data address (TRACE_LOAD or TRACE_STORE),
+// the value of rs2 before execution (TRACE_STORE) and the value written to rd (TRACE_WB), in
+// that order; interpreted instructions always carry all three. The writer works out the
+// flags and expands blocks into instructions, to keep the hart's side short: engines store
+// values straight into the ring.
+#define TRACE_REC_CODE  1
+#define TRACE_REC_BLOCK 2
+#define TRACE_REC_INSN  3
+#define TRACE_REC_WRAP  4
+
+// Longest hart record (a block whose every instruction has all three values)
+#define TRACE_RECORD_WORDS (2 + 3 * BLOCK_MAX_LEN)
+
+// Words in a hart's ring buffer (must be a power of 2)
+#define TRACE_RING_WORDS (1u << 16)
+
+// Most words a hart writes before letting the writer see them
+#define TRACE_WINDOW_WORDS (1u << 14)
+
+// Records per chunk
+#define TRACE_CHUNK_RECORDS (1u << 16)
+
+// Single-producer single-consumer ring of records between a hart and the writer thread.
+// The hart writes at pos, up to limit, and publishes what it wrote when it asks for more
+// room; it waits when the ring is full, so nothing is dropped.
+class TraceWriter;
+class TraceBuffer {
+    friend class TraceWriter;
+
+    private:
+        TraceWriter *writer;
+        std::vector<uint32_t> ring;
+        uint64_t lap;                               // Words written before the current pass over the ring
+        alignas(64) std::atomic<uint64_t> head;     // Words published by the hart
+        alignas(64) std::atomic<uint64_t> tail;     // Words taken by the writer
+
+    public:
+        uint32_t *pos;      // Where the hart writes its next record
+        uint32_t *limit;    // End of the room it has
+
+        TraceBuffer(TraceWriter *writer) :
+            writer(writer), ring(TRACE_RING_WORDS), lap(0), head(0), tail(0), pos(ring.data()), limit(ring.data()) {}
+
+        // Publish what was written and make room for at least one more record, waking the
+        // writer and waiting for it if the ring is full
+        void refill();
+
+        // Let the writer see the records written so far
+        void publish() { head.store(lap + (pos - ring.data()), std::memory_order_release); }
+
+        // Room for one record (TRACE_RECORD_WORDS) at pos
+        uint32_t *reserve() {
+            if (limit - pos < TRACE_RECORD_WORDS) {
+                refill();
+            }
+            return pos;
+        }
+
+        // Record the code of a translated block (its first len uops retire)
+        void code(xlen_t pc, const uop_t *uops, uint32_t len) {
+            uint32_t *w = reserve();
+            w[0] = TRACE_REC_CODE | len << 8;
+            w[1] = pc;
+            for (uint32_t i = 0; i < len; ++i) {
+                w[2 + i] = uops[i].value;
+            }
+            pos = w + 2 + len;
+        }
+
+        // Record an interpreted instruction; address is its data address, data the value of
+        // rs2 before execution and result the value of rd after it
+        void insn(const uop_t &u, xlen_t address, xlen_t data, xlen_t result) {
+            uint32_t *w = reserve();
+            w[0] = TRACE_REC_INSN | u.op << 8 | u.rd << 16;
+            w[1] = u.pc;
+            w[2] = u.value;
+            w[3] = address;
+            w[4] = data;
+            w[5] = result;
+            pos = w + 6;
+            publish();
+        }
+};
+
+// Writes the instructions retired by a set of harts to a trace file. Harts append raw
+// records to their ring buffers; a background thread expands, encodes and writes them.
+class TraceWriter {
+    friend class TraceBuffer;
+
+    private:
+        // Decoded instruction, with the flags of its record less TRACE_JUMP and TRACE_INSN
+        struct Insn {
+            uint32_t word;
+            uint8_t op;
+            uint8_t rd;
+            uint8_t flags;
+        };
+
+        // Encoder state of a hart's current chunk
+        struct Stream {
+            Stream(TraceWriter *writer) : buffer(writer) {}
+
+            TraceBuffer buffer;
+            std::vector<uint8_t> data;      // Encoded records (room for a whole chunk)
+            uint32_t size;                  // Bytes used
+            uint32_t records;
+            xlen_t pc_next;
+            xlen_t regs[32];
+            xlen_t address;
+            std::vector<uint64_t> insns;    // Instruction word by pc, as pc << 32 | word
+            std::unordered_map<xlen_t, std::vector<Insn>> blocks;  // Code of the hart's blocks by pc (kept across chunks)
+            std::vector<std::pair<xlen_t, const std::vector<Insn>*>> recent; // Cache of blocks, direct-mapped by pc
+        };
+
+        FILE *f;
+        std::string path;
+        std::vector<std::unique_ptr<Stream>> streams;
+        std::thread thread;
+        std::mutex mutex;                   // Guards full and stop for wake
+        std::condition_variable wake;
+        bool full;                          // A hart waits for room in its ring
+        bool stop;
+        bool failed;                        // A write failed (reported by finish())
+        uint64_t records;
+        uint64_t bytes;
+
+        // Decode an instruction word fetched from pc
+        static Insn decode_insn(uint32_t word, xlen_t pc);
+
+        // Encode a retired instruction into a stream, taking its values
+        void encode(Stream &s, xlen_t pc, const Insn &in, const uint32_t *&values);
+
+        // Encode the records of a hart from its ring position t; returns the position after them
+        uint64_t take(Stream &s, uint32_t hart, uint64_t t);
+
+        // Write a stream's chunk and start the next one
+        void flush(Stream &s, uint32_t hart);
+
+        // Encode what the harts have recorded
+        void drain();
+
+        // Writer thread body
+        void run();
+
+        // Called by a hart whose ring is full
+        void notify_full();
+
+    public:
+        // Create the file and start the writer thread (throws on error)
+        TraceWriter(const std::string &path, unsigned nharts);
+
+        // Destructor (stops the thread if finish() was not called)
+        ~TraceWriter();
+
+        // Ring buffer of a hart
+        TraceBuffer *buffer(unsigned hart) { return &streams[hart]->buffer; }
+
+        // Write everything recorded and close the file (throws if a write failed)
+        void finish();
+
+        uint64_t getRecords() const { return records; } // Instructions written
+        uint64_t getBytes() const { return bytes; } // File size
+};
+
+// Print a trace file as text, one instruction per line; returns the number of records
+// (throws on a malformed file)
+uint64_t print_trace(const std::string &path, FILE *out);
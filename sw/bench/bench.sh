@@ -0,0 +1,94 @@
+#!/bin/bash
+# Run benchmark kernels under every execution engine and compare their speed
+# (MIPS) against the checked-in baseline.
+#
+# usage: bench.sh [--update] kernel.elf...
+#
+# Environment:
+#   POLARIS    simulator binary (default: polaris from PATH)
+#   ENGINES    engines to run (default: "interp block jit")
+#   REPEAT     runs per kernel and engine, the fastest is kept (default: 5)
+#   THRESHOLD  slowdown in percent reported as a regression (default: 15)
+#   BASELINE   baseline file (default: baseline.txt next to this script)
+#
+# A kernel checks its own result and exits with a non-zero code on a mismatch,
+# which is reported as FAIL, as is a run that writes no statistics. The script exits with status 1 on any failure or
+# regression.
+
+POLARIS=${POLARIS:-polaris}
+ENGINES=${ENGINES:-"interp block jit"}
+REPEAT=${REPEAT:-5}
+THRESHOLD=${THRESHOLD:-15}
+BASELINE=${BASELINE:-$(dirname "$0")/baseline.txt}
+
+update=0
+if [ "$1" = "--update" ]; then
+    update=1
+    shift
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [--update] kernel.elf..." >&2
+    exit 2
+fi
+
+json=$(mktemp)
+results=$(mktemp)
+trap 'rm -f "$json" "$results"' EXIT
+
+# Baseline MIPS for a kernel and engine, empty if there is none
+baseline_mips() {
+    [ -f "$BASELINE" ] && awk -v k="$1" -v e="$2" '$1 == k && $2 == e { print $3 }' "$BASELINE"
+}
+
+status=0
+printf "%-10s %-7s %12s %10s %10s %8s\n" "kernel" "engine" "instret" "MIPS" "baseline" "change"
+for elf in "$@"; do
+    kernel=$(basename "$elf" .elf)
+    for engine in $ENGINES; do
+        best=0
+        instret=0
+        failed=0
+        for ((i = 0; i < REPEAT; i++)); do
+            rm -f "$json" # A run that fails before writing it must not be scored from the last one
+            if ! "$POLARIS" -e "$engine" --console none --stats-json "$json" "$elf" > /dev/null 2>&1 || [ ! -s "$json" ]; then
+                failed=1
+                break
+            fi
+            mips=$(awk -F '[:,]' '/"mips"/ { print $2 + 0 }' "$json")
+            instret=$(awk -F '[:,]' '/"instret"/ { print $2 + 0 }' "$json")
+            best=$(awk -v a="$best" -v b="$mips" 'BEGIN { print (b > a) ? b : a }')
+        done
+        if [ $failed -ne 0 ]; then
+            printf "%-10s %-7s %12s %10s %10s %8s\n" "$kernel" "$engine" "-" "-" "-" "FAIL"
+            status=1
+            continue
+        fi
+        echo "$kernel $engine $best" >> "$results"
+
+        base=$(baseline_mips "$kernel" "$engine")
+        if [ -z "$base" ]; then
+            printf "%-10s %-7s %12s %10.2f %10s %8s\n" "$kernel" "$engine" "$instret" "$best" "-" "-"
+            continue
+        fi
+        change=$(awk -v a="$best" -v b="$base" 'BEGIN { printf "%+.1f%%", (a - b) * 100 / b }')
+        regressed=$(awk -v a="$best" -v b="$base" -v t="$THRESHOLD" 'BEGIN { print (a < b * (1 - t / 100)) }')
+        mark=""
+        if [ "$regressed" = "1" ]; then
+            mark="  REGRESSION"
+            status=1
+        fi
+        printf "%-10s %-7s %12s %10.2f %10.2f %8s%s\n" "$kernel" "$engine" "$instret" "$best" "$base" "$change" "$mark"
+    done
+done
+
+if [ $update -ne 0 ]; then
+    {
+        echo "# Benchmark baseline: kernel engine MIPS (best of $REPEAT runs)"
+        echo "# Host: $(uname -m), $(grep -m1 'model name' /proc/cpuinfo 2>/dev/null | cut -d: -f2 | sed 's/^ *//')"
+        echo "# Regenerate with: make bench-baseline"
+        cat "$results"
+    } > "$BASELINE"
+    echo "Baseline written to $BASELINE"
+fi
+
+exit $status
@@ -10,7 +10,7 @@ EXEC?= a.elf
 ################################################################################
 RVPREFIX := riscv64-unknown-elf
 CFLAGS += -Wall -O0
-CFLAGS += -march=rv32i -mabi=ilp32 -nostartfiles -ffreestanding
+CFLAGS += -march=rv32ia_zicsr -mabi=ilp32 -nostartfiles -ffreestanding
 LFLAGS := -T $(POLARIS_HOME)/sw/lib/link.ld 
 
 all: build
@@ -22,13 +22,11 @@ $(BUILD_DIR)/$(EXEC): $(SRCS)
 	mkdir -p $(BUILD_DIR)
 	$(RVPREFIX)-gcc $(CFLAGS) $^ -o $@ $(LFLAGS)
 	$(RVPREFIX)-objdump -dt $@ > $(basename $@).lst
-	$(RVPREFIX)-objcopy -O binary $@ $(basename $@).bin
-	xxd -e -c 4 $(basename $@).bin | awk '{print $$2}' > $(basename $@).hex
 
 .PHONY: run
 run: $(BUILD_DIR)/$(EXEC)
 	@echo "Running $(EXEC)"
-	polaris  $(basename $<).hex
+	polaris $<
 
 .PHONY: clean
 clean: